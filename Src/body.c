@@ -0,0 +1,196 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#include <dmfserver/body.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 先在内存中积累 body, 超过 mem_max 以后把已有的部分和后面的数据都写入临时文件
+typedef struct _body_spool_t {
+    req_body_sink_t sink;           // 必须是第一个成员
+    char *          mem;
+    size_t          cap;
+    size_t          len;            // 已经收到的字节数
+    size_t          mem_max;
+    size_t          limit;          // 0 表示不限制
+    int             fd;
+} body_spool_t;
+
+
+// 没有名字的临时文件, 内核不支持 O_TMPFILE 时创建以后马上删除
+int body_tmpfile()
+{
+    int fd = -1;
+
+#ifdef O_TMPFILE
+    fd = open(BODY_SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        return fd;
+#endif
+#ifdef _WIN32
+    FILE *fp = tmpfile();
+    if (fp != NULL)
+        fd = dup(fileno(fp));
+    if (fp != NULL)
+        fclose(fp);
+#else
+    char path[] = BODY_SPOOL_DIR "/dmfserver-body-XXXXXX";
+    fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+#endif
+    return fd;
+}
+
+
+int body_write(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static long body_spool_data(req_body_sink_t *sink, const char *data, size_t len)
+{
+    body_spool_t *s = (body_spool_t *)sink;
+    size_t cap;
+    char *mem;
+
+    if (s->limit > 0 && s->len + len > s->limit)
+        return -1;
+
+    if (s->fd < 0 && s->len + len > s->mem_max) {
+        if ((s->fd = body_tmpfile()) < 0)
+            return -1;
+        if (s->len > 0 && body_write(s->fd, s->mem, s->len) < 0)
+            return -1;
+        free(s->mem);
+        s->mem = NULL;
+        s->cap = 0;
+    }
+
+    if (s->fd >= 0) {
+        if (body_write(s->fd, data, len) < 0)
+            return -1;
+    } else {
+        if (s->len + len > s->cap) {
+            cap = s->cap == 0 ? 4096 : s->cap;
+            while (cap < s->len + len)
+                cap *= 2;
+            if (cap > s->mem_max)
+                cap = s->mem_max;
+            if ((mem = (char *)realloc(s->mem, cap + 1)) == NULL)
+                return -1;
+            s->mem = mem;
+            s->cap = cap;
+        }
+        memcpy(s->mem + s->len, data, len);
+    }
+    s->len += len;
+    return (long)len;
+}
+
+
+// 内存中的 body 交给 req->body, 由 request 负责释放, 和一次读入的 body 一样解析 multipart
+static int body_spool_end(req_body_sink_t *sink, request_t *req)
+{
+    body_spool_t *s = (body_spool_t *)sink;
+
+    req->body.length = s->len;
+    if (s->fd >= 0)
+        return lseek(s->fd, 0, SEEK_SET) < 0 ? -1 : 0;
+
+    if (s->mem == NULL && (s->mem = (char *)malloc(1)) == NULL)
+        return -1;
+    s->mem[s->len] = '\0';
+    req->body.body = s->mem;
+    s->mem = NULL;
+    req_parse_body(req);
+    return 0;
+}
+
+
+static void body_spool_free(req_body_sink_t *sink)
+{
+    body_spool_t *s = (body_spool_t *)sink;
+
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->mem);
+    free(s);
+}
+
+
+// expect 是 Content-Length, 不超过 mem_max 时一次分配好内存, 超过时直接写临时文件
+req_body_sink_t * body_spool_new(size_t expect, size_t mem_max, size_t limit)
+{
+    body_spool_t *s = (body_spool_t *)calloc(1, sizeof(body_spool_t));
+
+    if (s == NULL)
+        return NULL;
+    s->sink.on_data = body_spool_data;
+    s->sink.on_end = body_spool_end;
+    s->sink.on_free = body_spool_free;
+    s->mem_max = mem_max;
+    s->limit = limit;
+    s->fd = -1;
+
+    if (expect > mem_max) {
+        s->fd = body_tmpfile();
+    } else if (expect > 0) {
+        s->mem = (char *)malloc(expect + 1);
+        s->cap = expect;
+    }
+    if (s->fd < 0 && s->mem == NULL && expect > 0) {
+        free(s);
+        return NULL;
+    }
+    return &s->sink;
+}
+
+
+req_body_sink_t * body_spool(connection_tp conn, const request_t *req)
+{
+    const char *len = req_param(req, "Content-Length");
+    size_t limit = (size_t)g_server_conf_all._conf_server.upload_max * 1024 * 1024;
+
+    (void)conn;
+    return body_spool_new(len != NULL ? strtoul(len, NULL, 10) : 0, BODY_SPOOL_MEM, limit);
+}
+
+
+int body_spool_fd(const request_t *req)
+{
+    if (req->sink == NULL || req->sink->on_data != body_spool_data)
+        return -1;
+    return ((body_spool_t *)req->sink)->fd;
+}
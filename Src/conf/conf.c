@@ -18,16 +18,317 @@
 
    
 #include <dmfserver/conf/conf.h>
+#include <dmfserver/utility/dm_cpu.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 // conf 全局的配置变量
 server_cf_t g_server_conf_all;
 
 
+static void conf_parse_model(xmlNodePtr node)
+{
+    xmlChar *szKey;
+    xmlNodePtr curNode = node->children; // node 是model节点
+    while (curNode != NULL) {
+        szKey = xmlNodeGetContent(curNode);
+        if (!xmlStrcmp(curNode->name, (const xmlChar *)"host"))
+            strcpy(g_server_conf_all._conf_model.host, szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"port"))
+            g_server_conf_all._conf_model.port = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"username"))
+            strcpy(g_server_conf_all._conf_model.username, szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"password"))
+            strcpy(g_server_conf_all._conf_model.password, szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"database"))
+            strcpy(g_server_conf_all._conf_model.database, szKey);
+        xmlFree(szKey);
+        curNode = curNode->next;
+    }
+}
+
+
+// <mode> 的取值与 ServerMode 的名字相同
+static void conf_parse_mode(const char *mode)
+{
+    if (!strcmp(mode, "SimpleServer")) {
+        // 没有单独的 simple container, 用当前平台默认的 container
+#ifdef __linux__
+        g_server_conf_all._conf_server.mode = EpollServer;
+        printf("[Conf: Info] SimpleServer mode is served as EpollServer\n");
+#else
+        g_server_conf_all._conf_server.mode = IOCPServer;
+        printf("[Conf: Info] SimpleServer mode is served as IOCPServer\n");
+#endif
+    } else if (!strcmp(mode, "IOCPServer"))
+        g_server_conf_all._conf_server.mode = IOCPServer;
+    else if (!strcmp(mode, "SSLServer"))
+        g_server_conf_all._conf_server.mode = SSLServer;
+#ifdef __linux__
+    else if (!strcmp(mode, "EpollServer"))
+        g_server_conf_all._conf_server.mode = EpollServer;
+    else if (!strcmp(mode, "IoUringServer"))
+        g_server_conf_all._conf_server.mode = IoUringServer;
+#endif
+    else
+        printf("[Conf: Warn] unknown server mode %s, use default\n", mode);
+}
+
+
+// address 的写法: "unix:/run/dmf.sock" 是 unix socket, 带 ':' 的是 IPv6 (可以加 []), 其余是 IPv4
+static void conf_parse_address(conf_listener *ls, const char *address)
+{
+    size_t len;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        ls->family = CONF_LISTEN_UNIX;
+        snprintf(ls->address, sizeof(ls->address), "%s", address + 5);
+        return;
+    }
+    if (strchr(address, ':') == NULL) {
+        ls->family = CONF_LISTEN_INET;
+        snprintf(ls->address, sizeof(ls->address), "%s", strcmp(address, "*") == 0 ? "" : address);
+        return;
+    }
+    ls->family = CONF_LISTEN_INET6;
+    if (address[0] == '[') {
+        address++;
+        len = strcspn(address, "]");
+    } else {
+        len = strlen(address);
+    }
+    if (len >= sizeof(ls->address))
+        len = sizeof(ls->address) - 1;
+    memcpy(ls->address, address, len);
+    ls->address[len] = '\0';
+}
+
+
+static void conf_listener_default(conf_listener *ls, int port, int tls)
+{
+    memset(ls, 0, sizeof(conf_listener));
+    ls->family = CONF_LISTEN_INET;
+    ls->port = port;
+    ls->backlog = 1024;
+    ls->tls = tls;
+}
+
+
+static void conf_parse_listener(xmlNodePtr node)
+{
+    xmlChar *szKey;
+    xmlNodePtr curNode = node->children; // node 是listener节点
+    conf_listener *ls;
+
+    if (g_server_conf_all._conf_server.listener_num >= CONF_LISTEN_MAX) {
+        printf("[Conf: Warn] more than %d listeners, ignored\n", CONF_LISTEN_MAX);
+        return;
+    }
+    ls = &g_server_conf_all._conf_server.listeners[g_server_conf_all._conf_server.listener_num++];
+    conf_listener_default(ls, 0, 0);
+
+    while (curNode != NULL) {
+        szKey = xmlNodeGetContent(curNode);
+        if (!xmlStrcmp(curNode->name, (const xmlChar *)"address"))
+            conf_parse_address(ls, (const char *)szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"port"))
+            ls->port = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"backlog"))
+            ls->backlog = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"tls"))
+            ls->tls = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"defer_accept"))
+            ls->defer_accept = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"fastopen"))
+            ls->fastopen = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"rcvbuf"))
+            ls->rcvbuf = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"sndbuf"))
+            ls->sndbuf = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"busy_poll"))
+            ls->busy_poll = atoi(szKey);
+        xmlFree(szKey);
+        curNode = curNode->next;
+    }
+}
+
+
+static void conf_parse_server(xmlNodePtr node)
+{
+    xmlChar *szKey;
+    xmlNodePtr curNode = node->children; // node 是server节点
+    while (curNode != NULL) {
+        szKey = xmlNodeGetContent(curNode);
+        if (!xmlStrcmp(curNode->name, (const xmlChar *)"listen"))
+            g_server_conf_all._conf_server.port = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"listeners")) {
+            for (xmlNodePtr ls = curNode->children; ls != NULL; ls = ls->next)
+                if (!xmlStrcmp(ls->name, (const xmlChar *)"listener"))
+                    conf_parse_listener(ls);
+        }
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"reactors"))
+            g_server_conf_all._conf_server.reactor_num = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"multi_process"))
+            g_server_conf_all._conf_server.multi_process = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"workers"))
+            g_server_conf_all._conf_server.workers = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"daemon"))
+            g_server_conf_all._conf_server.daemon = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"mode"))
+            conf_parse_mode((const char *)szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"keepalive_requests"))
+            g_server_conf_all._conf_server.keepalive_requests = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"keepalive_timeout"))
+            g_server_conf_all._conf_server.keepalive_timeout = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"header_timeout"))
+            g_server_conf_all._conf_server.header_timeout = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"body_timeout"))
+            g_server_conf_all._conf_server.body_timeout = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"send_timeout"))
+            g_server_conf_all._conf_server.send_timeout = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"drain_timeout"))
+            g_server_conf_all._conf_server.drain_timeout = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"ktls"))
+            g_server_conf_all._conf_server.ktls = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"session_cache"))
+            g_server_conf_all._conf_server.session_cache = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"session_timeout"))
+            g_server_conf_all._conf_server.session_timeout = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"ticket_key_rotate"))
+            g_server_conf_all._conf_server.ticket_key_rotate = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"max_conns"))
+            g_server_conf_all._conf_server.max_conns = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"max_inflight"))
+            g_server_conf_all._conf_server.max_inflight = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"max_inflight_total"))
+            g_server_conf_all._conf_server.max_inflight_total = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"pool_queue"))
+            g_server_conf_all._conf_server.pool_queue = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"status_path"))
+            snprintf(g_server_conf_all._conf_server.status_path, sizeof(g_server_conf_all._conf_server.status_path), "%s", (const char *)szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"pool_threads"))
+            g_server_conf_all._conf_server.pool_threads = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"cpu_affinity"))
+            g_server_conf_all._conf_server.cpu_affinity = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"busy_spin"))
+            g_server_conf_all._conf_server.busy_spin = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"conn_batch"))
+            g_server_conf_all._conf_server.conn_batch = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"zerocopy_min"))
+            g_server_conf_all._conf_server.zerocopy_min = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"upload_max"))
+            g_server_conf_all._conf_server.upload_max = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"chunked_meta_max"))
+            g_server_conf_all._conf_server.chunked_meta_max = atoi(szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"io_cpus"))
+            snprintf(g_server_conf_all._conf_server.io_cpus, sizeof(g_server_conf_all._conf_server.io_cpus), "%s", (const char *)szKey);
+        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"pool_cpus"))
+            snprintf(g_server_conf_all._conf_server.pool_cpus, sizeof(g_server_conf_all._conf_server.pool_cpus), "%s", (const char *)szKey);
+        xmlFree(szKey);
+        curNode = curNode->next;
+    }
+}
+
+
+static void conf_set_default()
+{
+    g_server_conf_all._conf_server.port = 8080;
+    strcpy(g_server_conf_all._conf_server.host, "localhost");
+    strcpy(g_server_conf_all._conf_server.cert_public, "./cert/localhost.pem");
+    strcpy(g_server_conf_all._conf_server.cert_private, "./cert/localhost-key.pem");
+#ifdef __linux__
+    g_server_conf_all._conf_server.mode = EpollServer;
+#else
+    g_server_conf_all._conf_server.mode = IOCPServer;
+#endif
+    g_server_conf_all._conf_server.reactor_num = 0;
+    g_server_conf_all._conf_server.multi_process = 0;
+    g_server_conf_all._conf_server.workers = 0;
+    g_server_conf_all._conf_server.daemon = 0;
+    g_server_conf_all._conf_server.keepalive_requests = 100;
+    g_server_conf_all._conf_server.keepalive_timeout = 15;
+    g_server_conf_all._conf_server.header_timeout = 10;
+    g_server_conf_all._conf_server.body_timeout = 30;
+    g_server_conf_all._conf_server.send_timeout = 30;
+    g_server_conf_all._conf_server.drain_timeout = 30;
+    g_server_conf_all._conf_server.ktls = 0;
+    g_server_conf_all._conf_server.session_cache = 4096;
+    g_server_conf_all._conf_server.session_timeout = 300;
+    g_server_conf_all._conf_server.ticket_key_rotate = 3600;
+    g_server_conf_all._conf_server.max_conns = 0;
+    g_server_conf_all._conf_server.max_inflight = 0;
+    g_server_conf_all._conf_server.max_inflight_total = 0;
+    g_server_conf_all._conf_server.pool_queue = 1024;
+    g_server_conf_all._conf_server.status_path[0] = '\0';
+    g_server_conf_all._conf_server.pool_threads = 8;
+    g_server_conf_all._conf_server.cpu_affinity = 0;
+    g_server_conf_all._conf_server.io_cpus[0] = '\0';
+    g_server_conf_all._conf_server.pool_cpus[0] = '\0';
+    g_server_conf_all._conf_server.busy_spin = 0;
+    g_server_conf_all._conf_server.conn_batch = 16;
+    g_server_conf_all._conf_server.zerocopy_min = 0;
+    g_server_conf_all._conf_server.upload_max = 100;
+    g_server_conf_all._conf_server.chunked_meta_max = 8192;
+    g_server_conf_all._conf_server.listener_num = 0;
+
+    strcpy(g_server_conf_all._conf_router.static_dir, "static");
+}
+
+
+// 没有配置的值在这里补全
+static void conf_check()
+{
+    int cpus = 1;
+#ifdef __linux__
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0)
+        cpus = 1;
+
+    // 绑核时默认每个 io 核一个 reactor (或 worker)
+    if (g_server_conf_all._conf_server.cpu_affinity) {
+        dm_cpu_set_t io_set;
+        if (dm_cpu_parse(g_server_conf_all._conf_server.io_cpus, &io_set) > 0) {
+            cpus = io_set.num;
+        } else {
+            printf("[Conf: Warn] bad io_cpus \"%s\", cpu affinity disabled\n", g_server_conf_all._conf_server.io_cpus);
+            g_server_conf_all._conf_server.cpu_affinity = 0;
+        }
+    }
+#else
+    g_server_conf_all._conf_server.multi_process = 0;
+    g_server_conf_all._conf_server.cpu_affinity = 0;
+#endif
+
+    // 没有 <listeners> 时监听 <listen> 端口的所有 IPv4 地址, SSLServer 模式下使用 TLS
+    if (g_server_conf_all._conf_server.port <= 0)
+        g_server_conf_all._conf_server.port = 8080;
+    if (g_server_conf_all._conf_server.listener_num == 0) {
+        conf_listener_default(&g_server_conf_all._conf_server.listeners[0], 
+                g_server_conf_all._conf_server.port, 
+                g_server_conf_all._conf_server.mode == SSLServer);
+        g_server_conf_all._conf_server.listener_num = 1;
+    }
+
+    // 多进程模式下默认每个 cpu 核一个 worker, 每个 worker 一个 reactor
+    if (g_server_conf_all._conf_server.multi_process) {
+        if (g_server_conf_all._conf_server.workers <= 0)
+            g_server_conf_all._conf_server.workers = cpus;
+        if (g_server_conf_all._conf_server.reactor_num <= 0)
+            g_server_conf_all._conf_server.reactor_num = 1;
+    }
+
+    if (g_server_conf_all._conf_server.reactor_num <= 0)
+        g_server_conf_all._conf_server.reactor_num = cpus;
+}
+
+
 void conf_init()
 {
 
     printf("[Conf: Info] start confguring...\n");
 
+    conf_set_default();
+
     xmlKeepBlanksDefault(0);
     xmlDocPtr doc = xmlReadFile("./conf.xml", "gbk", XML_PARSE_NOBLANKS);
     if (doc != NULL) {
@@ -40,6 +341,7 @@ void conf_init()
     if (curNode == NULL) {
         printf("[Conf: Warn] doc is empty \n");
         xmlFreeDoc(doc);
+        conf_check();
         return;
     }
 
@@ -47,52 +349,25 @@ void conf_init()
     if (xmlStrcmp(curNode->name, BAD_CAST "dmfserver")) {
         printf("[Conf: Warn] root not dmfserver\n");
         xmlFreeDoc(doc);
+        conf_check();
         return;
     }
 
-    xmlChar *szKey;
     xmlNodePtr child;
     child = curNode->children;      // curNode 是根节点
                                     // child 是模块层
     while (child != NULL){
-        if (!xmlStrcmp(child->name, (const xmlChar *)"model")) {
-            // szKey = xmlNodeGetContent(child);
-            // printf("model: %s\n", szKey);
-            // xmlFree(szKey);
-            break;
-        }
+        if (!xmlStrcmp(child->name, (const xmlChar *)"model"))
+            conf_parse_model(child);
+        else if (!xmlStrcmp(child->name, (const xmlChar *)"server"))
+            conf_parse_server(child);
         child = child->next;
     }
 
-    curNode = child->children; // child 是model节点
-    while (curNode != NULL) {
-        szKey = xmlNodeGetContent(curNode);
-        if (!xmlStrcmp(curNode->name, (const xmlChar *)"host"))
-            strcpy(g_server_conf_all._conf_model.host, szKey);
-        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"port"))
-            g_server_conf_all._conf_model.port = atoi(szKey);
-        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"username"))
-            strcpy(g_server_conf_all._conf_model.username, szKey);
-        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"password"))
-            strcpy(g_server_conf_all._conf_model.password, szKey);
-        else if (!xmlStrcmp(curNode->name, (const xmlChar *)"database"))
-            strcpy(g_server_conf_all._conf_model.database, szKey);
-        else continue;
-        curNode = curNode->next;
-    }
-    xmlFree(szKey);
-
     xmlFreeDoc(doc);
 
-
-    g_server_conf_all._conf_server.port = 8080;
-    strcpy(g_server_conf_all._conf_server.host, "localhost");
-    strcpy(g_server_conf_all._conf_server.cert_public, "./cert/localhost.pem");
-    strcpy(g_server_conf_all._conf_server.cert_private, "./cert/localhost-key.pem");
-    g_server_conf_all._conf_server.mode = SimpleServer;
-
-    strcpy(g_server_conf_all._conf_router.static_dir, "static");
+    conf_check();
 
     printf("[Conf: Info] conf init successfully...\n");
     printf("\n");
-}
+}
\ No newline at end of file
@@ -19,38 +19,680 @@
 #include <dmfserver/common.h>
 
 #include <dmfserver/connection.h>
+#include <dmfserver/tls.h>
 #include <dmfserver/socket.h>
-#include <dmfserver/mpool.h>
 
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <dmfserver/container.h>
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
 #endif
 
-extern server_t g_server;
+// 连接对象按 cache line 对齐, 一次分配包含 handle, io 数据和 request
+static connection_tp
+connection_mem_alloc () {
+    size_t size = (sizeof(connection_t) + CONN_ALIGN - 1) & ~(size_t)(CONN_ALIGN - 1);
+#ifdef __WIN32__
+    return (connection_tp)_aligned_malloc(size, CONN_ALIGN);
+#else
+    return (connection_tp)aligned_alloc(CONN_ALIGN, size);
+#endif
+}
+
+static void
+connection_mem_free (connection_tp conn) {
+#ifdef __WIN32__
+    _aligned_free(conn);
+#else
+    free(conn);
+#endif
+}
 
-// 仅仅做分配工作
+// 把连接初始化成刚 accept 的状态
+static void
+connection_init (connection_tp conn_ptr, conn_slab_t * slab) {
+    conn_ptr->per_handle_data = &conn_ptr->handle_data;
+    conn_ptr->per_io_data = &conn_ptr->io_data;
+    conn_ptr->req = NULL;
+#ifdef __linux__
+    conn_ptr->per_handle_data->efd = -1;
+    conn_ptr->per_handle_data->reactor = NULL;
+#endif
+    conn_ptr->rbuf = NULL;
+    conn_ptr->rlen = 0;
+    conn_ptr->rcap = 0;
+    conn_ptr->keep_alive = 0;
+    conn_ptr->req_count = 0;
+    conn_ptr->sender = NULL;
+    conn_ptr->io_ctx = NULL;
+    dm_timer_node_init(&conn_ptr->timer, NULL, conn_ptr);
+    conn_ptr->timeout = CONN_TIMEOUT_NONE;
+    conn_ptr->out_head = NULL;
+    conn_ptr->out_tail = NULL;
+    conn_ptr->out_bytes = 0;
+    conn_ptr->read_paused = 0;
+    conn_ptr->read_eof = 0;
+    conn_ptr->closing = 0;
+    conn_ptr->zerocopy = 0;
+    conn_ptr->zc_copied = 0;
+    conn_ptr->zc_next = 0;
+    conn_ptr->zc_head = NULL;
+    conn_ptr->zc_tail = NULL;
+    conn_ptr->offloaded = 0;
+    conn_ptr->rpos = 0;
+    conn_ptr->done_next = NULL;
+    conn_ptr->inflight = 0;
+    conn_ptr->work = 0;
+    conn_ptr->ready = 0;
+    conn_ptr->ready_prev = NULL;
+    conn_ptr->ready_next = NULL;
+    conn_ptr->ssl = NULL;
+    conn_ptr->slab = slab;
+    conn_ptr->slab_prev = NULL;
+    conn_ptr->slab_next = NULL;
+}
+
+// 仅仅做分配工作, 不经过 slab 的连接一直带着 request
 extern connection_tp 
 new_connection () {
-    connection_tp conn_ptr = (connection_tp)malloc(sizeof(connection_t));
-#ifdef __SERVER_MPOOL__
-    conn_ptr->per_handle_data =  (per_handle_data_t*) pool_alloc (&g_server.pool_handle);
-    conn_ptr->per_io_data = (per_io_data_t*) pool_alloc (&g_server.pool_io);
-#else
-    conn_ptr->per_handle_data =  (per_handle_data_t*)malloc(sizeof(per_handle_data_t));
-    // 建立一个Overlapped，并使用这个Overlapped结构对socket投递操作
-    conn_ptr->per_io_data  =  (per_io_data_t*)malloc(sizeof(per_io_data_t));     
-#endif // __SERVER_MPOOL__
-    conn_ptr->req = (request_t*)malloc(sizeof(request_t));
-    
+    connection_tp conn_ptr = connection_mem_alloc();
+    if (conn_ptr == NULL)
+        return NULL;
+    connection_init(conn_ptr, NULL);
+    if (connection_req_attach(conn_ptr) == NULL) {
+        connection_mem_free(conn_ptr);
+        return NULL;
+    }
+    return conn_ptr;
+}
+
+
+extern void
+conn_slab_init (conn_slab_t * slab, size_t free_max) {
+    slab->free_list = NULL;
+    slab->free_num = 0;
+    slab->free_max = free_max;
+    slab->used = 0;
+    slab->used_list = NULL;
+    slab->req_free = NULL;
+    slab->req_num = 0;
+    slab->rbuf_free = NULL;
+    slab->rbuf_num = 0;
+}
+
+// 只释放空闲链表中的对象, 正在使用的连接由 container 关闭
+extern void
+conn_slab_destroy (conn_slab_t * slab) {
+    while (slab->free_list != NULL) {
+        connection_tp conn = slab->free_list;
+        slab->free_list = conn->slab_next;
+        connection_mem_free(conn);
+    }
+    slab->free_num = 0;
+
+    while (slab->req_free != NULL) {
+        request_t * req = slab->req_free;
+        slab->req_free = *(request_t **)req;
+        free(req);
+    }
+    slab->req_num = 0;
+
+    while (slab->rbuf_free != NULL) {
+        char * buf = slab->rbuf_free;
+        slab->rbuf_free = *(char **)buf;
+        free(buf);
+    }
+    slab->rbuf_num = 0;
+}
+
+// 优先复用空闲链表中的对象, 没有时才分配
+extern connection_tp
+conn_slab_acquire (conn_slab_t * slab) {
+    connection_tp conn_ptr = slab->free_list;
+    if (conn_ptr != NULL) {
+        slab->free_list = conn_ptr->slab_next;
+        slab->free_num--;
+    } else {
+        conn_ptr = connection_mem_alloc();
+        if (conn_ptr == NULL)
+            return NULL;
+    }
+    slab->used++;
+    connection_init(conn_ptr, slab);
+
+    conn_ptr->slab_next = slab->used_list;
+    if (slab->used_list != NULL)
+        slab->used_list->slab_prev = conn_ptr;
+    slab->used_list = conn_ptr;
     return conn_ptr;
 }
 
+// 处理请求之前挂上 request, 优先使用 slab 缓存的对象
+extern request_t *
+connection_req_attach (connection_tp conn) {
+    conn_slab_t * slab = conn->slab;
+    request_t * req = conn->req;
+
+    if (req != NULL)
+        return req;
+    if (slab != NULL && slab->req_free != NULL) {
+        req = slab->req_free;
+        slab->req_free = *(request_t **)req;
+        slab->req_num--;
+    } else {
+        req = (request_t *)malloc(sizeof(request_t));
+        if (req == NULL)
+            return NULL;
+    }
+    req_parse_init(req);
+    conn->req = req;
+    return req;
+}
+
+static void
+connection_req_release (connection_tp conn) {
+    conn_slab_t * slab = conn->slab;
+    request_t * req = conn->req;
+
+    if (req == NULL)
+        return;
+    conn->req = NULL;
+    req_free(req);
+    if (slab == NULL || slab->req_num >= slab->free_max) {
+        free(req);
+        return;
+    }
+    *(request_t **)req = slab->req_free;
+    slab->req_free = req;
+    slab->req_num++;
+}
+
+// 只有初始大小的读缓冲放回 slab, 扩大过的直接释放
+static void
+connection_rbuf_release (connection_tp conn) {
+    conn_slab_t * slab = conn->slab;
+
+    if (conn->rbuf == NULL)
+        return;
+    if (slab != NULL && conn->rcap == CONN_RBUF_INIT && slab->rbuf_num < slab->free_max) {
+        *(char **)conn->rbuf = slab->rbuf_free;
+        slab->rbuf_free = conn->rbuf;
+        slab->rbuf_num++;
+    } else {
+        free(conn->rbuf);
+    }
+    conn->rbuf = NULL;
+    conn->rlen = 0;
+    conn->rcap = 0;
+}
+
+// 读缓冲中没有剩下的数据, 也不在线程池中执行时, 交还 request 和读缓冲
+// 大量空闲的 keep-alive 连接只占连接对象本身, 下次有数据到达时再挂上
+extern void
+connection_idle (connection_tp conn) {
+    if (conn->rlen > 0 || conn->offloaded)
+        return;
+    connection_req_release(conn);
+    connection_rbuf_release(conn);
+}
+
+#ifdef __linux__
+// 保证读缓冲至少还有一个字节的空间, 超过 CONN_RBUF_MAX 时返回 -1
+static int
+connection_rbuf_reserve (connection_tp conn) {
+    conn_slab_t * slab = conn->slab;
+
+    if (conn->rlen < conn->rcap)
+        return 0;
+
+    if (conn->rcap == 0 && slab != NULL && slab->rbuf_free != NULL) {
+        conn->rbuf = slab->rbuf_free;
+        slab->rbuf_free = *(char **)conn->rbuf;
+        slab->rbuf_num--;
+        conn->rcap = CONN_RBUF_INIT;
+        return 0;
+    }
+
+    size_t cap = conn->rcap == 0 ? CONN_RBUF_INIT : conn->rcap * 2;
+    if (cap > CONN_RBUF_MAX)
+        cap = CONN_RBUF_MAX;
+    if (cap <= conn->rlen)
+        return -1;
+    char * buf = (char*)realloc(conn->rbuf, cap + 1);
+    if (buf == NULL)
+        return -1;
+    conn->rbuf = buf;
+    conn->rcap = cap;
+    return 0;
+}
+
+// 流式 body 的请求, 头部之后最多读入 CONN_BODY_WINDOW 字节, 消费者取走以后再继续读
+static size_t
+connection_read_limit (connection_tp conn) {
+    if (conn->req != NULL && conn->req->sink != NULL)
+        return conn->req->head_len + CONN_BODY_WINDOW;
+    return CONN_RBUF_MAX;
+}
+
+// 非阻塞 socket 上一直读到 EAGAIN (EPOLLET 要求), 数据追加到连接自己的读缓冲
+// 返回值: 1 读到了数据或暂无数据, 0 对端关闭, -1 出错或请求超过 CONN_RBUF_MAX,
+// 2 流式 body 的窗口满了, socket 中可能还有数据, 调用者要在消费者取走数据以后主动再读
+extern int
+connection_read (connection_tp conn) {
+    int fd = conn->per_handle_data->Socket;
+    size_t limit = connection_read_limit(conn);
+    size_t room;
+    ssize_t n;
+
+    for (;;) {
+        if (conn->rlen >= limit)
+            return 2;
+        if (connection_rbuf_reserve(conn) < 0)
+            return -1;
+
+        room = conn->rcap - conn->rlen;
+        if (room > limit - conn->rlen)
+            room = limit - conn->rlen;
+        if (conn->ssl != NULL) {
+            n = tls_recv(conn, conn->rbuf + conn->rlen, room);
+            if (n == TLS_IO_AGAIN)
+                return 1;
+            if (n < 0)
+                return -1;
+        } else {
+            n = recv(fd, conn->rbuf + conn->rlen, room, 0);
+        }
+        if (n > 0) {
+            conn->rlen += n;
+            conn->rbuf[conn->rlen] = '\0';
+            continue;
+        }
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        return -1;
+    }
+}
+
+// 把 container 已经收到的数据 (例如 io_uring 的 provided buffer) 追加到读缓冲
+extern int
+connection_append (connection_tp conn, const char * data, size_t len) {
+    while (len > 0) {
+        if (connection_rbuf_reserve(conn) < 0)
+            return -1;
+        size_t n = conn->rcap - conn->rlen;
+        if (n > len)
+            n = len;
+        memcpy(conn->rbuf + conn->rlen, data, n);
+        conn->rlen += n;
+        data += n;
+        len -= n;
+    }
+    conn->rbuf[conn->rlen] = '\0';
+    return 0;
+}
+
+// socket 已经是非阻塞的, 发送缓冲满时用 poll 等待可写, 保证数据全部发出
+extern int
+connection_send_all (connection_tp conn, const char * buf, size_t len) {
+    int fd = conn->per_handle_data->Socket;
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < len) {
+        n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, 5000) > 0)
+                continue;
+        }
+        return -1;
+    }
+    return (int)sent;
+}
+
+
+static conn_seg_t *
+connection_seg_new (connection_tp conn, conn_seg_type_t type) {
+    conn_seg_t * seg = (conn_seg_t *)calloc(1, sizeof(conn_seg_t));
+    if (seg == NULL)
+        return NULL;
+    seg->type = type;
+    seg->fd = -1;
+    if (conn->out_tail != NULL)
+        conn->out_tail->next = seg;
+    else
+        conn->out_head = seg;
+    conn->out_tail = seg;
+    return seg;
+}
+
+static void
+connection_seg_free (conn_seg_t * seg) {
+    if (seg->type == CONN_SEG_HEAP || seg->type == CONN_SEG_ZEROCOPY)
+        free((char *)seg->data);
+    else if (seg->type == CONN_SEG_FILE && seg->close_fd)
+        close(seg->fd);
+    free(seg);
+}
+
+// 复制数据到输出队列, 能放进队尾 HEAP 段的空闲空间时直接追加
+extern int
+connection_out_copy (connection_tp conn, const char * buf, size_t len) {
+    conn_seg_t * seg = conn->out_tail;
+    size_t end;
+
+    if (len == 0)
+        return 0;
+
+    if (seg == NULL || seg->type != CONN_SEG_HEAP || seg->cap - (end = seg->offset + seg->len) < len) {
+        size_t cap = len > CONN_SEG_MIN ? len : CONN_SEG_MIN;
+        char * data = (char *)malloc(cap);
+        if (data == NULL)
+            return -1;
+        seg = connection_seg_new(conn, CONN_SEG_HEAP);
+        if (seg == NULL) {
+            free(data);
+            return -1;
+        }
+        seg->data = data;
+        seg->cap = cap;
+        end = 0;
+    }
+    memcpy((char *)seg->data + end, buf, len);
+    seg->len += len;
+    conn->out_bytes += len;
+    return (int)len;
+}
+
+extern int
+connection_out_static (connection_tp conn, const char * buf, size_t len) {
+    if (len == 0)
+        return 0;
+    conn_seg_t * seg = connection_seg_new(conn, CONN_SEG_STATIC);
+    if (seg == NULL)
+        return -1;
+    seg->data = buf;
+    seg->len = len;
+    conn->out_bytes += len;
+    return (int)len;
+}
+
+// close_fd 为 1 时 fd 交给队列, 发送完或者连接释放时关闭
+extern int
+connection_out_file (connection_tp conn, int fd, long long offset, size_t len, int close_fd) {
+    conn_seg_t * seg = len > 0 ? connection_seg_new(conn, CONN_SEG_FILE) : NULL;
+    if (seg == NULL) {
+        if (close_fd)
+            close(fd);
+        return len > 0 ? -1 : 0;        // 空文件没有需要发送的内容
+    }
+    seg->fd = fd;
+    seg->close_fd = close_fd;
+    seg->offset = offset;
+    seg->len = len;
+    conn->out_bytes += len;
+    return (int)len;
+}
+
+// buf 必须由 malloc 分配, 交给队列以后不再复制; socket 没有打开 SO_ZEROCOPY 时作为普通的 HEAP 段
+extern int
+connection_out_zerocopy (connection_tp conn, char * buf, size_t len) {
+    conn_seg_t * seg = len > 0 ? 
+        connection_seg_new(conn, conn->zerocopy ? CONN_SEG_ZEROCOPY : CONN_SEG_HEAP) : NULL;
+    if (seg == NULL) {
+        free(buf);
+        return len > 0 ? -1 : 0;
+    }
+    seg->data = buf;
+    seg->cap = len;
+    seg->len = len;
+    conn->out_bytes += len;
+    return (int)len;
+}
+
+// 零拷贝发出的段在内核通知之前不能释放, 按发送顺序挂到 zc 链表上
+static void
+connection_zerocopy_hold (connection_tp conn, conn_seg_t * seg) {
+    seg->next = NULL;
+    if (conn->zc_tail != NULL)
+        conn->zc_tail->next = seg;
+    else
+        conn->zc_head = seg;
+    conn->zc_tail = seg;
+}
+
+// TCP 的通知按序号顺序到达, 通知 [lo, hi] 说明 hi 和之前的发送内核都已经用完
+static void
+connection_zerocopy_done (connection_tp conn, unsigned int hi) {
+    while (conn->zc_head != NULL && (int)(conn->zc_head->zc_id - hi) <= 0) {
+        conn_seg_t * seg = conn->zc_head;
+        conn->zc_head = seg->next;
+        if (conn->zc_head == NULL)
+            conn->zc_tail = NULL;
+        connection_seg_free(seg);
+    }
+}
+
+// 从 socket 的错误队列读出所有零拷贝通知, 通知到达时 epoll 报告 EPOLLERR
+// 返回值: 0 已经读完, -1 出错
+extern int
+connection_zerocopy_reap (connection_tp conn) {
+    int fd = conn->per_handle_data->Socket;
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr * cm;
+    struct sock_extended_err * serr;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // 内核还是复制了数据, 零拷贝只多了通知的开销
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                conn->zc_copied = 1;
+            connection_zerocopy_done(conn, serr->ee_data);
+        }
+    }
+}
+
+// 从队头去掉已经发出的 n 个字节, FILE 段的 offset 已经由 sendfile 更新
+static void
+connection_out_consume (connection_tp conn, size_t n) {
+    conn->out_bytes -= n;
+    while (n > 0 && conn->out_head != NULL) {
+        conn_seg_t * seg = conn->out_head;
+        size_t part = n < seg->len ? n : seg->len;
+        seg->len -= part;
+        if (seg->type != CONN_SEG_FILE)
+            seg->offset += part;
+        n -= part;
+        if (seg->len > 0)
+            break;
+        conn->out_head = seg->next;
+        if (conn->out_head == NULL)
+            conn->out_tail = NULL;
+        if (seg->type == CONN_SEG_ZEROCOPY && seg->zc_sent)
+            connection_zerocopy_hold(conn, seg);
+        else
+            connection_seg_free(seg);
+    }
+}
+
+// TLS 连接逐段用 SSL_write 发送, 文件段先读到缓冲区再加密
+// SSL_write 要求重试时数据相同, 文件段每次从同一个位置读同样的长度
+static int
+connection_flush_tls (connection_tp conn) {
+    char buf[CONN_TLS_CHUNK];
+    const char * data;
+    size_t len;
+    int n;
+
+    while (conn->out_head != NULL) {
+        conn_seg_t * seg = conn->out_head;
+
+        if (seg->type == CONN_SEG_FILE && tls_ktls_send(conn)) {
+            n = tls_sendfile(conn, seg->fd, seg->offset, seg->len);
+            if (n == TLS_IO_AGAIN)
+                return 0;
+            if (n <= 0)
+                return -1;
+            seg->offset += n;
+            connection_out_consume(conn, n);
+            continue;
+        } else if (seg->type == CONN_SEG_FILE) {
+            len = seg->len < sizeof(buf) ? seg->len : sizeof(buf);
+            ssize_t r = pread(seg->fd, buf, len, (off_t)seg->offset);
+            if (r <= 0)
+                return -1;
+            data = buf;
+            len = r;
+        } else {
+            data = seg->data + seg->offset;
+            len = seg->len;
+        }
+
+        n = tls_send(conn, data, len);
+        if (n == TLS_IO_AGAIN)
+            return 0;
+        if (n <= 0)
+            return -1;
+        if (seg->type == CONN_SEG_FILE)
+            seg->offset += n;
+        connection_out_consume(conn, n);
+    }
+    return 1;
+}
+
+// 尽量发送输出队列, 相邻的内存段用一次 sendmsg 发出, 文件段用 sendfile, ZEROCOPY 段单独用 MSG_ZEROCOPY 发送
+// 返回值: 1 队列已经发完, 0 socket 发送缓冲满 (等待 EPOLLOUT), -1 出错
+extern int
+connection_flush (connection_tp conn) {
+    int fd = conn->per_handle_data->Socket;
+    struct iovec iov[CONN_IOV_MAX];
+    ssize_t n;
+
+    if (conn->ssl != NULL)
+        return connection_flush_tls(conn);
+
+    while (conn->out_head != NULL) {
+        conn_seg_t * seg = conn->out_head;
+
+        if (seg->type == CONN_SEG_FILE) {
+            off_t offset = (off_t)seg->offset;
+            n = sendfile(fd, seg->fd, &offset, seg->len);
+            if (n == 0)
+                return -1;          // 文件在发送过程中被截短
+            if (n > 0)
+                seg->offset = offset;
+        } else if (seg->type == CONN_SEG_ZEROCOPY) {
+            // 不和其它段合并, 否则同一次发送中的其它段也会被内核引用
+            int flags = conn->zc_copied ? MSG_NOSIGNAL : MSG_NOSIGNAL | MSG_ZEROCOPY;
+            n = send(fd, seg->data + seg->offset, seg->len, flags);
+            if (n > 0 && (flags & MSG_ZEROCOPY)) {
+                seg->zc_id = conn->zc_next++;
+                seg->zc_sent = 1;
+            } else if (n < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                n = send(fd, seg->data + seg->offset, seg->len, MSG_NOSIGNAL);  // 超过 optmem_max, 这次复制发送
+            }
+        } else {
+            struct msghdr msg;
+            int cnt = 0;
+            for (; seg != NULL && (seg->type == CONN_SEG_HEAP || seg->type == CONN_SEG_STATIC) && 
+                    cnt < CONN_IOV_MAX; seg = seg->next) {
+                iov[cnt].iov_base = (char *)seg->data + seg->offset;
+                iov[cnt].iov_len = seg->len;
+                cnt++;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        connection_out_consume(conn, n);
+    }
+    return 1;
+}
+
+extern void
+connection_out_clear (connection_tp conn) {
+    while (conn->out_head != NULL) {
+        conn_seg_t * seg = conn->out_head;
+        conn->out_head = seg->next;
+        connection_seg_free(seg);
+    }
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+
+    // connection_close 已经用 RST 关闭了还有零拷贝数据没有完成的连接, 内核不会再发送这些页面
+    while (conn->zc_head != NULL) {
+        conn_seg_t * seg = conn->zc_head;
+        conn->zc_head = seg->next;
+        connection_seg_free(seg);
+    }
+    conn->zc_tail = NULL;
+}
+#endif
+
 extern void 
 connection_close (connection_tp conn) {
 #ifdef __linux__
-    epoll_ctl(conn->per_handle_data->efd, 2, 
-        conn->per_handle_data->Socket, NULL);  // EPOLL_CTL_DEL 2
+    if (conn->per_handle_data->efd >= 0)
+        epoll_ctl(conn->per_handle_data->efd, 2, 
+            conn->per_handle_data->Socket, NULL);  // EPOLL_CTL_DEL 2
+    if (conn->per_handle_data->reactor != NULL)
+        conn->per_handle_data->reactor->conn_num--;
+
+    // 内核还在引用零拷贝发送的页面时, 正常 close 以后这些数据仍会继续发送和重传,
+    // 而 connection_free 马上会释放这块内存, 被重新分配以后别的数据会出现在这个连接上;
+    // 先收掉已经完成的通知, 还有没完成的就用 RST 关闭, 让内核丢掉这些 skb
+    if (conn->zc_head != NULL)
+        connection_zerocopy_reap(conn);
+    if (conn->zc_head != NULL) {
+        struct linger lg = { 1, 0 };
+        setsockopt(conn->per_handle_data->Socket, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
 #endif
+    tls_shutdown(conn);
 	close_socket(conn->per_handle_data->Socket);
 }
 
@@ -68,30 +710,38 @@ send_next (connection_tp conn) {
 }
 #endif
 
-extern void
-connection_free_base (connection_tp conn) {
-#ifdef __SERVER_MPOOL__
-    pool_free(&g_server.pool_io, conn->per_io_data );
-    pool_free(&g_server.pool_handle, conn->per_handle_data );
-#else 
-    free( conn->per_io_data);
-    free( conn->per_handle_data);
-#endif // __SERVER_MPOOL__
-}
-
 extern void
 connection_free (connection_tp conn) {
-    req_free(conn->req);
-
+#ifdef __linux__
+    if (conn->per_handle_data->reactor != NULL) {
+        dm_timer_del(&conn->per_handle_data->reactor->wheel, &conn->timer);
+        container_inflight_end(conn);
+        container_ready_del(conn);
+    }
+    connection_out_clear(conn);
+#endif
+    tls_free(conn);
+    connection_req_release(conn);
+    connection_rbuf_release(conn);
 
+    conn_slab_t * slab = conn->slab;
+    if (slab == NULL) {
+        connection_mem_free(conn);
+        return;
+    }
+    slab->used--;
+    if (conn->slab_prev != NULL)
+        conn->slab_prev->slab_next = conn->slab_next;
+    else
+        slab->used_list = conn->slab_next;
+    if (conn->slab_next != NULL)
+        conn->slab_next->slab_prev = conn->slab_prev;
 
-    free(conn->req);
-#ifdef __SERVER_MPOOL__
-    pool_free(&g_server.pool_io, conn->per_io_data );
-    pool_free(&g_server.pool_handle, conn->per_handle_data );
-#else 
-    free( conn->per_io_data );
-    free( conn->per_handle_data );
-#endif // __SERVER_MPOOL__
-    free(conn);
+    if (slab->free_num >= slab->free_max) {
+        connection_mem_free(conn);
+        return;
+    }
+    conn->slab_next = slab->free_list;
+    slab->free_list = conn;
+    slab->free_num++;
 }
@@ -16,68 +16,125 @@
     *
     */
    
+#ifdef __linux__
+#define _GNU_SOURCE                 // accept4, memmem
+#endif
+
 #include <dmfserver/container.h>
 #include <dmfserver/connection.h>
 #include <dmfserver/cfg.h>
 #include <dmfserver/common.h>
+#include <dmfserver/tls.h>
+#include <dmfserver/master.h>
+#include <dmfserver/utility/dm_cpu.h>
+#include <dmfserver/utility/dm_thread_pool.h>
+#include <dmfserver/utility/dm_scan.h>
+#include <dmfserver/body.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <stdatomic.h>
+#endif
+
+#ifdef __SERVER_IO_URING__
+#include <stdint.h>
+#include <poll.h>
+#include <limits.h>
+#include <liburing.h>
+#endif // __SERVER_IO_URING__
 
 server_t g_server;
 _Atomic int all = 0;
 
-static SSL_CTX * get_ssl_ctx()
+#ifdef __linux__
+#include <sys/syscall.h>
+#define GetCurrentThreadId() ((int)syscall(SYS_gettid))
+#endif // linux
+
+// 路由之前决定这次响应之后是否保持连接:
+// 请求本身允许 keep-alive, 并且没有超过每个连接的请求数上限
+static void container_keep_alive(connection_tp conn)
 {
-    SSL_CTX * ctx ;
-    SSL_library_init();
-    OpenSSL_add_all_algorithms();
-    SSL_load_error_strings();
-    ctx = SSL_CTX_new(SSLv23_server_method());
-    if (ctx == NULL) {
-        ERR_print_errors_fp(stdout);
-        return NULL;
-    }
-    if (SSL_CTX_use_certificate_file(ctx, g_server_conf_all._conf_server.cert_public , SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stdout);
-        return NULL;
-    }
-    if (SSL_CTX_use_PrivateKey_file(ctx, g_server_conf_all._conf_server.cert_private , SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stdout);
-        return NULL;
-    }
-    if (!SSL_CTX_check_private_key(ctx)) {
-        ERR_print_errors_fp(stdout);
-        return NULL;
-    }
-    return ctx;
+    conn->req_count++;
+    conn->keep_alive = req_keep_alive(conn->req) &&
+        conn->req_count < (unsigned int)g_server_conf_all._conf_server.keepalive_requests;
+#ifdef __linux__
+    // 排空时响应带上 Connection: close
+    if (conn->per_handle_data->reactor != NULL && conn->per_handle_data->reactor->draining)
+        conn->keep_alive = 0;
+#endif
 }
 
 
+// 连接对象由每个 reactor 的 conn_slab_t 管理, 不再需要全局内存池
 extern void container_init () {
 
-#define SIZE_HANDLE sizeof(per_handle_data_t)
-#define SIZE_IO sizeof(per_io_data_t)
+}
 
-#ifdef __SERVER_MPOOL__
-    printf("server mpool start !\n");
-    pool_init(&g_server.pool_io, SIZE_IO, SIZE_IO * SERVER_MPOOL_NUM);  // server 模块内存池初始化
-    pool_init(&g_server.pool_handle, SIZE_HANDLE, SIZE_HANDLE * SERVER_MPOOL_NUM);       // server 模块内存池初始化
-#endif // __SERVER_MPOOL__
 
-}
+#ifdef __linux__
+// 所有 worker 的监听 socket 和 SSL_CTX 在 fork 之前建立, 由 worker 继承;
+// 按配置中监听地址的顺序排列: TCP 地址每个 reactor 一个 SO_REUSEPORT socket, 
+// worker w 的第 i 个 reactor 使用这一段中的第 w * reactor_num + i 个; unix socket 只有一个, 所有 reactor 共用
+static int * container_listen_fds = NULL;
+static int container_listen_num = 0;
+static int container_listen_reactors = 0;      // 所有 worker 的 reactor 总数
+static SSL_CTX * container_ssl_ctx = NULL;
+
+// cpu_affinity 打开时 reactor 依次绑定 io 核, 线程池绑定 pool 核
+static dm_cpu_set_t container_io_cpus;
+static dm_cpu_set_t container_pool_cpus;
+
+static int container_listen_init(int worker_num);
+static void container_listen_free();
+static void container_worker(int id);
+
+// 每个 worker 进程一个 eventfd, SIGQUIT 的处理函数写入它, 唤醒所有 reactor 开始排空
+static int container_wake_fd = -1;
+
+// 执行阻塞 view 的线程池, 每个 worker 进程一个, 由这个进程的所有 epoll reactor 共用
+static thread_pool_t * container_pool = NULL;
+static _Atomic long container_pool_queued = 0;     // 已经交给线程池还没有执行完的请求
+
+// 所有 worker 共享的负载计数, 和这个进程的 reactor (状态页使用)
+static container_load_t * container_load = NULL;
+static reactor_tp container_reactors = NULL;
+static int container_reactor_num = 0;
+#endif // linux
 
 
 extern void container_start () {
-    // 根据使用的平台启动服务器
+    // 根据配置的 mode 和使用的平台启动服务器
+    switch (g_server_conf_all._conf_server.mode) {
+    case SimpleServer:
+        simple_container_make();
+        break;
 #ifdef __WIN32__
-	iocp_container_make();
-	// simple_container_make();
-	// simple_ssl_container_make();
+    case SSLServer:
+        simple_ssl_container_make();
+        break;
+    default:
+        iocp_container_make();
+        break;
 #elif __linux__
-	// simple_container_make();
-	// simple_ssl_container_make();
-	epoll_container_make();
-    // multi_process_init(&epoll_container_make);
-	// epoll_ssl_container();
+    default: {
+        // 多进程模式下 master 只负责监听和监督, 连接都由 worker 处理
+        int multi = g_server_conf_all._conf_server.multi_process;
+        int worker_num = multi ? g_server_conf_all._conf_server.workers : 1;
+
+        if (container_listen_init(worker_num) != 0)
+            break;
+        if (multi)
+            multi_process_init(worker_num, container_worker, container_listen_fds, container_listen_num);
+        else
+            container_worker(0);
+        container_listen_free();
+        break;
+    }
 #endif // linux
+    }
 
 }
 
@@ -90,7 +147,7 @@ static void simple_container_handler(connection_tp conn_ptr )
 	int receive_bytes = recv( conn_ptr->per_handle_data->Socket, res_str, sizeof(res_str), 0 );
     // printf("recv: \n%s\n", res_str);
 
-	req_parse_http(conn_ptr->req, res_str);
+	req_parse_http(conn_ptr->req, res_str, receive_bytes > 0 ? receive_bytes : 0);
 	
 	// 进行必要日志记录
     char time [30] = {'\0'};
@@ -100,9 +157,13 @@ static void simple_container_handler(connection_tp conn_ptr )
             GetCurrentThreadId (), all++);
     memset(time, 0, 30);
 	
+	// simple container 每个连接只处理一个请求
+	conn_ptr->keep_alive = 0;
 	router_handle(conn_ptr, conn_ptr->req);
 	// 通过请求的 path 调用了对应的处理函数
 	
+	connection_close(conn_ptr);
+	connection_free(conn_ptr);
 }
 
 
@@ -137,7 +198,7 @@ extern void simple_container_make()
 
 extern void simple_ssl_container_make()
 {
-	SSL_CTX *ctx = get_ssl_ctx();
+	SSL_CTX *ctx = tls_ctx_create();
 #ifdef __WIN32__
     wsa_init();
 #endif
@@ -196,10 +257,7 @@ DWORD WINAPI iocp_handle(LPVOID lpParam)
             if( (GetLastError() == WAIT_TIMEOUT)) { //|| (GetLastError() == ERROR_NETNAME_DELETED ) ){
                 printf("closingsocket %d\n", PerHandleData->Socket); 
                 closesocket(PerHandleData->Socket);
-                connection_tp conn;
-                conn->per_handle_data = PerHandleData;
-                conn->per_io_data = PerIoData;
-                connection_free_base(conn);
+                connection_free(PerHandleData->conn);
                 continue;
             } else {
                 OutErr("GetQueuedCompletionStatus failed!");
@@ -213,9 +271,7 @@ DWORD WINAPI iocp_handle(LPVOID lpParam)
         if(BytesTransferred == 0) {
             printf("客户端已经退出 closingsocket %d\n", PerHandleData->Socket);
             connection_close(conn_ptr);
-            free(conn_ptr->req);
-            connection_free_base(conn_ptr);
-            free(conn_ptr);
+            connection_free(conn_ptr);
             continue;
         }
         
@@ -225,28 +281,20 @@ DWORD WINAPI iocp_handle(LPVOID lpParam)
 
         req_parse_init(conn_ptr->req);
         // 解析 http 请求
-        req_parse_http(conn_ptr->req, conn_ptr->per_io_data->Buffer);
+        req_parse_http(conn_ptr->req, conn_ptr->per_io_data->Buffer, 
+                strlen(conn_ptr->per_io_data->Buffer));
 
         char* res_str = "HTTP/1.1 200\r\n\r\nhello world!";
         send(PerHandleData->Socket, res_str, strlen(res_str), 0);
         closesocket(PerHandleData->Socket);
 
-        req_free(conn_ptr->req);
-        free(conn_ptr->req);
-
-    #ifdef __SERVER_MPOOL__
-        pool_free( conn_ptr->per_io_data );
-        pool_free2( conn_ptr->per_handle_data );
-    #else 
-        free( conn_ptr->per_io_data );
-        free( conn_ptr->per_handle_data );
-    #endif // __SERVER_MPOOL__
-        free(conn_ptr);
+        connection_free(conn_ptr);
 
 #endif
         
         // 解析 http 请求
-        req_parse_http(conn_ptr->req, conn_ptr->per_io_data->Buffer);
+        req_parse_http(conn_ptr->req, conn_ptr->per_io_data->Buffer, 
+                strlen(conn_ptr->per_io_data->Buffer));
         
         // 根据解析出来的结果运行中间件
         if( middleware_handle(conn_ptr) < 0) {
@@ -268,8 +316,18 @@ DWORD WINAPI iocp_handle(LPVOID lpParam)
             *路由模块调用用户的view函数
             *在view函数中必须调用response模块进行返回
             */
+        container_keep_alive(conn_ptr);
         router_handle(conn_ptr, conn_ptr->req);
 
+        // keep-alive 连接重置 request 后继续投递 WSARecv
+        if (conn_ptr->keep_alive) {
+            req_reset(conn_ptr->req);
+            send_next(conn_ptr);
+        } else {
+            connection_close(conn_ptr);
+            connection_free(conn_ptr);
+        }
+
     }
 
     return 0;
@@ -352,259 +410,1775 @@ int iocp_container_make()
 
 #ifdef __linux__ 
 
+#define CONTAINER_WHEEL_SLOTS   512     // 时间轮一圈 512 * 100ms, 更长的超时多转几圈
+#define CONTAINER_WHEEL_TICK    100     // ms
+#define CONTAINER_SLAB_FREE_MAX 4096    // 每个 reactor 最多缓存的空闲连接对象
+#define CONTAINER_DRAIN_IDLE    1000    // 排空时空闲 keep-alive 连接再保留的毫秒数
+
+
+#define CONTAINER_WORK_HEAVY    4       // 连续积压超过 4 轮 conn_batch 的连接每轮只处理一个请求
+
+
+// 请求行中的 path 是否注册了 body 消费者, 这时头部还没有解析
+static BodyFun container_body_route(const char *data, size_t len)
+{
+    const char *end = data + len;
+    const char *path = memchr(data, ' ', len);
+    const char *p;
+
+    if (path == NULL)
+        return NULL;
+    path++;
+    p = dm_scan(path, end, " ?", 2);
+    return router_body(path, p - path);
+}
+
+
+// 开始流式接收 body: 头部移到读缓冲开头并解析, 由路由注册的工厂函数创建消费者
+// chunked 编码的 body 在没有注册消费者的路由上也走这里, 解码到内存中 (最多 HTTP_BODY_MAX), 和 Content-Length 的请求一样处理
+// body 留在读缓冲中, 由 container_body_feed 交给消费者; 返回 -1 时已经返回了 413 或 400
+static int container_body_start(connection_tp conn, size_t offset, int head_len, long body_len)
+{
+    long max = (long)g_server_conf_all._conf_server.upload_max * 1024 * 1024;
+    req_body_sink_t *sink;
+    request_t *req;
+    BodyFun bf;
+
+    if (offset > 0) {
+        conn->rlen -= offset;
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rlen);
+        conn->rbuf[conn->rlen] = '\0';
+    }
+    if ((req = connection_req_attach(conn)) == NULL)
+        return -1;
+    if (req_parse_http(req, conn->rbuf, head_len) < 0) {
+        res_bad_request(conn);
+        return -1;
+    }
+    container_keep_alive(conn);
+
+    if (max > 0 && body_len > max) {
+        res_too_large(conn);
+        return -1;
+    }
+    bf = router_body(req->path, strlen(req->path));
+    if (bf != NULL)
+        sink = bf(conn, req);
+    else
+        sink = body_spool_new(0, HTTP_BODY_MAX, HTTP_BODY_MAX);
+    if (sink == NULL) {
+        res_too_large(conn);
+        return -1;
+    }
+    req->sink = sink;
+    req->head_len = head_len;
+    if (body_len == HTTP_BODY_CHUNKED)
+        req_chunked_init(&req->chunked, bf != NULL ? (size_t)max : HTTP_BODY_MAX, 
+                g_server_conf_all._conf_server.chunked_meta_max);
+    else
+        req->body_left = body_len;
+    return head_len;
+}
+
+
+// 把读缓冲中已经到达的 body 交给消费者, 没有被接收的部分留在缓冲区中, 读取在 CONN_BODY_WINDOW 处暂停
+// chunked 编码的 body 先解码, 数据部分不复制直接交给消费者, chunk 的长度行, 扩展和 trailer 解码时就从缓冲区中去掉
+// 返回头部的长度表示 body 已经全部交给消费者, 可以执行 view; 0 等待数据或消费者, -1 消费者拒绝 (已经返回 413) 或格式错误 (400)
+static int container_body_feed(connection_tp conn)
+{
+    request_t *req = conn->req;
+    size_t head = req->head_len;
+    size_t n = conn->rlen - head;
+    int chunked = req->chunked.state != REQ_CHUNK_NONE;
+    long used = 0;
+
+    req_rebase(req, conn->rbuf);        // 读缓冲可能在读取时扩大过
+    if (chunked) {
+        if (n > 0)
+            used = req_chunked_feed(&req->chunked, conn->rbuf + head, n, req->sink);
+    } else {
+        if (n > req->body_left)
+            n = req->body_left;
+        if (n > 0)
+            used = req->sink->on_data(req->sink, conn->rbuf + head, n);
+        if (used > (long)n)
+            used = REQ_BODY_REJECT;
+    }
+    if (used == REQ_BODY_BAD) {
+        res_bad_request(conn);          // 编码或者 body 格式错误, 不再能找到下一个请求的开头
+        return -1;
+    }
+    if (used < 0) {
+        res_too_large(conn);
+        return -1;
+    }
+
+    if (used > 0) {
+        conn->rlen -= used;
+        memmove(conn->rbuf + head, conn->rbuf + head + used, conn->rlen - head);
+        conn->rbuf[conn->rlen] = '\0';
+        if (!chunked)
+            req->body_left -= used;
+    }
+    if (chunked ? req->chunked.state != REQ_CHUNK_DONE : req->body_left > 0)
+        return 0;
+    if (req->sink->on_end != NULL && (used = req->sink->on_end(req->sink, req)) < 0) {
+        if (used == REQ_BODY_BAD)
+            res_bad_request(conn);
+        else
+            res_too_large(conn);
+        return -1;
+    }
+    return (int)head;
+}
+
+
+// 处理读缓冲中所有完整的请求, 头部和 body 都到齐以后才进行解析
+// 注册了 body 消费者的路由在头部到齐时就开始处理, body 边到达边交给消费者, 收完以后再执行 view
+// 缓冲区中可能有多个 pipeline 请求, 依次处理, 响应按请求顺序发出
+// 返回 0 表示请求非法 (已经返回 400) 或不再保持连接, 调用者应关闭连接
+// budget 不为 0 时最多处理这么多个请求, 用完时返回 2, 剩下的请求由调用者安排下一轮处理
+// 阻塞 view 执行完以后, 从记下的位置继续处理后面的请求
+static int container_route(connection_tp conn, size_t rpos);
+
+static int container_dispatch(connection_tp conn, int reactor_id, unsigned int budget)
+{
+    char time [30] = {'\0'};
+    size_t offset = conn->rpos;
+    int req_len = 0;
+    int alive = conn->rpos > 0 ? conn->keep_alive : 1;
+    unsigned int handled = 0;
+    long body_len;
+
+    conn->rpos = 0;
+
+    // 输出积压超过高水位时先不处理后面的请求, 等输出队列降下来再继续
+    while (alive && conn->out_bytes < CONN_OUT_HIGH && (budget == 0 || handled < budget)) {
+        if (conn->req != NULL && conn->req->sink != NULL) {
+            // 流式 body 的请求在缓冲区开头, 头部已经解析过
+            if ((req_len = container_body_feed(conn)) <= 0)
+                break;
+        } else {
+            if ((req_len = req_parse_head(conn->rbuf + offset, conn->rlen - offset, &body_len)) <= 0) {
+                if (req_len < 0)
+                    res_bad_request(conn);
+                break;
+            }
+            if (body_len == HTTP_BODY_CHUNKED ||
+                    (body_len > 0 && container_body_route(conn->rbuf + offset, req_len) != NULL)) {
+                req_len = container_body_start(conn, offset, req_len, body_len);
+                offset = 0;
+                if (req_len < 0)
+                    break;
+                continue;
+            }
+            if (body_len > HTTP_BODY_MAX) {
+                res_too_large(conn);            // 没有 body 消费者的路由只能整个读入读缓冲
+                req_len = -1;
+                break;
+            }
+            if (conn->rlen - offset < req_len + body_len) {
+                req_len = 0;
+                break;
+            }
+            req_len += body_len;
+
+            // 解析结果指向读缓冲, 这个请求处理完之前不能移动缓冲区中的数据
+            if (connection_req_attach(conn) == NULL)
+                return 0;
+            if (req_parse_http(conn->req, conn->rbuf + offset, req_len) < 0) {
+                res_bad_request(conn);
+                return 0;
+            }
+            container_keep_alive(conn);
+        }
+        handled++;
+
+        server_time(time);
+        log_info("SERVER", 506, "[%s][Server: Info] %s %d id: %d reactor: %d\n",time , 
+            conn->req->path, req_len, getpid(), reactor_id);
+        memset(time, 0, 30);
+        
+        if (container_route(conn, offset + req_len))
+            return 1;
+        conn->timeout = CONN_TIMEOUT_NONE;      // 下一个请求重新开始计算超时
+
+        offset += req_len;
+        req_reset(conn->req);
+        alive = conn->keep_alive;
+    }
+
+    if (req_len < 0 || !alive)
+        return 0;
+
+    // 剩下的请求移到缓冲区开头, 等待后续数据或者下一轮处理
+    if (offset > 0) {
+        conn->rlen -= offset;
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rlen);
+        conn->rbuf[conn->rlen] = '\0';
+    }
+
+    if (budget > 0 && handled == budget && conn->out_bytes < CONN_OUT_HIGH) {
+        conn->work += handled;
+        return 2;
+    }
+    conn->work = 0;
+    return 1;
+}
+
+
+// 这一轮给连接的请求数: 持续积压的连接 (例如一直 pipeline 的客户端) 每轮只处理一个请求
+static unsigned int container_budget(reactor_tp reactor, connection_tp conn)
+{
+    unsigned int batch = g_server_conf_all._conf_server.conn_batch;
+
+    if (batch == 0)
+        return 0;
+    if (conn->work >= batch * CONTAINER_WORK_HEAVY) {
+        reactor->throttled++;
+        return 1;
+    }
+    return batch;
+}
+
+
+// 按读缓冲中的内容设置连接的超时, 每次读取和处理之后调用
+// 头部超时从请求的第一个字节开始计算, 之后收到数据也不延长, 慢速发送头部 (slowloris) 的连接会被关闭
+// 空闲和 body 超时在每次收到数据之后重新计时, 发送超时在每次发出数据之后重新计时
+// 正在流式接收 body 的请求, 解析过的头部已经不以 "\r\n\r\n" 的形式留在读缓冲中
+static int container_body_pending(connection_tp conn)
+{
+    request_t *req = conn->req;
+
+    if (req == NULL || req->sink == NULL)
+        return 0;
+    if (req->chunked.state != REQ_CHUNK_NONE)
+        return req->chunked.state != REQ_CHUNK_DONE;
+    return req->body_left > 0;
+}
+
+
+static void container_conn_timer(reactor_tp reactor, connection_tp conn)
+{
+    conf_server *cf = &g_server_conf_all._conf_server;
+    conn_timeout_t timeout;
+    int seconds;
+
+    // 响应已经全部交给内核, 请求结束
+    if (conn->inflight && !conn->offloaded && conn->out_head == NULL)
+        container_inflight_end(conn);
+
+    if (conn->offloaded)
+        return;                 // 在线程池中执行时不计算超时, 回来以后重新设置
+
+    if (conn->out_head != NULL || (conn->closing && conn->zc_head != NULL))
+        timeout = CONN_TIMEOUT_SEND;
+    else if (container_body_pending(conn))
+        timeout = CONN_TIMEOUT_BODY;
+    else if (conn->rlen == 0 && conn->req_count > 0)
+        timeout = CONN_TIMEOUT_IDLE;
+    else if (conn->rlen == 0 || memmem(conn->rbuf, conn->rlen, "\r\n\r\n", 4) == NULL)
+        timeout = CONN_TIMEOUT_HEADER;
+    else
+        timeout = CONN_TIMEOUT_BODY;
+
+    if (timeout == CONN_TIMEOUT_HEADER && conn->timeout == CONN_TIMEOUT_HEADER)
+        return;
+    conn->timeout = timeout;
+
+    if (timeout == CONN_TIMEOUT_IDLE)
+        seconds = cf->keepalive_timeout;
+    else if (timeout == CONN_TIMEOUT_HEADER)
+        seconds = cf->header_timeout;
+    else if (timeout == CONN_TIMEOUT_BODY)
+        seconds = cf->body_timeout;
+    else
+        seconds = cf->send_timeout;
+
+    // 排空时不马上关闭空闲连接: 客户端可能已经在复用它发送请求, 关闭会让这个请求失败
+    if (reactor->draining && timeout == CONN_TIMEOUT_IDLE)
+        dm_timer_add(&reactor->wheel, &conn->timer, CONTAINER_DRAIN_IDLE);
+    else if (seconds > 0)
+        dm_timer_add(&reactor->wheel, &conn->timer, seconds * 1000);
+    else
+        dm_timer_del(&reactor->wheel, &conn->timer);
+}
+
+
+// 线程池线程中执行 view, 然后把连接放回所属 reactor 的完成队列
+static void container_offload_run(void *arg)
+{
+    connection_tp conn = (connection_tp)arg;
+    reactor_tp reactor = conn->per_handle_data->reactor;
+    uint64_t one = 1;
+    ssize_t n;
+
+    router_handle(conn, conn->req);
+    atomic_fetch_sub(&container_pool_queued, 1);
+
+    pthread_mutex_lock(&reactor->done_lock);
+    conn->done_next = reactor->done_list;
+    reactor->done_list = conn;
+    pthread_mutex_unlock(&reactor->done_lock);
+
+    n = write(reactor->done_fd, &one, sizeof(one));
+    (void)n;
+}
+
+
+// 路由标记为阻塞的 view 交给线程池执行, 返回 0 表示在当前线程中执行, -1 表示线程池的队列已满
+// 交出之前先尽量发出前面 pipeline 请求的响应; 之后直到 view 执行完, 连接的请求, 读缓冲和输出队列
+// 只由线程池线程使用, reactor 忽略这个连接上的事件, 也不计算它的超时
+// io_uring 的连接由 ring 发送 (conn->sender), 仍然在 reactor 中执行
+static int container_offload(connection_tp conn, size_t rpos)
+{
+    reactor_tp reactor = conn->per_handle_data->reactor;
+
+    if (container_pool == NULL || conn->sender != NULL || reactor == NULL || 
+            reactor->done_fd < 0 || !router_blocking(conn->req))
+        return 0;
+
+    // 队列满时马上拒绝, 不让请求在线程池前面排队
+    if (atomic_fetch_add(&container_pool_queued, 1) >= g_server_conf_all._conf_server.pool_queue &&
+            g_server_conf_all._conf_server.pool_queue > 0) {
+        atomic_fetch_sub(&container_pool_queued, 1);
+        return -1;
+    }
+
+    connection_flush(conn);     // 出错时 view 执行完以后再次 flush 会失败并关闭连接
+    dm_timer_del(&reactor->wheel, &conn->timer);
+    conn->timeout = CONN_TIMEOUT_NONE;
+    conn->rpos = rpos;
+    conn->offloaded = 1;
+    reactor->offloaded++;
+
+    if (thread_pool_add_task(container_pool, container_offload_run, conn) != 0) {
+        atomic_fetch_sub(&container_pool_queued, 1);
+        conn->rpos = 0;
+        conn->offloaded = 0;
+        reactor->offloaded--;
+        return 0;
+    }
+    return 1;
+}
+
+
+// 开始处理一个请求时计入 in-flight, 超过 reactor 或全局的上限时返回 0
+// 同一个连接上 pipeline 的请求依次处理, 和前面的请求一起计算
+static int container_admit(connection_tp conn)
+{
+    conf_server *cf = &g_server_conf_all._conf_server;
+    reactor_tp reactor = conn->per_handle_data->reactor;
+
+    if (conn->inflight || reactor == NULL)
+        return 1;
+    if (cf->max_inflight > 0 && reactor->inflight >= cf->max_inflight)
+        return 0;
+    if (reactor->load != NULL && 
+            atomic_fetch_add(&reactor->load->inflight, 1) >= cf->max_inflight_total && 
+            cf->max_inflight_total > 0) {
+        atomic_fetch_sub(&reactor->load->inflight, 1);
+        return 0;
+    }
+    conn->inflight = 1;
+    reactor->inflight++;
+    return 1;
+}
+
+
+// 响应全部交给内核或者连接关闭时调用
+extern void container_inflight_end(connection_tp conn)
+{
+    reactor_tp reactor = conn->per_handle_data->reactor;
+
+    if (!conn->inflight || reactor == NULL)
+        return;
+    conn->inflight = 0;
+    reactor->inflight--;
+    if (reactor->load != NULL)
+        atomic_fetch_sub(&reactor->load->inflight, 1);
+}
+
+
+// 过载时直接返回事先拼好的 503, 不进入路由
+static void container_shed(connection_tp conn)
+{
+    reactor_tp reactor = conn->per_handle_data->reactor;
+
+    if (reactor != NULL) {
+        reactor->shed++;
+        if (reactor->load != NULL)
+            atomic_fetch_add(&reactor->load->shed, 1);
+    }
+    res_unavailable(conn);
+}
+
+
+// 状态页: 上限和当前的负载, 其他 reactor 的计数不加锁读取, 只是近似值
+static void container_status(connection_tp conn)
+{
+    conf_server *cf = &g_server_conf_all._conf_server;
+    char buf[8192];
+    size_t len = 0;
+
+    len += snprintf(buf + len, sizeof(buf) - len, 
+            "pid: %d\ninflight_total: %ld / %d\nshed_total: %ld\npool_queued: %ld / %d\n",
+            getpid(), 
+            container_load != NULL ? atomic_load(&container_load->inflight) : 0L, cf->max_inflight_total,
+            container_load != NULL ? atomic_load(&container_load->shed) : 0L,
+            atomic_load(&container_pool_queued), cf->pool_queue);
+    for (int i = 0; i < container_reactor_num && len < sizeof(buf); i++) {
+        reactor_tp r = &container_reactors[i];
+        len += snprintf(buf + len, sizeof(buf) - len, 
+                "reactor %d: conns %ld / %d, inflight %ld / %d, offloaded %ld, shed %ld, throttled %ld%s\n",
+                r->id, r->conn_num, cf->max_conns, r->inflight, cf->max_inflight, 
+                r->offloaded, r->shed, r->throttled, r->accept_paused ? ", accept paused" : "");
+    }
+    res_row(conn, buf);
+}
+
+
+// 路由一个请求: 状态页直接返回, 超过负载上限时返回 503, 阻塞 view 交给线程池, 其余在当前线程中执行
+// 返回 1 表示交给了线程池
+static int container_route(connection_tp conn, size_t rpos)
+{
+    const char *status = g_server_conf_all._conf_server.status_path;
+    int ret;
+
+    if (status[0] != '\0' && strcmp(conn->req->path, status) == 0) {
+        container_status(conn);
+        return 0;
+    }
+    if (!container_admit(conn)) {
+        container_shed(conn);
+        return 0;
+    }
+
+    ret = container_offload(conn, rpos);
+    if (ret < 0)
+        container_shed(conn);
+    else if (ret == 0)
+        router_handle(conn, conn->req);
+    return ret > 0;
+}
+
+
+// 取出完成队列中的所有连接
+static connection_tp container_offload_done(reactor_tp reactor)
+{
+    connection_tp list;
+    uint64_t count;
+    ssize_t n;
+
+    n = read(reactor->done_fd, &count, sizeof(count));
+    (void)n;
+
+    pthread_mutex_lock(&reactor->done_lock);
+    list = reactor->done_list;
+    reactor->done_list = NULL;
+    pthread_mutex_unlock(&reactor->done_lock);
+    return list;
+}
+
+
+// 开始排空: 空闲的 keep-alive 连接改用 CONTAINER_DRAIN_IDLE 的超时,
+// 其余连接处理完当前请求以后关闭
+static void container_drain_start(reactor_tp reactor)
+{
+    connection_tp conn;
+
+    reactor->draining = 1;
+    reactor->drain_deadline = dm_timer_now_ms() + 
+            (unsigned long long)g_server_conf_all._conf_server.drain_timeout * 1000;
+
+    for (conn = reactor->slab.used_list; conn != NULL; conn = conn->slab_next)
+        if (conn->timeout == CONN_TIMEOUT_IDLE)
+            container_conn_timer(reactor, conn);
+
+    // 单进程模式下不会再有人 accept, 停止监听让新连接马上被拒绝;
+    // 多进程模式下监听 socket 还在其他 worker 或升级后的程序中使用, 不能动
+    if (!g_server_conf_all._conf_server.multi_process)
+        for (int l = 0; l < reactor->listen_num; ++l)
+            shutdown(reactor->listeners[l].fd, SHUT_RDWR);
+}
+
+
+// 排空时最多等到截止时间
+static int container_drain_wait(reactor_tp reactor, int timeout)
+{
+    unsigned long long now;
+    int left;
+
+    if (!reactor->draining)
+        return timeout;
+    now = dm_timer_now_ms();
+    left = now >= reactor->drain_deadline ? 0 : (int)(reactor->drain_deadline - now);
+    if (left == 0 && reactor->offloaded > 0)
+        return timeout;         // 过了截止时间, 只等线程池中的连接回来
+    return (timeout < 0 || timeout > left) ? left : timeout;
+}
+
+
+// 线程池中还在使用的连接不能关闭, 等它们回来以后再结束
+static int container_drain_done(reactor_tp reactor)
+{
+    return reactor->draining && reactor->offloaded == 0 &&
+        (reactor->conn_num == 0 || dm_timer_now_ms() >= reactor->drain_deadline);
+}
+
+
+// 取出并清除 socket 上的错误, 有错误时返回 1
+static int container_sock_error(connection_tp conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(conn->per_handle_data->Socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        return 1;
+    return err != 0;
+}
+
+
+static void container_ready_add(reactor_tp reactor, connection_tp conn)
+{
+    if (conn->ready)
+        return;
+    conn->ready = 1;
+    conn->ready_next = NULL;
+    conn->ready_prev = reactor->ready_tail;
+    if (reactor->ready_tail != NULL)
+        reactor->ready_tail->ready_next = conn;
+    else
+        reactor->ready_head = conn;
+    reactor->ready_tail = conn;
+}
+
+
+extern void container_ready_del(connection_tp conn)
+{
+    reactor_tp reactor = conn->per_handle_data->reactor;
+
+    if (!conn->ready)
+        return;
+    if (conn->ready_prev != NULL)
+        conn->ready_prev->ready_next = conn->ready_next;
+    else
+        reactor->ready_head = conn->ready_next;
+    if (conn->ready_next != NULL)
+        conn->ready_next->ready_prev = conn->ready_prev;
+    else
+        reactor->ready_tail = conn->ready_prev;
+    conn->ready = 0;
+    conn->ready_prev = NULL;
+    conn->ready_next = NULL;
+}
+
+
+static void epoll_conn_timeout(dm_timer_node_t *node)
+{
+    connection_tp conn = (connection_tp)node->data;
+    connection_close(conn);
+    connection_free(conn);
+}
+
+
+// 处理连接上的一次 epoll 事件, 返回 0 表示应该关闭连接
+// 连接同时注册 EPOLLIN 和 EPOLLOUT (边缘触发), 输出队列没有发完时等下一次可写事件继续发送
+static int epoll_conn_event(reactor_tp reactor, connection_tp conn, uint32_t events)
+{
+    int read_state = 1;
+    int alive;
+
+    if (conn->offloaded)
+        return 1;               // view 执行完以后由 epoll_offload_resume 继续处理
+
+    // 零拷贝通知也通过 EPOLLERR 报告, 读完以后 socket 上没有错误才是通知
+    if (conn->zc_head != NULL || (conn->zerocopy && (events & EPOLLERR))) {
+        if (connection_zerocopy_reap(conn) < 0)
+            return 0;
+    }
+    if ((events & EPOLLERR) && (!conn->zerocopy || container_sock_error(conn)))
+        return 0;
+
+    // TLS 握手完成之前只推进握手, 由 WANT_READ / WANT_WRITE 决定等待哪个事件
+    if (conn->ssl != NULL && !SSL_is_init_finished(conn->ssl)) {
+        int ret = tls_handshake(conn);
+        if (ret <= 0)
+            return ret == 0;
+        events |= EPOLLIN;      // 客户端可能已经随握手发来了请求
+    }
+
+    if (conn->out_head != NULL && connection_flush(conn) < 0)
+        return 0;
+
+    // 响应发送完, 并且内核用完零拷贝的缓冲以后关闭
+    if (conn->closing)
+        return conn->out_head != NULL || conn->zc_head != NULL;
+
+    if (conn->read_paused) {
+        if (conn->out_bytes >= CONN_OUT_LOW)
+            return 1;
+        conn->read_paused = 0;  // 恢复读取, 边缘触发下暂停期间到达的数据需要主动去读
+    } else if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        return 1;               // 只是可写事件
+    }
+
+    if (!conn->read_eof) {
+        read_state = connection_read(conn);
+        if (read_state < 0)
+            return 0;
+        if (read_state == 0)
+            conn->read_eof = 1;
+    }
+
+    // 请求非法, 不再保持连接, 或者对端已经关闭时, 发完已有的响应再关闭
+    // 流式 body 的窗口满了时, 这里交给消费者以后腾出了空间, 由就绪队列继续读
+    alive = container_dispatch(conn, reactor->id, container_budget(reactor, conn));
+    if (conn->offloaded)
+        return 1;
+    if (connection_flush(conn) < 0)
+        return 0;
+
+    if (conn->out_bytes >= CONN_OUT_HIGH) {
+        conn->read_paused = 1;
+        if (alive)
+            return 1;
+    }
+    // 用完这一轮的请求数, 或者 socket 中还有没读进窗口的 body, 或者消费者还没有取走缓冲中的 body,
+    // 排到就绪队列的末尾; 对端已经关闭写时也要先处理完这些请求
+    if (alive == 2 || (alive && (read_state == 2 || 
+            (conn->req != NULL && conn->req->sink != NULL && conn->rlen > conn->req->head_len)))) {
+        container_ready_add(reactor, conn);
+        return 1;
+    }
+    if (!alive || conn->read_eof) {
+        conn->closing = 1;
+        return conn->out_head != NULL || conn->zc_head != NULL;
+    }
+    return 1;
+}
+
+
+// 处理一次事件, 然后关闭连接, 或者交还空闲连接的缓冲并重新设置超时
+static void epoll_conn_run(reactor_tp reactor, connection_tp conn, uint32_t events)
+{
+    if (!epoll_conn_event(reactor, conn, events)) {
+        connection_close(conn);
+        connection_free(conn);
+        return;
+    }
+    connection_idle(conn);
+    container_conn_timer(reactor, conn);
+}
+
+
+// 就绪队列上的连接各再处理一批请求, 这一轮中重新排队的连接等下一次 epoll_wait 之后再处理
+// 读缓冲中的数据已经读出, 边缘触发下不会再有事件, 只能由这里继续
+static void epoll_ready_run(reactor_tp reactor)
+{
+    connection_tp last = reactor->ready_tail;
+    connection_tp conn;
+    int end = 0;
+
+    while (!end && (conn = reactor->ready_head) != NULL) {
+        end = conn == last;
+        container_ready_del(conn);
+        epoll_conn_run(reactor, conn, EPOLLIN);
+    }
+}
+
+
+// 在 reactor 线程中先绑定 cpu, 再分配 reactor 自己的内存 (时间轮, 以后的连接对象和读缓冲),
+// 这些页面在第一次写入时从这个 cpu 的 NUMA 节点分配
+static void container_reactor_setup(reactor_tp reactor)
+{
+    if (reactor->cpu >= 0) {
+        if (dm_cpu_bind_thread(reactor->cpu) != 0)
+            printf("[Server: Warn] reactor %d: bind cpu %d failed\n", reactor->id, reactor->cpu);
+#ifdef SO_INCOMING_CPU
+        // 同一个 SO_REUSEPORT 组中, 内核优先把连接交给 incoming cpu 和软中断所在 cpu 相同的 socket
+        for (int l = 0; l < reactor->listen_num; ++l)
+            if (!reactor->listeners[l].shared)
+                setsockopt(reactor->listeners[l].fd, SOL_SOCKET, SO_INCOMING_CPU, 
+                        &reactor->cpu, sizeof(reactor->cpu));
+#endif
+    }
+    dm_timer_wheel_init(&reactor->wheel, CONTAINER_WHEEL_SLOTS, CONTAINER_WHEEL_TICK);
+}
+
+
+// 把所有监听 socket 加入 epoll 或者从 epoll 中去掉, data.ptr 指向 listener_t
+static void epoll_listen_ctl(reactor_tp reactor, int op)
+{
+    struct epoll_event ev;
+
+    for (int l = 0; l < reactor->listen_num; ++l) {
+        ev.events = EPOLLIN | (reactor->listeners[l].shared ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = &reactor->listeners[l];
+        epoll_ctl(reactor->epfd, op, reactor->listeners[l].fd, op == EPOLL_CTL_DEL ? NULL : &ev);
+    }
+}
+
+
+static int epoll_is_listener(reactor_tp reactor, void *ptr)
+{
+    return (listener_t *)ptr >= reactor->listeners && 
+        (listener_t *)ptr < reactor->listeners + reactor->listen_num;
+}
+
+
+// 连接数达到 max_conns 时从 epoll 中去掉监听 socket
+static int container_accept_pause(reactor_tp reactor)
+{
+    int max_conns = g_server_conf_all._conf_server.max_conns;
+
+    if (max_conns <= 0 || reactor->conn_num < max_conns)
+        return 0;
+    if (!reactor->accept_paused) {
+        epoll_listen_ctl(reactor, EPOLL_CTL_DEL);
+        reactor->accept_paused = 1;
+    }
+    return 1;
+}
+
+
+// 连接数降下来以后重新 accept, 排空时监听 socket 已经去掉, 不再恢复
+static void container_accept_resume(reactor_tp reactor)
+{
+    if (!reactor->accept_paused || reactor->draining || 
+            reactor->conn_num >= g_server_conf_all._conf_server.max_conns)
+        return;
+    epoll_listen_ctl(reactor, EPOLL_CTL_ADD);
+    reactor->accept_paused = 0;
+}
+
+
+// 监听 socket 为非阻塞, 一次取完所有已完成握手的连接
+// 连接数达到上限时停止 accept, 之后的连接留在 backlog 中, 不再占用 reactor 的资源
+static void epoll_accept(reactor_tp reactor, listener_t *listener)
+{
+    struct epoll_event ev;
+    int i_connfd;
+    int one = 1;
+
+    while (!container_accept_pause(reactor) && 
+            (i_connfd = accept4(listener->fd, (struct sockaddr*)NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+
+        connection_tp conn_ptr = conn_slab_acquire(&reactor->slab);
+        if (conn_ptr == NULL) {
+            close(i_connfd);
+            continue;
+        }
+        conn_ptr->per_handle_data->Socket = i_connfd;
+        conn_ptr->per_handle_data->efd = reactor->epfd;
+        conn_ptr->per_handle_data->reactor = reactor;
+        conn_ptr->per_handle_data->conn = conn_ptr;
+        conn_ptr->timer.callback = epoll_conn_timeout;
+        if (listener->tls && reactor->ssl_ctx != NULL && tls_accept(conn_ptr, reactor->ssl_ctx) < 0) {
+            close(i_connfd);
+            connection_free(conn_ptr);
+            continue;
+        }
+#ifdef SO_ZEROCOPY
+        // 大的动态响应用 MSG_ZEROCOPY 发送, TLS 连接的数据经过 SSL_write 加密, 用不上
+        if (g_server_conf_all._conf_server.zerocopy_min > 0 && conn_ptr->ssl == NULL)
+            conn_ptr->zerocopy = setsockopt(i_connfd, SOL_SOCKET, SO_ZEROCOPY, 
+                    &one, sizeof(one)) == 0;
+#endif
+        container_conn_timer(reactor, conn_ptr);
+
+        // 边缘触发, 每次事件都要把 socket 读到 EAGAIN; EPOLLOUT 一开始就注册, 不需要再 MOD
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = (void*)conn_ptr;
+
+        epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, i_connfd, &ev);
+        reactor->conn_num++;
+    }
+}
+
+
+// 线程池执行完的连接回到 reactor, 接着处理后面的请求
+// 执行期间忽略的事件在边缘触发下不会再来, 这里当作可读可写处理一次
+static void epoll_offload_resume(reactor_tp reactor)
+{
+    connection_tp conn = container_offload_done(reactor);
+    connection_tp next;
+
+    for (; conn != NULL; conn = next) {
+        next = conn->done_next;
+        conn->done_next = NULL;
+        conn->offloaded = 0;
+        reactor->offloaded--;
+        req_reset(conn->req);
+        epoll_conn_run(reactor, conn, EPOLLIN | EPOLLOUT);
+    }
+}
+
+
+#define SPIN_MIN_US     8           // 自旋预算减到这个值以下就不再自旋
+
+// busy_spin 打开时先用 epoll_wait(..., 0) 自旋, 省掉阻塞和唤醒的延迟
+// 预算自适应: 自旋中等到事件时翻倍 (不超过 busy_spin), 整个预算内没有事件时减半, 
+// 减到 0 以后直接阻塞; 阻塞后在 busy_spin 之内就有事件说明负载回来了, 重新开始自旋
+static int epoll_wait_spin(reactor_tp reactor, struct epoll_event *events, int max, int timeout)
+{
+    int busy_spin = g_server_conf_all._conf_server.busy_spin;
+    unsigned long long start;
+    int n;
+
+    if (busy_spin <= 0 || timeout == 0)
+        return epoll_wait(reactor->epfd, events, max, timeout);
+
+    start = dm_timer_now_us();
+    if (reactor->spin_us > 0) {
+        do {
+            n = epoll_wait(reactor->epfd, events, max, 0);
+            if (n != 0) {
+                if (n > 0)
+                    reactor->spin_us = reactor->spin_us * 2 > busy_spin ? busy_spin : reactor->spin_us * 2;
+                return n;
+            }
+        } while (dm_timer_now_us() - start < (unsigned long long)reactor->spin_us);
+
+        reactor->spin_us /= 2;
+        if (reactor->spin_us < SPIN_MIN_US)
+            reactor->spin_us = 0;
+    }
+
+    n = epoll_wait(reactor->epfd, events, max, timeout);
+    if (n > 0 && reactor->spin_us == 0 && dm_timer_now_us() - start < (unsigned long long)busy_spin)
+        reactor->spin_us = busy_spin / 8 > SPIN_MIN_US ? busy_spin / 8 : SPIN_MIN_US;
+    return n;
+}
+
+
+// 监听 socket 配置了 busy_poll 时让 epoll_wait 也在网卡队列上忙等 (linux 6.9+)
+// 没有这个 ioctl 时只能依靠 net.core.busy_poll
+static void epoll_busy_poll(reactor_tp reactor)
+{
+#ifdef EPIOCSPARAMS
+    struct epoll_params params;
+    int busy_poll = 0;
+
+    for (int l = 0; l < g_server_conf_all._conf_server.listener_num; ++l)
+        if (g_server_conf_all._conf_server.listeners[l].busy_poll > busy_poll)
+            busy_poll = g_server_conf_all._conf_server.listeners[l].busy_poll;
+    if (busy_poll == 0)
+        return;
+
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = busy_poll;
+    params.prefer_busy_poll = 1;
+    if (ioctl(reactor->epfd, EPIOCSPARAMS, &params) < 0)
+        printf("[Server: Warn] EPIOCSPARAMS: %s\n", strerror(errno));
+#endif
+}
+
 
 static void* epoll_handle(void* p)
 {	
-    thread_arg* arg = (thread_arg*)p;
-    long i_listenfd = arg->fd;
-    i_listenfd = createSocket();
+    reactor_tp reactor = (reactor_tp)p;
 
     struct epoll_event ev, events[1024];
     int epfd, nCounts;
-    int i_connfd;
+    int drain, done;
+    container_reactor_setup(reactor);
     epfd = epoll_create(1024);
+    reactor->epfd = epfd;
+    reactor->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->spin_us = g_server_conf_all._conf_server.busy_spin;
+    epoll_busy_poll(reactor);
+
+    // 监听 socket 的 data.ptr 指向 reactor->listeners 数组, 以此和连接区分
+    epoll_listen_ctl(reactor, EPOLL_CTL_ADD);
 
-    // ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    // 唤醒用的 eventfd 是水平触发, 所有 reactor 都会收到; data.ptr 指向 container_wake_fd 
     ev.events = EPOLLIN;
-    ev.data.fd = i_listenfd;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, i_listenfd, &ev);
+    ev.data.ptr = &container_wake_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, container_wake_fd, &ev);
 
-    char time [30] = {'\0'};
-    char res_str[RECEIVE_MAX_BYTES] = {'\0'};
-    int receive_bytes;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->done_fd;
+    if (reactor->done_fd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, reactor->done_fd, &ev);
 
-    for(;;)
+    while (!container_drain_done(reactor))
     {
-        nCounts = epoll_wait(epfd, events, 1024, -1);
+        // 有定时器时最多等到下一个 tick, 就绪队列上还有连接时不等待
+        nCounts = epoll_wait_spin(reactor, events, 1024, reactor->ready_head != NULL ? 0 :
+                container_drain_wait(reactor, dm_timer_wheel_timeout(&reactor->wheel)));
+        drain = 0;
+        done = 0;
         for(int i = 0; i < nCounts; i++)
         {
-            int tmp_epoll_recv_fd = events[i].data.fd;
             connection_tp conn = events[i].data.ptr;
 
-            if(tmp_epoll_recv_fd == i_listenfd)	{
-            
-                i_connfd = accept(i_listenfd, (struct sockaddr*)NULL, NULL);	
-
-                connection_tp conn_ptr = (connection_tp)malloc(sizeof(connection_t));
-                conn_ptr->per_handle_data =  (per_handle_data_t*)malloc(sizeof(per_handle_data_t));
-                conn_ptr->per_io_data  =  (per_io_data_t*)malloc(sizeof(per_io_data_t));     
-                conn_ptr->req = (request_t*)malloc(sizeof(request_t));
+            if ((void *)conn == (void *)&container_wake_fd) {
+                drain = 1;
 
-                conn_ptr->per_handle_data->Socket = i_connfd;
-                conn_ptr->per_handle_data->efd = epfd;
-                req_parse_init(conn_ptr->req);
+            } else if ((void *)conn == (void *)&reactor->done_fd) {
+                done = 1;
 
-                ev.events = EPOLLIN;
-                ev.data.ptr = (void*)conn_ptr;
+            } else if (epoll_is_listener(reactor, conn)) {
 
-                epoll_ctl( epfd, EPOLL_CTL_ADD, i_connfd, &ev );
+                if (!reactor->draining)
+                    epoll_accept(reactor, (listener_t *)conn);
             
             } else {
 
-                int fd = conn->per_handle_data->Socket;
+                epoll_conn_run(reactor, conn, events[i].events);
+            }
+        }
 
-                receive_bytes = recv( fd, res_str, sizeof(res_str), 0 );
-                if (receive_bytes == -1) {
-                    connection_close(conn);
-	                connection_free(conn);
-                    continue;
-                }
-                
-                req_parse_http(conn->req, res_str);
+        epoll_ready_run(reactor);
 
-                server_time(time);
-                log_info("SERVER", 506, "[%s][Server: Info] %s %d id: %d\n",time , 
-                    conn->req->path, (int)strlen(res_str), getpid());
-                memset(time, 0, 30);
-                
-                router_handle(conn, conn->req);
+        // 回来的连接可能被关闭, 和超时一样放在这一批事件之后处理
+        if (done)
+            epoll_offload_resume(reactor);
 
-            }
+        container_accept_resume(reactor);
+
+        // 同样在这一批事件之后开始排空
+        if (drain && !reactor->draining) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, container_wake_fd, NULL);
+            if (!reactor->accept_paused)
+                epoll_listen_ctl(reactor, EPOLL_CTL_DEL);
+            container_drain_start(reactor);
         }
+
+        // 在处理完这一批事件之后再处理超时, 超时回调释放的连接不会再出现在 events 中
+        dm_timer_wheel_expire(&reactor->wheel);
     }
-    close(i_listenfd);
+
+    // 到了截止时间还没有结束的连接
+    while (reactor->slab.used_list != NULL) {
+        connection_tp conn = reactor->slab.used_list;
+        connection_close(conn);
+        connection_free(conn);
+    }
+    close(reactor->done_fd);
+    reactor->done_fd = -1;
     close(epfd);
+    return NULL;
 }
 
 
-extern void epoll_container_make() {
+// 取出环境变量 MASTER_LISTEN_FDS 中继承来的监听 socket, 放到 *fds (调用者释放)
+// 列表格式不对或者其中有不是监听 socket 的 fd 时返回 -1, 新程序不启动, 旧 master 继续服务
+static int container_listen_inherit(int **fds)
+{
+    const char *env = getenv(MASTER_LISTEN_FDS);
+    const char *p;
+    char *end;
+    int num = 0, max = 1;
+    int listening;
+    socklen_t len;
+
+    *fds = NULL;
+    if (env == NULL || *env == '\0')
+        return 0;
+    for (p = env; *p != '\0'; p++)
+        max += *p == ',';
+    *fds = (int *)malloc(max * sizeof(int));
+
+    for (p = env; ; p = end + 1) {
+        long fd = strtol(p, &end, 10);
+        len = sizeof(listening);
+        if (end == p || fd < 0 || fd > INT_MAX || (*end != ',' && *end != '\0') ||
+                getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening) {
+            printf("[Server: Error] bad inherited listening socket list \"%s\"\n", env);
+            free(*fds);
+            *fds = NULL;
+            return -1;
+        }
+        (*fds)[num++] = (int)fd;
+        if (*end == '\0')
+            break;
+    }
+    unsetenv(MASTER_LISTEN_FDS);
+    return num;
+}
 
-    long fd = 1;
-    thread_arg* arg = malloc(sizeof(thread_arg));
-    arg->cmp = g_cmp;
-    arg->fd = fd;
 
-    for (int i = 0; i < 4; ++i) {
-        pthread_t roundCheck;
-        pthread_create(&roundCheck, NULL, epoll_handle, (void*)arg);
-        pthread_join(roundCheck, NULL);
+// 在继承来的 socket 中找一个监听在 ls 的地址和端口上的, 取走它; 没有时返回 -1
+// 新配置可以增加, 删除或者调整监听地址的顺序, 不能按位置对应
+static int container_listen_take(int *fds, int num, const conf_listener *ls)
+{
+    for (int i = 0; i < num; ++i) {
+        if (fds[i] >= 0 && socket_listen_is(fds[i], ls) == 1) {
+            int fd = fds[i];
+            fds[i] = -1;
+            return fd;
+        }
     }
-    
+    return -1;
+}
+
+
+// io 核来自 io_cpus; pool 核没有配置时取 io 核以外的核, 没有剩余时与 reactor 共用
+static void container_cpu_init()
+{
+    container_io_cpus.num = 0;
+    container_pool_cpus.num = 0;
+    if (!g_server_conf_all._conf_server.cpu_affinity)
+        return;
+
+    dm_cpu_parse(g_server_conf_all._conf_server.io_cpus, &container_io_cpus);
+    if (g_server_conf_all._conf_server.pool_cpus[0] != '\0') {
+        dm_cpu_parse(g_server_conf_all._conf_server.pool_cpus, &container_pool_cpus);
+    } else {
+        dm_cpu_parse(NULL, &container_pool_cpus);
+        dm_cpu_exclude(&container_pool_cpus, &container_io_cpus);
+        if (container_pool_cpus.num == 0)
+            container_pool_cpus = container_io_cpus;
+    }
+    printf("[Server: Info] cpu affinity: %d io cpus, %d pool cpus\n", 
+            container_io_cpus.num, container_pool_cpus.num);
+}
+
+
+// unix socket 不支持 SO_REUSEPORT
+static int container_listen_reuseport(const conf_listener *ls)
+{
+    return ls->family != CONF_LISTEN_UNIX;
+}
+
+
+// 在 fork 之前为每个监听地址建立监听 socket: TCP 地址为 worker_num 个 worker 的每个 reactor 各建一个, 
+// 由内核在它们之间分配新连接; 有 TLS 的监听地址时同时建立共享的 SSL_CTX
+static int container_listen_init(int worker_num)
+{
+    conf_server *cf = &g_server_conf_all._conf_server;
+    int reactor_num = cf->reactor_num;
+    int tls = 0;
+    int i = 0;
+    if (reactor_num <= 0)
+        reactor_num = 1;
+
+    container_cpu_init();
+
+    // 负载计数在所有 worker 之间共享, 全局的 in-flight 上限才能生效
+    container_load = (container_load_t *)mmap(NULL, sizeof(container_load_t), 
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (container_load == MAP_FAILED) {
+        container_load = NULL;
+    } else {
+        atomic_init(&container_load->inflight, 0);
+        atomic_init(&container_load->shed, 0);
+    }
+
+    container_listen_reactors = worker_num * reactor_num;
+    container_listen_num = 0;
+    for (int l = 0; l < cf->listener_num; ++l) {
+        tls |= cf->listeners[l].tls;
+        container_listen_num += container_listen_reuseport(&cf->listeners[l]) ? container_listen_reactors : 1;
+    }
+
+    if (tls) {
+        container_ssl_ctx = tls_ctx_create();
+        if (container_ssl_ctx == NULL) {
+            printf("[Server: Error] load certificate failed\n");
+            return -1;
+        }
+    }
+
+    container_listen_fds = (int *)malloc(container_listen_num * sizeof(int));
+
+    // 升级时先使用旧 master 传下来的监听 socket, 它们的 accept 队列中的连接不会丢失
+    // 按地址和端口对应到监听配置上, 没有对应的配置的关闭, 没有继承到 socket 的配置重新建立
+    int *inherit_fds;
+    int inherit_num = container_listen_inherit(&inherit_fds);
+    int reused = 0;
+    if (inherit_num < 0) {
+        container_listen_num = 0;
+        container_listen_free();
+        return -1;
+    }
+
+    for (int l = 0; l < cf->listener_num; ++l) {
+        conf_listener *ls = &cf->listeners[l];
+        int reuseport = container_listen_reuseport(ls);
+        int count = reuseport ? container_listen_reactors : 1;
+
+        for (int k = 0; k < count; ++k, ++i) {
+            container_listen_fds[i] = container_listen_take(inherit_fds, inherit_num, ls);
+            if (container_listen_fds[i] >= 0) {
+                reused++;
+                continue;
+            }
+            container_listen_fds[i] = socket_listen(ls, reuseport);
+            if (container_listen_fds[i] < 0) {
+                printf("[Server: Error] listen on %s%s%s:%d failed\n", 
+                        ls->family == CONF_LISTEN_UNIX ? "unix:" : "", 
+                        ls->address[0] ? ls->address : "*", "", ls->port);
+                for (int j = 0; j < inherit_num; ++j)
+                    if (inherit_fds[j] >= 0)
+                        close(inherit_fds[j]);
+                free(inherit_fds);
+                container_listen_num = i;
+                container_listen_free();
+                return -1;
+            }
+        }
+        if (ls->family == CONF_LISTEN_UNIX)
+            printf("[Server: Info] listening on unix:%s%s\n", ls->address, ls->tls ? " (tls)" : "");
+        else
+            printf("[Server: Info] listening on %s%s%s:%d%s\n", 
+                    ls->family == CONF_LISTEN_INET6 ? "[" : "", ls->address[0] ? ls->address : "*", 
+                    ls->family == CONF_LISTEN_INET6 ? "]" : "", ls->port, ls->tls ? " (tls)" : "");
+    }
+
+    if (inherit_num > 0) {
+        int closed = 0;
+        for (int j = 0; j < inherit_num; ++j) {
+            if (inherit_fds[j] >= 0) {
+                close(inherit_fds[j]);
+                closed++;
+            }
+        }
+        printf("[Server: Info] inherited %d listening sockets: %d reused, %d closed, %d new\n", 
+                inherit_num, reused, closed, container_listen_num - reused);
+    }
+    free(inherit_fds);
+    return 0;
+}
+
+
+static void container_listen_free()
+{
+    for (int i = 0; i < container_listen_num; ++i)
+        close(container_listen_fds[i]);
+    free(container_listen_fds);
+    container_listen_fds = NULL;
+    container_listen_num = 0;
+
+    SSL_CTX_free(container_ssl_ctx);
+    container_ssl_ctx = NULL;
+
+    if (container_load != NULL)
+        munmap(container_load, sizeof(container_load_t));
+    container_load = NULL;
+}
+
+
+static void container_drain_signal(int signum)
+{
+    uint64_t one = 1;
+    ssize_t n = write(container_wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+
+// worker 进程 (单进程模式下就是主进程) 的入口
+// SIGQUIT 让这个进程平滑退出: 停止 accept, 等待连接处理完或者到 drain_timeout
+static void container_worker(int id)
+{
+    struct sigaction sa;
+
+    container_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = container_drain_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGQUIT, &sa, NULL);
+
+    switch (g_server_conf_all._conf_server.mode) {
+    case IoUringServer:
+#ifdef __SERVER_IO_URING__
+        if (container_ssl_ctx == NULL) {
+            io_uring_container_make(id);
+            break;
+        }
+        // 一个 worker 只用一种 reactor, 有 tls 监听时明文监听也由 epoll 处理
+        printf("[Server: Warn] io_uring does not serve tls listeners, all listeners of worker %d use epoll\n", id);
+#else
+        printf("[Server: Warn] built without io_uring, use epoll\n");
+#endif // __SERVER_IO_URING__
+    default:                // TLS 连接和明文连接使用同样的 epoll reactor
+        epoll_container_make(id);
+        break;
+    }
+
+    signal(SIGQUIT, SIG_DFL);
+    close(container_wake_fd);
+    container_wake_fd = -1;
+}
+
+
+// 按配置建立 worker 的 reactor 数组, 监听 socket 来自 container_listen_init
+static reactor_tp container_reactors_create(int worker, int *num)
+{
+    int reactor_num = g_server_conf_all._conf_server.reactor_num;
+    if (reactor_num <= 0)
+        reactor_num = 1;
+
+    conf_server *cf = &g_server_conf_all._conf_server;
+    reactor_tp reactors = (reactor_tp)calloc(reactor_num, sizeof(reactor_t));
+
+    for (int i = 0; i < reactor_num; ++i) {
+        int base = 0;
+
+        reactors[i].id = i;
+        reactors[i].epfd = -1;
+        reactors[i].listen_num = cf->listener_num;
+        reactors[i].listeners = (listener_t *)calloc(cf->listener_num, sizeof(listener_t));
+        for (int l = 0; l < cf->listener_num; ++l) {
+            int reuseport = container_listen_reuseport(&cf->listeners[l]);
+            reactors[i].listeners[l].fd = 
+                    container_listen_fds[base + (reuseport ? worker * reactor_num + i : 0)];
+            reactors[i].listeners[l].tls = cf->listeners[l].tls;
+            reactors[i].listeners[l].shared = !reuseport;
+            base += reuseport ? container_listen_reactors : 1;
+        }
+        reactors[i].ssl_ctx = container_ssl_ctx;
+        reactors[i].cpu = -1;
+        reactors[i].done_fd = -1;
+        reactors[i].load = container_load;
+        reactors[i].done_list = NULL;
+        pthread_mutex_init(&reactors[i].done_lock, NULL);
+        if (g_server_conf_all._conf_server.cpu_affinity && container_io_cpus.num > 0)
+            reactors[i].cpu = container_io_cpus.cpus[(worker * reactor_num + i) % container_io_cpus.num];
+        conn_slab_init(&reactors[i].slab, CONTAINER_SLAB_FREE_MAX);
+    }
+
+    container_reactors = reactors;
+    container_reactor_num = reactor_num;
+    *num = reactor_num;
+    return reactors;
+}
+
+
+// 启动 reactor_num 个 reactor, 每个 reactor 使用自己的监听 socket 和连接集合
+// SSLServer 模式下所有 reactor 共用一个 SSL_CTX, 每个连接有自己的 SSL
+extern void epoll_container_make(int worker) {
+
+    int reactor_num;
+    int pool_threads = g_server_conf_all._conf_server.pool_threads;
+    reactor_tp reactors = container_reactors_create(worker, &reactor_num);
+
+    // 在 worker 进程中建立线程池, fork 不会复制线程
+    if (pool_threads > 0)
+        container_pool = thread_pool_create_bind(pool_threads, 
+                container_pool_cpus.num > 0 ? &container_pool_cpus : NULL);
+
+    for (int i = 0; i < reactor_num; ++i)
+        pthread_create(&reactors[i].tid, NULL, epoll_handle, (void*)&reactors[i]);
+    printf("[Server: Info] worker %d: %d epoll reactors on %d listeners\n", worker, reactor_num, 
+            g_server_conf_all._conf_server.listener_num);
+
+    for (int i = 0; i < reactor_num; ++i) {
+        pthread_join(reactors[i].tid, NULL);
+        dm_timer_wheel_destroy(&reactors[i].wheel);
+        conn_slab_destroy(&reactors[i].slab);
+        pthread_mutex_destroy(&reactors[i].done_lock);
+        free(reactors[i].listeners);
+    }
+
+    // reactor 结束时已经没有在线程池中的连接
+    if (container_pool != NULL) {
+        thread_pool_destroy(container_pool);
+        container_pool = NULL;
+    }
+
+    container_reactors = NULL;
+    container_reactor_num = 0;
+    free(reactors);
     return;
 }
 
 
-extern int epoll_ssl_container()
-    {
-        /*初始化socket*/
-        int srvFd = create_socket_reuse();
+#ifdef __SERVER_IO_URING__
+
+#define URING_ENTRIES       4096
+#define URING_BUF_GROUP     0
+#define URING_BUF_NUM       1024        // provided buffer 个数, 必须是 2 的幂
+#define URING_BUF_SIZE      4096
+
+// user_data 低 3 位保存操作类型, 其余位是连接指针 (malloc 返回的地址至少 8 字节对齐)
+// accept 的 user_data 其余位是监听 socket 在 reactor->listeners 中的下标
+#define URING_OP_ACCEPT     1
+#define URING_OP_RECV       2
+#define URING_OP_SEND       3
+#define URING_OP_SHUTDOWN   4
+#define URING_OP_CLOSE      5
+#define URING_OP_WAKE       6           // container_wake_fd 可读, 开始排空
+#define URING_OP_CANCEL     7           // 取消 recv, 完成事件不需要处理
+
+#define URING_DATA(conn, op)    ((__u64)(uintptr_t)(conn) | (op))
+#define URING_CONN(data)        ((connection_tp)(uintptr_t)((data) & ~(__u64)7))
+#define URING_OP(data)          ((int)((data) & 7))
+#define URING_LISTENER(data)    ((int)((data) >> 3))
+
+typedef struct uring_reactor_t {
+    reactor_tp                  reactor;
+    struct io_uring             ring;
+    struct io_uring_buf_ring *  buf_ring;
+    char *                      bufs;
+} uring_reactor_t;
+
+// 连接在 io_uring 中的发送和关闭状态, 挂在 conn->io_ctx 上
+typedef struct uring_conn_t {
+    uring_reactor_t *   ur;
+    char *              pending;            // view 写入, 还没有提交的响应
+    size_t              plen;
+    size_t              pcap;
+    char *              inflight;           // 已经提交给内核的 send 缓冲
+    size_t              ilen;
+    int                 refs;               // 内核中还没有结束的操作数
+    int                 recv_armed;         // multishot recv 在内核中
+    int                 recv_paused;        // 流式 body 的窗口满了, 不再读取
+    int                 recv_cancel;        // 取消 recv 的请求已经提交, 还没有收到 -ECANCELED
+    int                 closing;            // 发送完毕以后关闭
+    int                 close_submitted;
+    int                 closed;             // fd 已经关闭
+} uring_conn_t;
+
+
+static struct io_uring_sqe * uring_get_sqe(struct io_uring *ring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (sqe == NULL) {          // SQ 满了, 先把已有的提交
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
+    return sqe;
+}
 
-        /*创建ssl上下文*/
-        SSL_CTX *ctx = get_ssl_ctx();
-        if(ctx == NULL){
-            return 1;
+
+static void uring_prep_accept(uring_reactor_t *ur, int l)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    io_uring_prep_multishot_accept(sqe, ur->reactor->listeners[l].fd, NULL, NULL, 0);
+    io_uring_sqe_set_data64(sqe, URING_DATA((__u64)l << 3, URING_OP_ACCEPT));
+}
+
+
+// multishot recv, 数据放在内核从 buffer ring 中挑选的缓冲里
+static void uring_prep_recv(uring_reactor_t *ur, connection_tp conn)
+{
+    uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    io_uring_prep_recv_multishot(sqe, conn->per_handle_data->Socket, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, URING_DATA(conn, URING_OP_RECV));
+    uc->refs++;
+    uc->recv_armed = 1;
+}
+
+
+// 流式 body 在读缓冲中积压到 CONN_BODY_WINDOW 时取消 multishot recv, 不再读取, TCP 流控让客户端慢下来
+// 取消生效之前已经收到的数据照样追加到读缓冲; 窗口有空间以后重新投递 recv
+// 缓冲中还有消费者没有取走的 body 时排到就绪队列上, 每一轮再交给消费者
+static void uring_recv_ctl(uring_reactor_t *ur, connection_tp conn)
+{
+    uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+    request_t *req = conn->req;
+    int body = req != NULL && req->sink != NULL;
+
+    if (uc->closing)
+        return;
+    if (body && conn->rlen >= req->head_len + CONN_BODY_WINDOW) {
+        if (uc->recv_armed && !uc->recv_cancel) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+            io_uring_prep_cancel64(sqe, URING_DATA(conn, URING_OP_RECV), 0);
+            io_uring_sqe_set_data64(sqe, URING_DATA(NULL, URING_OP_CANCEL));
+            uc->recv_cancel = 1;
         }
+        uc->recv_paused = 1;
+    } else {
+        // 取消还没有完成时不能投递新的 recv, 否则会被同一个取消请求一起取消; 等 -ECANCELED 之后再投递
+        uc->recv_paused = 0;
+        if (!uc->recv_armed && !uc->recv_cancel)
+            uring_prep_recv(ur, conn);
+    }
+    if (body && conn->rlen > req->head_len)
+        container_ready_add(ur->reactor, conn);
+}
 
-        printf("ssl load ok\n");
-        
-        int efd = epoll_create(100);
-        assert(efd > 0);
-        printf("epoll fd %d\n", efd);
 
-        struct epoll_event events[100];
-        struct epoll_event ev;
-        ev.data.fd = srvFd;
-        ev.events = EPOLLET | EPOLLIN;
-        epoll_ctl(efd, EPOLL_CTL_ADD, srvFd, &ev);
+static void uring_recycle_buf(uring_reactor_t *ur, int bid)
+{
+    io_uring_buf_ring_add(ur->buf_ring, ur->bufs + bid * URING_BUF_SIZE, URING_BUF_SIZE, 
+            bid, io_uring_buf_ring_mask(URING_BUF_NUM), 0);
+    io_uring_buf_ring_advance(ur->buf_ring, 1);
+}
 
 
-        fd_ssl_map* fsm_head = (fd_ssl_map*)malloc(sizeof(fd_ssl_map));
-        fsm_head->next = NULL;
+// view 通过 res_* 写入的数据先放到 pending, 请求处理完以后一起提交
+static int uring_sender(connection_tp conn, const char *buf, size_t len)
+{
+    uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+
+    if (uc->plen + len > uc->pcap) {
+        size_t cap = uc->pcap ? uc->pcap : 4096;
+        while (cap < uc->plen + len)
+            cap *= 2;
+        char *p = (char *)realloc(uc->pending, cap);
+        if (p == NULL)
+            return -1;
+        uc->pending = p;
+        uc->pcap = cap;
+    }
+    memcpy(uc->pending + uc->plen, buf, len);
+    uc->plen += len;
+    return (int)len;
+}
 
-        
-        printf("server is listening...\n");
-        static const char *https_response = 
-            "HTTP/1.1 200 OK\r\nServer: httpd\r\nContent-Length: %d\r\nConnection: keep-alive\r\n\r\n";
-
-        while (true) {
-            // printf("epoll wait...\n");
-            int nev = epoll_wait(efd, events, sizeof(events) / sizeof(struct epoll_event), -1);
-            if (nev < 0) {
-                printf("epoll_wait error. [%d,%s]", errno, strerror(errno));
-                break;
-            }
 
-            for (size_t i = 0; i < nev; ++i) {
-                // auto &event = events[i];
-                struct epoll_event event = events[i];
-
-                if (event.data.fd == srvFd) {  // accept
-                    struct sockaddr_in addr;
-                    socklen_t len = sizeof(addr);
-                    int cfd = accept(srvFd, (struct sockaddr *)&addr, &len);
-                    if (cfd > 0) {
-                        printf("accept client %d [%s:%d]\n", cfd, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-                        SSL *ssl = SSL_new(ctx);
-                        bool isSSLAccept = true;
-                        if (ssl == NULL) {
-                            printf("SSL_new error.\n");
-                            continue;
-                        }
-                        int flags = fcntl(cfd, F_GETFL, 0);
-                        fcntl(cfd, F_SETFL, flags | O_NONBLOCK);
-
-                        SSL_set_fd(ssl, cfd);
-                        int code;
-                        int retryTimes = 0;
-
-                        while ((code = SSL_accept(ssl)) <= 0 && retryTimes++ < 100) {
-                            if (SSL_get_error(ssl, code) != SSL_ERROR_WANT_READ) {
-                                printf("ssl accept error. %d\n", SSL_get_error(ssl, code));
-                                break;
-                            }
-                            usleep(1);
-                            printf("-------|");
-                        }
-
-                        printf("code %d, retry times %d\n", code, retryTimes);
-                        if (code != 1) {
-                            isSSLAccept = false;
-                            close(cfd);
-                            SSL_free(ssl);
-                            continue;
-                        }
-                        ev.data.fd = cfd;
-                        ev.events = EPOLLET | EPOLLIN;
-                        epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev);
-                        
-                        fd_ssl_map* per = (fd_ssl_map*)malloc(sizeof(fd_ssl_map));
-                        per->fd = cfd; per->ssl = ssl; per->next = NULL;
-                        if(fsm_head->next == NULL)
-                            fsm_head->next = per;
-                        else{
-                            per->next = fsm_head->next;
-                            fsm_head->next = per;
-                        }
-
-                    } else {
-                        perror("accept error");
-                    }
-                    continue;
-                }
-
-                fd_ssl_map* it = fsm_head;
-                fd_ssl_map* pre;
-
-                while(it->next != NULL){
-                    if(it->fd == event.data.fd)
-                        break;
-                    pre = it;
-                    it = it->next;
-                }
-
-                if (event.events & (EPOLLRDHUP | EPOLLHUP)) {
-                    printf("client %d quit!\n", event.data.fd);
-                    close(event.data.fd);
-                    SSL_shutdown(it->ssl);
-                    SSL_free(it->ssl);
-                    
-                    if(it->next == NULL)
-                        pre->next = NULL;
-                    pre->next = it->next;
-
-
-                    epoll_ctl(efd, EPOLL_CTL_DEL, event.data.fd, NULL);
-                    continue;
-                }
-
-                if (event.events & EPOLLIN) {
-                    char buf[100] = {0};
-                    int readSize = SSL_read(it->ssl, buf, sizeof(buf));
-                    if (readSize <= 0) {
-                        printf("SSL_read error. %d\n", SSL_get_error(it->ssl, readSize));
-                        continue;
-                    }
-                    printf("read: %d\n%s\n", readSize, buf);
-
-                    char sendBuf[1024] = {0};
-                    int fmtSize = sprintf(sendBuf, https_response, readSize);
-
-                    printf("*********************\n%s*********************\n", sendBuf);
-                    int writeSize = SSL_write(it->ssl, sendBuf, strlen(sendBuf));    // 发送响应头
-                    printf("format size %d, write size %d\n", fmtSize, writeSize);
-                    if (writeSize <= 0) {
-                        printf("SSL_write error. %d\n", SSL_get_error(it->ssl, writeSize));
-                    }
-                    writeSize = SSL_write(it->ssl, buf, readSize);   // 发送响应主体
-                    if (writeSize <= 0) {
-                        printf("SSL_write error. %d\n", SSL_get_error(it->ssl, writeSize));
-                    }
-                    printf("format size %d, write size %d\n", fmtSize, writeSize);
-                }
+// 提交 pending 中的响应, 需要关闭连接时 shutdown 和 close 链接在 send 之后
+// 同一时间一个连接只有一个 send 在内核中, 保证响应的顺序
+static void uring_flush(uring_reactor_t *ur, connection_tp conn)
+{
+    uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+    struct io_uring_sqe *sqe = NULL;
+    int fd = conn->per_handle_data->Socket;
+
+    if (uc->close_submitted || uc->inflight != NULL)
+        return;
+
+    if (uc->plen > 0) {
+        uc->inflight = uc->pending;
+        uc->ilen = uc->plen;
+        uc->pending = NULL;
+        uc->plen = uc->pcap = 0;
+
+        // MSG_WAITALL: 内核发送完全部数据才完成, 发送不完整时链接的操作会被取消
+        sqe = uring_get_sqe(&ur->ring);
+        io_uring_prep_send(sqe, fd, uc->inflight, uc->ilen, MSG_WAITALL | MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, URING_DATA(conn, URING_OP_SEND));
+        uc->refs++;
+    }
+
+    if (!uc->closing)
+        return;
+
+    if (sqe != NULL)
+        sqe->flags |= IOSQE_IO_LINK;
+
+    // shutdown 让 multishot recv 结束, 然后 close 释放 fd
+    sqe = uring_get_sqe(&ur->ring);
+    io_uring_prep_shutdown(sqe, fd, SHUT_RDWR);
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, URING_DATA(conn, URING_OP_SHUTDOWN));
+
+    sqe = uring_get_sqe(&ur->ring);
+    io_uring_prep_close(sqe, fd);
+    io_uring_sqe_set_data64(sqe, URING_DATA(conn, URING_OP_CLOSE));
+
+    uc->refs += 2;
+    uc->close_submitted = 1;
+}
+
+
+// 超时的连接不再读取, 发送完已经提交的响应以后关闭
+static void uring_conn_timeout(dm_timer_node_t *node)
+{
+    connection_tp conn = (connection_tp)node->data;
+    uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+
+    if (uc->closing)
+        return;
+    uc->closing = 1;
+    uring_flush(uc->ur, conn);
+}
+
+
+
+static void uring_prep_wake(uring_reactor_t *ur)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    io_uring_prep_poll_add(sqe, container_wake_fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, URING_DATA(NULL, URING_OP_WAKE));
+}
+
+
+// 排空时取消 multishot accept, 它的完成事件不再重新投递
+static void uring_drain_start(uring_reactor_t *ur)
+{
+    for (int l = 0; l < ur->reactor->listen_num; ++l) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+        io_uring_prep_cancel64(sqe, URING_DATA((__u64)l << 3, URING_OP_ACCEPT), 0);
+        io_uring_sqe_set_data64(sqe, URING_DATA(NULL, URING_OP_WAKE));
+    }
+
+    container_drain_start(ur->reactor);
+}
+
+
+static void uring_conn_new(uring_reactor_t *ur, int fd)
+{
+    connection_tp conn = conn_slab_acquire(&ur->reactor->slab);
+    if (conn == NULL) {
+        close(fd);
+        return;
+    }
+    conn->per_handle_data->Socket = fd;
+    conn->per_handle_data->reactor = ur->reactor;
+    conn->per_handle_data->conn = conn;
+
+    conn->io_ctx = calloc(1, sizeof(uring_conn_t));
+    if (conn->io_ctx == NULL) {
+        close(fd);
+        connection_free(conn);          // 还给 slab
+        return;
+    }
+    ((uring_conn_t *)conn->io_ctx)->ur = ur;
+    conn->sender = uring_sender;
+    conn->timer.callback = uring_conn_timeout;
+    ur->reactor->conn_num++;
+
+    container_conn_timer(ur->reactor, conn);
+    uring_prep_recv(ur, conn);
+}
+
+
+// fd 已经关闭并且内核中不再有引用这个连接的操作时才释放
+static void uring_conn_release(uring_reactor_t *ur, connection_tp conn)
+{
+    uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+    if (!uc->closed || uc->refs > 0)
+        return;
+
+    free(uc->pending);
+    free(uc->inflight);
+    free(uc);
+    conn->io_ctx = NULL;
+    ur->reactor->conn_num--;
+    connection_free(conn);
+}
+
+
+static void uring_handle_cqe(uring_reactor_t *ur, struct io_uring_cqe *cqe)
+{
+    int op = URING_OP(cqe->user_data);
+    int res = cqe->res;
+    unsigned int flags = cqe->flags;
+    connection_tp conn = URING_CONN(cqe->user_data);
+    uring_conn_t *uc;
+
+    if (op == URING_OP_ACCEPT) {
+        if (res >= 0 && !ur->reactor->draining)
+            uring_conn_new(ur, res);
+        else if (res >= 0)
+            close(res);
+        if (!(flags & IORING_CQE_F_MORE) && !ur->reactor->draining)
+            uring_prep_accept(ur, URING_LISTENER(cqe->user_data));
+        return;
+    }
+
+    if (op == URING_OP_CANCEL)
+        return;
+
+    if (op == URING_OP_WAKE) {
+        if (!ur->reactor->draining && res >= 0)
+            uring_drain_start(ur);
+        return;
+    }
+
+    uc = (uring_conn_t *)conn->io_ctx;
+
+    switch (op) {
+    case URING_OP_RECV:
+        if (!(flags & IORING_CQE_F_MORE)) {
+            uc->refs--;
+            uc->recv_armed = 0;
+            uc->recv_cancel = 0;
+        }
+
+        if (res > 0) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (!uc->closing) {
+                if (connection_append(conn, ur->bufs + bid * URING_BUF_SIZE, res) < 0 ||
+                    !container_dispatch(conn, ur->reactor->id, 0))
+                    uc->closing = 1;
             }
+            uring_recycle_buf(ur, bid);
+            if (!uc->closing) {
+                connection_idle(conn);
+                container_conn_timer(ur->reactor, conn);
+            }
+            uring_flush(ur, conn);
+            uring_recv_ctl(ur, conn);
+        } else if (res == -ENOBUFS || res == -ECANCELED) {
+            // buffer ring 暂时用完, 或者暂停读取时取消了 recv; 窗口这时可能已经腾空, 由 uring_recv_ctl 决定是否重新投递
+            // 关闭时 shutdown 结束的 recv 返回 0 或其他错误, 不会走到这里
+            uring_recv_ctl(ur, conn);
+        } else {
+            // 对端关闭或者出错
+            uc->closing = 1;
+            uring_flush(ur, conn);
+        }
+        break;
+
+    case URING_OP_SEND:
+        uc->refs--;
+        free(uc->inflight);
+        if (res != (int)uc->ilen) {
+            // 发送失败, 丢弃剩下的响应; 已经链接的 shutdown/close 会被取消
+            uc->closing = 1;
+            uc->plen = 0;
         }
+        uc->inflight = NULL;
+        uc->ilen = 0;
+        uring_flush(ur, conn);
+        break;
+
+    case URING_OP_SHUTDOWN:
+        uc->refs--;
+        break;
+
+    case URING_OP_CLOSE:
+        uc->refs--;
+        if (res == -ECANCELED) {
+            // 链接中前面的操作失败了, 直接同步关闭
+            shutdown(conn->per_handle_data->Socket, SHUT_RDWR);
+            close(conn->per_handle_data->Socket);
+        }
+        uc->closed = 1;
+        break;
+    }
+
+    uring_conn_release(ur, conn);
+}
 
-        fd_ssl_map* it = fsm_head;
-        while(it->next != NULL){
-            close(it->fd);
-            SSL_free(it->ssl);
+
+// 就绪队列上的连接把缓冲中的 body 再交给消费者, 与 epoll_ready_run 相同, 这一轮中重新排队的等下一轮
+static void uring_ready_run(uring_reactor_t *ur)
+{
+    connection_tp last = ur->reactor->ready_tail;
+    connection_tp conn;
+    int end = 0;
+
+    while (!end && (conn = ur->reactor->ready_head) != NULL) {
+        uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+        end = conn == last;
+        container_ready_del(conn);
+        if (uc->closing)
+            continue;
+        if (!container_dispatch(conn, ur->reactor->id, 0))
+            uc->closing = 1;
+        else
+            container_conn_timer(ur->reactor, conn);
+        uring_flush(ur, conn);
+        uring_recv_ctl(ur, conn);
+    }
+}
+
+
+static void* io_uring_handle(void* p)
+{
+    uring_reactor_t *ur = (uring_reactor_t *)p;
+    struct io_uring_cqe *cqe;
+    unsigned int head, count;
+    int ret;
+
+    container_reactor_setup(ur->reactor);
+
+    // ring 只在这个线程中提交, 可以使用 SINGLE_ISSUER, 旧内核不支持时退回默认参数
+    ret = io_uring_queue_init(URING_ENTRIES, &ur->ring, 
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+    if (ret < 0)
+        ret = io_uring_queue_init(URING_ENTRIES, &ur->ring, 0);
+    if (ret < 0) {
+        printf("[Server: Error] io_uring_queue_init: %s\n", strerror(-ret));
+        return NULL;
+    }
+
+    ur->buf_ring = io_uring_setup_buf_ring(&ur->ring, URING_BUF_NUM, URING_BUF_GROUP, 0, &ret);
+    if (ur->buf_ring == NULL) {
+        printf("[Server: Error] io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        io_uring_queue_exit(&ur->ring);
+        return NULL;
+    }
+    ur->bufs = (char *)malloc(URING_BUF_NUM * URING_BUF_SIZE);
+    for (int i = 0; i < URING_BUF_NUM; i++) {
+        io_uring_buf_ring_add(ur->buf_ring, ur->bufs + i * URING_BUF_SIZE, URING_BUF_SIZE, 
+                i, io_uring_buf_ring_mask(URING_BUF_NUM), i);
+    }
+    io_uring_buf_ring_advance(ur->buf_ring, URING_BUF_NUM);
+
+    for (int l = 0; l < ur->reactor->listen_num; ++l)
+        uring_prep_accept(ur, l);
+    uring_prep_wake(ur);
+
+    // 一次系统调用提交所有新的操作并等待完成事件
+    while (!container_drain_done(ur->reactor)) {
+        int timeout = container_drain_wait(ur->reactor, dm_timer_wheel_timeout(&ur->reactor->wheel));
+        if (ur->reactor->ready_head != NULL)
+            timeout = 0;
+        if (timeout >= 0) {
+            struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+            ret = io_uring_submit_and_wait_timeout(&ur->ring, &cqe, 1, &ts, NULL);
+            if (ret == -ETIME)
+                ret = 0;
+        } else {
+            ret = io_uring_submit_and_wait(&ur->ring, 1);
+        }
+        if (ret < 0 && ret != -EINTR) {
+            printf("[Server: Error] io_uring_submit_and_wait: %s\n", strerror(-ret));
+            break;
         }
-        
 
-        SSL_CTX_free(ctx);
-        close(srvFd);
-        close(efd);
-        return 0;
+        count = 0;
+        io_uring_for_each_cqe(&ur->ring, head, cqe) {
+            uring_handle_cqe(ur, cqe);
+            count++;
+        }
+        io_uring_cq_advance(&ur->ring, count);
+
+        uring_ready_run(ur);
+        dm_timer_wheel_expire(&ur->reactor->wheel);
+    }
+
+    io_uring_free_buf_ring(&ur->ring, ur->buf_ring, URING_BUF_NUM, URING_BUF_GROUP);
+    io_uring_queue_exit(&ur->ring);
+
+    // 到了截止时间还没有结束的连接, ring 退出以后内核不再引用它们
+    while (ur->reactor->slab.used_list != NULL) {
+        connection_tp conn = ur->reactor->slab.used_list;
+        uring_conn_t *uc = (uring_conn_t *)conn->io_ctx;
+        if (!uc->closed)
+            close(conn->per_handle_data->Socket);
+        uc->closed = 1;
+        uc->refs = 0;
+        uring_conn_release(ur, conn);
     }
+    free(ur->bufs);
+    return NULL;
+}
+
+
+// 与 epoll container 相同的 reactor 划分, 每个 reactor 一个 io_uring
+extern void io_uring_container_make(int worker) {
+
+    int reactor_num;
+    reactor_tp reactors = container_reactors_create(worker, &reactor_num);
+
+    uring_reactor_t *urs = (uring_reactor_t *)calloc(reactor_num, sizeof(uring_reactor_t));
+
+    for (int i = 0; i < reactor_num; ++i) {
+        urs[i].reactor = &reactors[i];
+        pthread_create(&reactors[i].tid, NULL, io_uring_handle, (void*)&urs[i]);
+    }
+    printf("[Server: Info] worker %d: %d io_uring reactors on %d listeners\n", worker, reactor_num, 
+            g_server_conf_all._conf_server.listener_num);
+
+    for (int i = 0; i < reactor_num; ++i) {
+        pthread_join(reactors[i].tid, NULL);
+        dm_timer_wheel_destroy(&reactors[i].wheel);
+        conn_slab_destroy(&reactors[i].slab);
+        pthread_mutex_destroy(&reactors[i].done_lock);
+        free(reactors[i].listeners);
+    }
+
+    free(urs);
+    container_reactors = NULL;
+    container_reactor_num = 0;
+    free(reactors);
+}
+
+#endif // __SERVER_IO_URING__
+
 
 #endif // linux
\ No newline at end of file
@@ -28,10 +28,13 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <dmfserver/cpool.h>
 
 static mysql_pool pool_mysql; //连接池定义
 
+mysql_conn * conn_pop();
+
 
 
 //创建一个新的mysql连接节点
@@ -85,10 +88,40 @@ void conn_push(mysql_conn * conn)
 }
 
 
+//建立 min_connections 个连接放入连接池, 调用时持有 pool_mysql.lock
+static void mysql_pool_fill()
+{
+	mysql_conn * conn;
+	pool_mysql.need_fill = 0;
+	for (int i = 0; i < pool_mysql.min_connections; ++i) {
+		conn = mysql_new_connection();
+		if (conn)
+			conn_push(conn);
+	}
+}
+
+
+#ifdef __linux__
+//fork 出来的 worker 不能使用父进程的连接: socket 是共用的, mysql_close 会发送 COM_QUIT
+//断开所有进程的连接, 所以只关闭子进程里的 fd, 第一次取连接时再建立自己的连接
+static void mysql_pool_fork_child()
+{
+	mysql_conn *conn;
+	while ((conn = conn_pop()) != NULL) {
+		close(conn->conn.net.fd);
+		free(conn);
+	}
+	pool_mysql.is_idle_block = 0;
+	pthread_mutex_init(&pool_mysql.lock,NULL);
+	pthread_cond_init(&pool_mysql.idle_signal,NULL);
+	pool_mysql.need_fill = 1;
+}
+#endif
+
+
 //初始化mysql连接池
 void mysql_pool_init()
 {
-	mysql_conn * conn;    //定义一个conn变量，他是指向mysql_conn变量的指针
 	strncpy(pool_mysql.host, g_server_conf_all._conf_model.host, sizeof(pool_mysql.host));
 	strncpy(pool_mysql.username, g_server_conf_all._conf_model.username, sizeof(pool_mysql.username));
 	strncpy(pool_mysql.password, g_server_conf_all._conf_model.password, sizeof(pool_mysql.password));
@@ -100,17 +133,17 @@ void mysql_pool_init()
 	pool_mysql.mysql_list = NULL;			// 初始化连接池为空
 	pool_mysql.is_idle_block = 0;
 	pool_mysql.min_connections = 20;
+	pool_mysql.need_fill = 0;
 
 	pthread_mutex_init(&pool_mysql.lock,NULL);
 	pthread_cond_init(&pool_mysql.idle_signal,NULL);
 	
 	pthread_mutex_lock(&pool_mysql.lock);
-	for (int i = 0; i < pool_mysql.min_connections; ++i) {
-		conn = mysql_new_connection();
-		if (conn)
-			conn_push(conn);
-	}
+	mysql_pool_fill();
 	pthread_mutex_unlock(&pool_mysql.lock);
+#ifdef __linux__
+	pthread_atfork(NULL, NULL, mysql_pool_fork_child);
+#endif
 
 	printf("[SERVER: Info] %d connections mysqlpool init successfully...\n", pool_mysql.free_connections);
 }
@@ -136,6 +169,8 @@ mysql_conn * conn_pop()
 mysql_conn * get_mysql_connection()
 {
 	pthread_mutex_lock(&pool_mysql.lock);
+	if (pool_mysql.need_fill)
+		mysql_pool_fill();
 	mysql_conn *conn = conn_pop();
 	pthread_mutex_unlock(&pool_mysql.lock);
 	return conn;
@@ -146,6 +181,8 @@ mysql_conn * get_mysql_connection()
 mysql_conn * get_mysql_connection_block()
 {
 	pthread_mutex_lock(&pool_mysql.lock);
+	if (pool_mysql.need_fill)
+		mysql_pool_fill();
 	mysql_conn *conn = conn_pop();
 	// printf("current free connections %d\n ", pool_mysql.free_connections);
 	if (conn == NULL) {
@@ -69,14 +69,36 @@ static void *log_thread(void *arg)
 	return NULL;
 }
 
-// 定义日志初始化函数
-void log_init() 
+static void log_thread_start()
 {
 	// 创建日志写入线程
 	pthread_t tid;
 	pthread_create(&tid, NULL, log_thread, NULL);
 	// 分离日志写入线程
 	pthread_detach(tid);
+}
+
+#ifdef __linux__
+// fork 时先拿住锁, 缓冲区不会停在写了一半的状态;
+// 写日志的线程不会被 fork 到子进程 (worker) 里, 子进程的条件变量里还记着它在等待,
+// 所以锁和条件变量都重新初始化, 再建立新的写入线程
+static void log_fork_prepare() { pthread_mutex_lock(&log_mutex); }
+static void log_fork_parent() { pthread_mutex_unlock(&log_mutex); }
+static void log_fork_child()
+{
+	pthread_mutex_init(&log_mutex, NULL);
+	pthread_cond_init(&log_cond, NULL);
+	log_thread_start();
+}
+#endif
+
+// 定义日志初始化函数
+void log_init() 
+{
+	log_thread_start();
+#ifdef __linux__
+	pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+#endif
 
     printf("[SERVER: Info] log init successfully...\n");
 }
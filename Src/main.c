@@ -45,9 +45,6 @@
 #include "./testviews/mdb.c"
 #include "./testviews/ws.c"
 
-typedef void (*worker_function)();
-void multi_process_init(worker_function _wf);
-
 int main(int argc, char ** argv) 
 {
 #if 1
@@ -19,56 +19,85 @@
 /*  
     *                       MASTER FOR SERVER
     *
-    *   This model is for linux, it start a daemon process and some worker processes
-    *   when a worker process exit unexpectedly, daemon process will restart a new
-    *   worker processs.
+    *   This model is for linux, the master process binds the listeners and finishes
+    *   all shared initialization, then forks worker processes which inherit them
+    *   copy-on-write. When a worker process exits unexpectedly, the master restarts
+    *   a new worker with the same id.
     */
 
 
 #ifdef __linux__
 
+#include <dmfserver/master.h>
+#include <dmfserver/conf/conf.h>
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <stdbool.h>
 
-// define default workers num
-#define DEFAULT_WORKER_NUM 6
-// save workers pid
-static pid_t worker[DEFAULT_WORKER_NUM];
-// define function pointer
-typedef void (*worker_function)();
+// worker 启动后不到这么多秒就退出, 认为是启动即崩溃, 等一秒再重启, 避免 fork 风暴
+#define WORKER_RESPAWN_MIN 1
+
+typedef struct worker_t {
+    pid_t   pid;            // <= 0 表示需要重新 fork
+    time_t  started;
+} worker_t;
+
+static worker_t * workers = NULL;
+static int worker_num = 0;
+static pid_t master_pid;
 
-volatile bool is_running2 = true;
+static volatile sig_atomic_t is_running = 1;
+static volatile sig_atomic_t stop_signal = SIGTERM;    // 停止时发给 worker 的信号
+static volatile sig_atomic_t upgrade_request = 0;
 
 static worker_function wf;
 
+static const int * listen_fds = NULL;
+static int listen_num = 0;
+static char ** master_argv = NULL;      // 升级时 exec 用的命令行, 和启动时相同
+static pid_t upgrade_pid = 0;           // 正在启动的新 master
 
-void start_worker()
+
+static void start_worker(int id)
 {
     pid_t pid;
 
-    for(int i=0; i<DEFAULT_WORKER_NUM; i++){
-        // start worker process
-        pid = fork();
-        if (pid == 0) {
+    fflush(stdout);                 // 缓冲区里的内容不要被 worker 再输出一次
+    pid = fork();
 
-            wf();
+    if (pid == 0) {
+        // master 退出时 worker 跟着退出; prctl 之前 master 已经退出的情况单独检查
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master_pid)
+            exit(0);
 
-        } else if (pid < 0){
-            perror("fork failed!");
-        } else {
-            // father process
-            worker[i] = pid;
-        }
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGUSR2, SIG_IGN);
+
+        wf(id);
+        exit(0);
+
+    } else if (pid < 0) {
+        perror("[Master: Error] fork");
     }
+
+    workers[id].pid = pid;
+    workers[id].started = time(NULL);
 }
 
-// set daemon
+
+// set daemon, 不切换工作目录: 配置中的证书, 静态文件和模板都是相对路径
 static void daemonize()
 {
     pid_t pid = fork();
@@ -88,8 +117,6 @@ static void daemonize()
 
     umask(0);
 
-    chdir("/");
-
     close(STDIN_FILENO);
     close(STDOUT_FILENO);
     close(STDERR_FILENO);
@@ -101,80 +128,268 @@ static void daemonize()
 }
 
 
-void signal_handle(int signum){
+static void signal_handle(int signum)
+{
+    switch (signum) {
+    case SIGUSR2:
+        upgrade_request = 1;
+        break;
+    case SIGQUIT:
+        if (is_running)
+            stop_signal = SIGQUIT;
+        is_running = 0;
+        break;
+    default:
+        // kill -10 pid, kill pid 或 Ctrl-C; 平滑退出的过程中收到也会改成立即退出
+        stop_signal = SIGTERM;
+        is_running = 0;
+        break;
+    }
+}
+
 
-    if(signum == SIGUSR1) {
-        is_running2 = false;
-        for(int i=0; i<DEFAULT_WORKER_NUM; i++)
-            kill(worker[i], SIGTERM);
+// 读出 /proc/self/cmdline, 升级时用同样的参数启动新的程序 (可执行文件已经被替换)
+static char ** master_load_cmdline()
+{
+    char buf[4096], **argv;
+    ssize_t len;
+    int fd, argc = 0, i, pos;
+
+    fd = open("/proc/self/cmdline", O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return NULL;
+    buf[len] = '\0';
+
+    for (i = 0; i < len; i++)
+        if (buf[i] == '\0')
+            argc++;
+    argv = (char **)calloc(argc + 1, sizeof(char *));
+    for (i = 0, pos = 0; i < argc; i++) {
+        argv[i] = strdup(buf + pos);
+        pos += strlen(buf + pos) + 1;
     }
+    return argv;
 }
 
 
-void check_and_restart()
+// 平滑升级: fork 以后 exec 新的程序, 监听 socket 不关闭, 通过 MASTER_LISTEN_FDS 告诉它 fd;
+// 新程序完成初始化, 启动好 worker 以后才向这里发送 SIGQUIT, 启动失败时这边继续服务
+static void master_upgrade()
 {
-    int i, status;
+    char fds[1024], pid_str[32];
+    int i, len = 0;
     pid_t pid;
 
-    while(is_running2) {
-
-        for(i=0; i<DEFAULT_WORKER_NUM; i++){
-
-            pid = waitpid(worker[i], &status, WNOHANG);
-            if(pid == 0) {
-
-                // worker is running
-
-            } else if (pid == worker[i]) {
-                // worker is down
-                pid = fork();
-
-                if (pid < 0) {
-                    perror("fork failed!");
-                    exit(1);
-                } else if (pid == 0) {
-                    wf();
-                    exit(0);
-                } else {
-                    // father
-                    printf("Worker %d has been down, ", worker[i]);
-                    worker[i] = pid;
-                    printf("Start new worker %d \n", pid);
-                }
-            } else {
-                perror("waitpid failed!");
-                exit(1);
-            }
+    if (upgrade_pid > 0) {
+        printf("[Master: Warn] upgrade already in progress (pid %d)\n", upgrade_pid);
+        return;
+    }
+    if (master_argv == NULL || master_argv[0] == NULL) {
+        printf("[Master: Error] upgrade: unknown command line\n");
+        return;
+    }
+
+    // 列表放不下时不升级, 少传的 socket 会让新程序重新 bind, 旧 socket 中排队的连接丢失
+    fds[0] = '\0';
+    for (i = 0; i < listen_num; i++) {
+        len += snprintf(fds + len, sizeof(fds) - len, i ? ",%d" : "%d", listen_fds[i]);
+        if (len >= (int)sizeof(fds)) {
+            printf("[Master: Error] upgrade: too many listening sockets (%d)\n", listen_num);
+            return;
         }
-        sleep(1);
     }
+    snprintf(pid_str, sizeof(pid_str), "%d", master_pid);
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        for (i = 0; i < listen_num; i++)
+            fcntl(listen_fds[i], F_SETFD, 0);       // 去掉 FD_CLOEXEC
+        setenv(MASTER_LISTEN_FDS, fds, 1);
+        setenv(MASTER_UPGRADE_PID, pid_str, 1);
+        execv(master_argv[0], master_argv);
+        perror("[Master: Error] execv");
+        _exit(1);
+    } else if (pid < 0) {
+        perror("[Master: Error] fork");
+        return;
+    }
+
+    upgrade_pid = pid;
+    printf("[Master: Info] upgrading, new master %d\n", pid);
 }
 
 
-void multi_process_init(worker_function _wf)
+// 作为新程序被旧 master 启动时, worker 已经开始服务, 通知旧 master 平滑退出
+static void master_upgrade_done(pid_t old_pid)
 {
-    wf = _wf;
+    if (old_pid <= 1 || old_pid != getppid())
+        return;
+    printf("[Master: Info] upgrade done, stopping old master %d\n", old_pid);
+    kill(old_pid, SIGQUIT);
+}
 
-    // kill -10 pid
-    signal(SIGUSR1, signal_handle);
 
-    daemonize();
+static void worker_report(int id, int status)
+{
+    if (WIFSIGNALED(status))
+        printf("[Master: Warn] worker %d (pid %d) killed by signal %d, ", 
+                id, workers[id].pid, WTERMSIG(status));
+    else
+        printf("[Master: Warn] worker %d (pid %d) exited with %d, ", 
+                id, workers[id].pid, WEXITSTATUS(status));
+}
 
-    start_worker();
 
-    check_and_restart();
+// 阻塞在 waitpid 上, 有 worker 退出时以相同的 id 重启; 信号打断 waitpid 后检查 is_running
+static void check_and_restart()
+{
+    int i, status;
+    pid_t pid;
+
+    while (is_running) {
+
+        // fork 失败的 worker 在这里重试
+        for (i = 0; i < worker_num && is_running; i++) {
+            if (workers[i].pid <= 0)
+                start_worker(i);
+        }
 
+        if (upgrade_request) {
+            upgrade_request = 0;
+            master_upgrade();
+            continue;
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == ECHILD)
+                sleep(1);           // 所有 worker 都没有 fork 成功
+            else if (errno != EINTR) {
+                perror("[Master: Error] waitpid");
+                break;
+            }
+            continue;
+        }
+
+        if (pid == upgrade_pid) {
+            printf("[Master: Warn] upgrade failed, new master %d exited\n", pid);
+            upgrade_pid = 0;
+            continue;
+        }
+
+        for (i = 0; i < worker_num; i++) {
+            if (workers[i].pid != pid)
+                continue;
+
+            worker_report(i, status);
+            if (!is_running)
+                break;
+            if (time(NULL) - workers[i].started < WORKER_RESPAWN_MIN)
+                sleep(1);
+            start_worker(i);
+            printf("start new worker %d\n", workers[i].pid);
+            break;
+        }
+    }
 }
 
 
-// worker function
-void myworker()
+static void stop_workers()
 {
-    sleep(100);
+    int i, left = 0, sig = stop_signal;
+    pid_t pid;
+
+    for (i = 0; i < worker_num; i++) {
+        if (workers[i].pid > 0) {
+            kill(workers[i].pid, sig);
+            left++;
+        }
+    }
+
+    // SIGQUIT 时 worker 最多用 drain_timeout 秒处理完已有的连接
+    while (left > 0) {
+        pid = waitpid(-1, NULL, 0);
+        if (pid < 0) {
+            if (errno != EINTR)
+                break;
+            if (sig != stop_signal) {
+                sig = stop_signal;
+                for (i = 0; i < worker_num; i++)
+                    if (workers[i].pid > 0)
+                        kill(workers[i].pid, sig);
+            }
+            continue;
+        }
+        for (i = 0; i < worker_num; i++) {
+            if (workers[i].pid == pid) {
+                workers[i].pid = 0;
+                left--;
+            }
+        }
+    }
 }
 
 
-int main2() {
-    multi_process_init(&myworker);
+extern void multi_process_init(int num, worker_function _wf, const int *fds, int fd_num)
+{
+    struct sigaction sa;
+    const char *env;
+    pid_t old_master = 0;
+    int i;
+
+    wf = _wf;
+    worker_num = num > 0 ? num : 1;
+    workers = (worker_t *)calloc(worker_num, sizeof(worker_t));
+    listen_fds = fds;
+    listen_num = fd_num;
+    master_argv = master_load_cmdline();
+
+    env = getenv(MASTER_UPGRADE_PID);
+    if (env != NULL) {
+        old_master = (pid_t)atoi(env);
+        unsetenv(MASTER_UPGRADE_PID);
+    }
+
+    // 不设置 SA_RESTART, 让信号打断 waitpid
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handle;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    // 升级启动的新 master 已经是守护进程的子进程, 不再 fork, 保持和旧 master 的父子关系
+    if (g_server_conf_all._conf_server.daemon && old_master == 0)
+        daemonize();
+
+    master_pid = getpid();
+    printf("[Master: Info] master %d starting %d workers\n", master_pid, worker_num);
+
+    for (i = 0; i < worker_num; i++)
+        start_worker(i);
+    if (old_master > 0)
+        master_upgrade_done(old_master);
+
+    check_and_restart();
+
+    stop_workers();
+    printf("[Master: Info] all workers stopped\n");
+
+    if (master_argv != NULL) {
+        for (i = 0; master_argv[i] != NULL; i++)
+            free(master_argv[i]);
+        free(master_argv);
+        master_argv = NULL;
+    }
+    free(workers);
+    workers = NULL;
 }
-#endif // __linux__
\ No newline at end of file
+
+#endif // __linux__
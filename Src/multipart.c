@@ -0,0 +1,464 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#define _GNU_SOURCE                 // memmem
+
+#include <dmfserver/multipart.h>
+#include <dmfserver/body.h>
+
+#include <stddef.h>
+#include <strings.h>
+#include <unistd.h>
+
+
+int multipart_boundary(const char *content_type, char *boundary, size_t size)
+{
+    const char *p, *end;
+
+    if (content_type == NULL || strncasecmp(content_type, "multipart/form-data", 19) != 0)
+        return -1;
+    if ((p = strstr(content_type, "boundary=")) == NULL)
+        return -1;
+    p += 9;
+    if (*p == '"') {
+        end = strchr(++p, '"');
+        if (end == NULL)
+            return -1;
+    } else {
+        end = p + strcspn(p, "; \t");
+    }
+    if (end == p || end - p > MULTIPART_BOUNDARY_MAX || (size_t)(end - p) >= size)
+        return -1;
+    memcpy(boundary, p, end - p);
+    boundary[end - p] = '\0';
+    return (int)(end - p);
+}
+
+
+int multipart_init(multipart_t *mp, request_t *req, const char *boundary, size_t len)
+{
+    if (len == 0 || len > MULTIPART_BOUNDARY_MAX)
+        return -1;
+
+    mp->state = MULTIPART_BODY;
+    mp->req = req;
+    mp->part = NULL;
+    mp->bad = 0;
+    mp->on_part = multipart_part_spool;
+    mp->on_data = multipart_data_store;
+    mp->on_end = multipart_part_end;
+
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, boundary, len);
+    mp->dlen = len + 4;
+    for (int i = 0; i < 256; i++)
+        mp->skip[i] = (unsigned char)mp->dlen;
+    for (size_t i = 0; i + 1 < mp->dlen; i++)
+        mp->skip[(unsigned char)mp->delim[i]] = (unsigned char)(mp->dlen - 1 - i);
+
+    // 第一个分隔符前面可以没有 \r\n, 当作已经收到了
+    memcpy(mp->hold, "\r\n", 2);
+    mp->hold_len = 2;
+    mp->head_len = 0;
+    return 0;
+}
+
+
+// Boyer-Moore-Horspool: 比较窗口的最后一个字节, 不匹配时按跳转表跳过
+static const char *multipart_search(const multipart_t *mp, const char *p, const char *end)
+{
+    size_t n = mp->dlen;
+    unsigned char last;
+
+    while ((size_t)(end - p) >= n) {
+        last = (unsigned char)p[n - 1];
+        if (last == (unsigned char)mp->delim[n - 1] && memcmp(p, mp->delim, n - 1) == 0)
+            return p;
+        p += mp->skip[last];
+    }
+    return NULL;
+}
+
+
+// 末尾可能是分隔符开头的一段, 要等后面的数据才能确定, 返回它的起点, 没有时返回 end
+static const char *multipart_tail(const multipart_t *mp, const char *p, const char *end)
+{
+    const char *q = (size_t)(end - p) >= mp->dlen ? end - (mp->dlen - 1) : p;
+
+    while ((q = memchr(q, '\r', end - q)) != NULL) {
+        if (memcmp(q, mp->delim, end - q) == 0)
+            return q;
+        q++;
+    }
+    return end;
+}
+
+
+// preamble 中的数据丢弃
+static int multipart_data(multipart_t *mp, const char *data, size_t len)
+{
+    if (mp->part == NULL || len == 0)
+        return 0;
+    return mp->on_data(mp, mp->part, data, len);
+}
+
+
+// hold 中的 hold_len 个字节后面接着 p, 交出这样拼起来的前 n 个字节
+static int multipart_data2(multipart_t *mp, const char *hold, size_t hold_len, const char *p, size_t n)
+{
+    if (multipart_data(mp, hold, n < hold_len ? n : hold_len) < 0)
+        return -1;
+    return n > hold_len ? multipart_data(mp, p, n - hold_len) : 0;
+}
+
+
+static const char *multipart_delim(multipart_t *mp, const char *p)
+{
+    if (mp->part != NULL && mp->on_end(mp, mp->part) < 0)
+        return NULL;
+    mp->part = NULL;
+    mp->state = MULTIPART_DELIM;
+    return p;
+}
+
+
+// 在 part 的数据中找分隔符, 分隔符之前的数据交给 on_data
+static const char *multipart_body(multipart_t *mp, const char *p, const char *end)
+{
+    char tmp[MULTIPART_DELIM_MAX * 2];
+    size_t hold = mp->hold_len;
+    size_t n, len = end - p;
+    const char *hit, *q;
+
+    // 上一段末尾留下的字节和这一段开头拼起来找跨越两段的分隔符
+    if (hold > 0) {
+        n = len < mp->dlen ? len : mp->dlen;
+        memcpy(tmp, mp->hold, hold);
+        memcpy(tmp + hold, p, n);
+        mp->hold_len = 0;
+
+        hit = multipart_search(mp, tmp, tmp + hold + n);
+        if (hit != NULL) {
+            if (multipart_data2(mp, tmp, hold, p, hit - tmp) < 0)
+                return NULL;
+            return multipart_delim(mp, p + (hit - tmp) + mp->dlen - hold);
+        }
+        if (n == len) {
+            q = multipart_tail(mp, tmp, tmp + hold + n);
+            if (multipart_data2(mp, tmp, hold, p, q - tmp) < 0)
+                return NULL;
+            mp->hold_len = tmp + hold + n - q;
+            memcpy(mp->hold, q, mp->hold_len);
+            return end;
+        }
+        // 这一段比分隔符长, 从 hold 开始的分隔符一定已经找到了
+        if (multipart_data(mp, tmp, hold) < 0)
+            return NULL;
+    }
+
+    hit = multipart_search(mp, p, end);
+    if (hit != NULL) {
+        if (multipart_data(mp, p, hit - p) < 0)
+            return NULL;
+        return multipart_delim(mp, hit + mp->dlen);
+    }
+    q = multipart_tail(mp, p, end);
+    if (multipart_data(mp, p, q - p) < 0)
+        return NULL;
+    mp->hold_len = end - q;
+    memcpy(mp->hold, q, mp->hold_len);
+    return end;
+}
+
+
+static void multipart_kv(struct Multi_kv *kv, const char *key, const char *value, size_t len)
+{
+    snprintf(kv->key, sizeof(kv->key), "%s", key);
+    if (len >= sizeof(kv->data))
+        len = sizeof(kv->data) - 1;
+    memcpy(kv->data, value, len);
+    kv->data[len] = '\0';
+}
+
+
+// form-data; name="field"; filename="a.txt"
+static void multipart_disposition(struct Multipart *part, const char *p, const char *end)
+{
+    const char *key, *eq, *v, *vend;
+
+    for (v = p; v < end && *v != ';'; v++)
+        ;
+    multipart_kv(&part->dis, "Content-Disposition", p, v - p);
+
+    for (p = v; p < end; p = vend) {
+        while (p < end && (*p == ';' || *p == ' ' || *p == '\t'))
+            p++;
+        key = p;
+        eq = memchr(p, '=', end - p);
+        if (eq == NULL)
+            return;
+        v = eq + 1;
+        if (v < end && *v == '"') {
+            v++;
+            vend = memchr(v, '"', end - v);
+            if (vend == NULL)
+                return;
+        } else {
+            for (vend = v; vend < end && *vend != ';'; vend++)
+                ;
+        }
+        if (eq - key == 4 && strncasecmp(key, "name", 4) == 0)
+            multipart_kv(&part->name, "name", v, vend - v);
+        else if (eq - key == 8 && strncasecmp(key, "filename", 8) == 0)
+            multipart_kv(&part->filename, "filename", v, vend - v);
+        if (vend < end && *vend == '"')
+            vend++;
+    }
+}
+
+
+// 头部已经完整地在 head 中, 以空行结束
+static int multipart_part(multipart_t *mp)
+{
+    struct Multipart head;
+    const char *line, *eol, *end = mp->head + mp->head_len;
+
+    memset(&head, 0, sizeof(head));
+    head.fd = -1;
+    for (line = mp->head; line < end; line = eol + 2) {
+        eol = memchr(line, '\r', end - line);
+        if (eol == NULL || eol == line)
+            break;
+        if (eol - line > 20 && strncasecmp(line, "Content-Disposition:", 20) == 0) {
+            for (line += 20; *line == ' ' || *line == '\t'; line++)
+                ;
+            multipart_disposition(&head, line, eol);
+        } else if (eol - line > 13 && strncasecmp(line, "Content-Type:", 13) == 0) {
+            for (line += 13; *line == ' ' || *line == '\t'; line++)
+                ;
+            multipart_kv(&head.type, "Content-Type", line, eol - line);
+        }
+    }
+    mp->part = mp->on_part(mp, &head);
+    return mp->part == NULL ? -1 : 0;
+}
+
+
+// 收集 part 的头部直到空行, 头部之后的数据留给 multipart_body
+static const char *multipart_head(multipart_t *mp, const char *p, const char *end)
+{
+    size_t old = mp->head_len;
+    size_t n = end - p;
+    char *e;
+
+    if (n > MULTIPART_HEAD_MAX - old)
+        n = MULTIPART_HEAD_MAX - old;
+    memcpy(mp->head + old, p, n);
+    mp->head_len += n;
+
+    if (mp->head_len >= 2 && mp->head[0] == '\r' && mp->head[1] == '\n') {
+        e = mp->head + 2;       // 没有头部
+    } else {
+        size_t from = old > 3 ? old - 3 : 0;
+        e = memmem(mp->head + from, mp->head_len - from, "\r\n\r\n", 4);
+        if (e != NULL)
+            e += 4;
+    }
+    if (e == NULL) {
+        if (mp->head_len < MULTIPART_HEAD_MAX)
+            return p + n;
+        mp->bad = 1;            // 头部太长
+        return NULL;
+    }
+
+    p += (e - mp->head) - old;
+    mp->head_len = e - mp->head;
+    if (multipart_part(mp) < 0)
+        return NULL;
+    mp->state = MULTIPART_BODY;
+    return p;
+}
+
+
+long multipart_feed(multipart_t *mp, const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p != NULL && p < end) {
+        switch (mp->state) {
+        case MULTIPART_BODY:
+            p = multipart_body(mp, p, end);
+            break;
+        case MULTIPART_DELIM:
+            if (*p == '-')
+                mp->state = MULTIPART_CLOSE;
+            else if (*p == '\r')
+                mp->state = MULTIPART_LF;
+            else if (*p != ' ' && *p != '\t')
+                return REQ_BODY_BAD;
+            p++;
+            break;
+        case MULTIPART_LF:
+            if (*p++ != '\n')
+                return REQ_BODY_BAD;
+            mp->state = MULTIPART_HEAD;
+            mp->head_len = 0;
+            break;
+        case MULTIPART_CLOSE:
+            if (*p++ != '-')
+                return REQ_BODY_BAD;
+            mp->state = MULTIPART_END;
+            break;
+        case MULTIPART_HEAD:
+            p = multipart_head(mp, p, end);
+            break;
+        case MULTIPART_END:
+            p = end;
+            break;
+        }
+    }
+    if (p == NULL)
+        return mp->bad ? REQ_BODY_BAD : REQ_BODY_REJECT;
+    return (long)len;
+}
+
+
+int multipart_finish(multipart_t *mp)
+{
+    return mp->state == MULTIPART_END ? 0 : REQ_BODY_BAD;
+}
+
+
+struct Multipart *multipart_part_new(multipart_t *mp, const struct Multipart *head)
+{
+    request_t *req = mp->req;
+    struct Multipart *part;
+    int n = req->multi_part_num + 1;
+
+    if (n >= MULTI_PART_MAX_NUM)
+        return NULL;
+    part = (struct Multipart *)req_arena_alloc(req, sizeof(struct Multipart));
+    if (part == NULL)
+        return NULL;
+    *part = *head;
+    part->data = NULL;
+    part->length = 0;
+    part->fd = -1;
+    req->multi[n] = part;
+    req->multi_part_num = n;
+    return part;
+}
+
+
+struct Multipart *multipart_part_spool(multipart_t *mp, const struct Multipart *head)
+{
+    struct Multipart *part = multipart_part_new(mp, head);
+
+    if (part != NULL && head->filename.key[0] != '\0' && (part->fd = body_tmpfile()) < 0)
+        return NULL;
+    return part;
+}
+
+
+int multipart_data_store(multipart_t *mp, struct Multipart *part, const char *data, size_t len)
+{
+    if (part->fd >= 0) {
+        if (body_write(part->fd, data, len) < 0)
+            return -1;
+        part->length += len;
+        return 0;
+    }
+    if (part->length + len > MULTI_PART_MAX)
+        return -1;
+    part->data = req_arena_grow(mp->req, part->data, part->length, len + 1);
+    if (part->data == NULL)
+        return -1;
+    memcpy(part->data + part->length, data, len);
+    part->length += len;
+    return 0;
+}
+
+
+// 整个 body 一次交给 multipart_feed 时, 一个 part 的数据在 body 中是连续的
+int multipart_data_inplace(multipart_t *mp, struct Multipart *part, const char *data, size_t len)
+{
+    (void)mp;
+    if (part->data == NULL)
+        part->data = (char *)data;
+    else if (part->data + part->length != data)
+        return -1;
+    part->length += len;
+    return 0;
+}
+
+
+// 内存中的数据以 '\0' 结尾: 原地解析时写在分隔符的 \r 上, 分隔符已经用过了
+int multipart_part_end(multipart_t *mp, struct Multipart *part)
+{
+    if (part->fd >= 0)
+        return lseek(part->fd, 0, SEEK_SET) < 0 ? -1 : 0;
+    if (part->data == NULL && (part->data = req_arena_alloc(mp->req, 1)) == NULL)
+        return -1;
+    part->data[part->length] = '\0';
+    return 0;
+}
+
+
+typedef struct _body_multipart_t {
+    req_body_sink_t     sink;           // 必须是第一个成员
+    multipart_t         mp;
+} body_multipart_t;
+
+
+static long body_multipart_data(req_body_sink_t *sink, const char *data, size_t len)
+{
+    return multipart_feed(&((body_multipart_t *)sink)->mp, data, len);
+}
+
+
+static int body_multipart_end(req_body_sink_t *sink, request_t *req)
+{
+    (void)req;
+    return multipart_finish(&((body_multipart_t *)sink)->mp);
+}
+
+
+static void body_multipart_free(req_body_sink_t *sink)
+{
+    free(sink);
+}
+
+
+req_body_sink_t *body_multipart(connection_tp conn, const request_t *req)
+{
+    char boundary[MULTIPART_BOUNDARY_MAX + 1];
+    int len = multipart_boundary(req_param(req, "Content-Type"), boundary, sizeof(boundary));
+    body_multipart_t *b;
+
+    if (len < 0)
+        return body_spool(conn, req);
+    if ((b = (body_multipart_t *)malloc(sizeof(body_multipart_t))) == NULL)
+        return NULL;
+    // part 保存在 request 中, 请求结束时释放, 比这个消费者活得久
+    multipart_init(&b->mp, (request_t *)req, boundary, len);
+    b->sink.on_data = body_multipart_data;
+    b->sink.on_end = body_multipart_end;
+    b->sink.on_free = body_multipart_free;
+    return &b->sink;
+}
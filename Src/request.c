@@ -21,487 +21,610 @@
 	*
 	*	This model parse HTTP reqeust, and save it to "req", which is 
 	*	a important struct througout the whole http handle.
-	*/
-
-/*	
-	*						REQUEST MODEL
-	*
-	*	This model parse http, and save relevant infomation in a const request_t struct
-	*	this model doesn't do well, I will imporove it in the future. (Ajax 2023/4/28)
-	*   It Reduces server performance by 16 percent.
+	*	The request line and headers are parsed in place: request_t only keeps
+	*	offsets into the connection's read buffer, so no header is copied or allocated.
 	*/
 
 #include <dmfserver/request.h>
+#include <dmfserver/utility/dm_scan.h>
+#include <dmfserver/multipart.h>
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
 
+// 整个 body 已经在内存中 (不超过 HTTP_BODY_MAX), 各个 part 原地解析, data 直接指向 body
+// 解析失败时保留已经完整的 part
 void req_parse_multi_part (request_t *request, char *boundary ) 
 {
-	
-	char *p = NULL;
-	p = request->body.body;
-	
-	// 状态参量 这次要不要写字符
-	int state = 10;
-	int write = 0;
-	
-	 // 临时记录字符串 
-	char temp[1024] = {'\0'};
-	int i;
-	
-	// 记录multidata  
-	int k = 0 ;
-	
-	int name_or_filename = 0;
-	
-	 // 有几块内容
-	int mul_num = -1;
-	
-	int boundary_len;
-	boundary_len = strlen(boundary);
-	char b[64];
-
-	
-	while(1){
-		switch(state){
-			
-			case 10:
-				if(*p == '-' && *(p+1) == '-'){
-					state = 11;
-					mul_num++;
-				}
-				break;
-			case 11:
-				if(*p == '-'){
-					write = 0;
-				}else{
-					write = 1;
-				}
-				if(*p == '\r' && *(p+1) == '\n'){
-					// printf("%s\n", temp);
-					state = 90;				 // 校对 boundary
-					write = 0;
-				}
-				if(*p == '-' && *(p+1) == '-'){
-					state = 1;
-					mul_num--;
-				}
-				break;
-			case 20:
-				if(*p == '\n'){
-
-					write = 0;
-				}else{
-					write = 1;
-				}
-				if(*p == ':'){
-					strcpy(request->multi[mul_num]->dis.key, temp);
-					// puts(temp);
-					write = 0;
-					state = 21;
-				}
-				break;
-			case 21:
-				if(*p == ' '){
-					write = 0;
-				}else{ 
-					write = 1; 
-				}
-				if(*p == ';'){
-					strcpy(request->multi[mul_num]->dis.data, temp);
-					write = 0;
-					state = 22;
-				}
-				break;
-			case 22:
-				if(*p == ' '){					// 有空格就空开
-					write =  0;
-				}else{
-					write = 1;
-				}
-				if(*p == '=' && *(p+1) == '"'){
-					
-					// puts(temp);
-					if(strcmp(temp, "name")==0){
-						strcpy(request->multi[mul_num]->name.key, temp);
-						name_or_filename = 1;
-					}else if(strcmp(temp, "filename")==0){
-						strcpy(request->multi[mul_num]->filename.key, temp);
-						name_or_filename = 2;
-					}
-					write = 0;
-					state = 235;
-				}
-				break;
-			case 235:							// 跳过 “
-				state = 23;
-				break;
-			case 23:
-				write = 1;
-				if(*p == '"'){
-					 if(name_or_filename == 1){
-						strcpy(request->multi[mul_num]->name.data, temp);
-					}else if(name_or_filename == 2){
-						strcpy(request->multi[mul_num]->filename.data, temp);
-					}
-					// puts(temp);
-					write = 0;
-					state = 24;
-				}
-				break;
-			case 24:
-				if(*p == ';'){
-					state = 22;				// 返回 22
-				}
-				if(*p == '\r' && *(p+1) == '\n'){
-					state = 25;
-				}
-				break;
-			case 25:
-				state = 26;     // 跳过 \n
-				break;
-			case 26:
-				state = 27;
-				break;
-			case 27:
-				state = 28;
-				break;
-			case 28:
-				write = 2;
-				if(*p == '\r' && *(p+1) == '\n'){
-					memset(b, 0, 64);
-					memcpy(b, p+4, boundary_len);
-					if(strcmp(boundary, b) == 0){
-						write = 3;
-						state = 10;
-					}
-				}
-				break;
-		}
-		if(state == 90){
-			if(strcmp( temp, boundary ) != 0){
-				break;
-			} else {
-				state = 20;
-				request->multi[mul_num] = (struct Multipart *)malloc(sizeof(struct Multipart));
-				request->multi[mul_num]->data=(char *)malloc(MULTI_PART_MAX * sizeof(char));	//  创建了内存 记得删除
-				memset(request->multi[mul_num]->data, 0, MULTI_PART_MAX);
-				// printf("[request] Create a Multi part\n");
-			}
-		}
+	multipart_t mp;
 
-		if(write == 2){
-			request->multi[mul_num]->data[k] = *p;
-			k++;
-		}else if(write == 1){
-			temp[i] = *p;
-			i++;
-		}else if(write == 3){
-			request->multi[mul_num]->length = k;
-			k = 0;
-			write = 0;
-		}else{
-			if(i){
-				// k = 0;
-				i = 0;
-				memset(temp, 0, 1024);
-			}
-		}
-		p ++;
-		if(state == 1)
-			break;
+	if (multipart_init(&mp, request, boundary, strlen(boundary)) < 0)
+		return;
+	mp.on_part = multipart_part_new;
+	mp.on_data = multipart_data_inplace;
+	multipart_feed(&mp, request->body.body, request->body.length);
+}
+
+
+// 从 request 的内存块中分配, 按 8 字节对齐
+void * req_arena_alloc (request_t *request, size_t size) {
+	req_arena_t *a = request->arena;
+	size_t cap;
+
+	size = (size + 7) & ~(size_t)7;
+	if (a == NULL || a->cap - a->used < size) {
+		cap = size > REQ_ARENA_CHUNK ? size : REQ_ARENA_CHUNK;
+		if ((a = (req_arena_t *)malloc(sizeof(req_arena_t) + cap)) == NULL)
+			return NULL;
+		a->next = request->arena;
+		a->used = 0;
+		a->cap = cap;
+		request->arena = a;
+	}
+	a->used += size;
+	return a->data + a->used - size;
+}
+
+
+// 把最近一次分配的 p (已经使用 len 字节) 扩大 add 字节, 当前块放不下时复制到新块, 返回新的位置
+// p 为 NULL 时相当于分配; 换块时多留一倍空间, 边收边追加的字段总共只复制 O(n) 字节
+char * req_arena_grow (request_t *request, char *p, size_t len, size_t add) {
+	req_arena_t *a = request->arena;
+	size_t need = (len + add + 7) & ~(size_t)7;
+	char *q;
+
+	if (p != NULL && a != NULL && p >= a->data && p < a->data + a->cap &&
+			(size_t)(p - a->data) + need <= a->cap) {
+		a->used = (p - a->data) + need;
+		return p;
 	}
+	if ((q = (char *)req_arena_alloc(request, p == NULL ? need : need * 2)) == NULL)
+		return NULL;
+	if (len > 0)
+		memcpy(q, p, len);
+	return q;
+}
+
 
-	request->multi_part_num = mul_num;
-	
-#ifdef MULTI_DEBUG 
-	printf("---------------------MULTI-DEBUG--------------------\n");
-	for(; mul_num >= 0; mul_num --){
-		
-	printf("%s  : %s\n", request->multi[mul_num]->dis.key,request->multi[mul_num]->dis.data);
-	printf("%s  : %s\n", request->multi[mul_num]->name.key,request->multi[mul_num]->name.data);
-	printf("%s  : %s\n", request->multi[mul_num]->filename.key,request->multi[mul_num]->filename.data);
-	printf("Length: %d\n", request->multi[mul_num]->length );
-	printf("DATA: %#x\n", &(request->multi[mul_num]->data) );
-	
+static void req_multi_free (request_t *request) {
+	req_arena_t *a;
+
+	for (int i = 0; i <= request->multi_part_num; i++)
+		if (request->multi[i]->fd >= 0)
+			close(request->multi[i]->fd);
+	request->multi_part_num = -1;
+	while ((a = request->arena) != NULL) {
+		request->arena = a->next;
+		free(a);
 	}
-	printf("---------------------MULTI-DEBUG--------------------\n");
-#endif
 }
 
 
 void req_parse_init (request_t *request) {
-	// request->pfd = pfd;
-	request->query = hashmap_create(17);
-	request->params = hashmap_create(17);
+	request->data = NULL;
+	request->method = "";
+	request->path = "";
+	request->protocol = "";
+	request->version = "";
+	request->header_num = 0;
+	request->query_num = 0;
+	request->body.body = NULL;
+	request->body.length = 0;
+	request->multi_part_num = -1;
+	request->arena = NULL;
+	request->sink = NULL;
+	request->head_len = 0;
+	request->body_left = 0;
+	request->chunked.state = REQ_CHUNK_NONE;
+}
+
+
+// keep-alive 连接上处理下一个请求之前, 原地清空上一个请求
+void req_reset (request_t *request) {
+	if (request->sink != NULL && request->sink->on_free != NULL)
+		request->sink->on_free(request->sink);
+	free(request->body.body);
+	req_multi_free(request);
+	req_parse_init(request);
 }
 
 
-void req_parse_http(request_t *request, char *data )
+// 根据协议版本和 Connection 头判断请求之后是否保持连接
+// HTTP/1.1 默认保持, HTTP/1.0 只有带 Connection: keep-alive 时保持
+int req_keep_alive (const request_t *request) {
+	char *connection = req_param(request, "Connection");
+
+	if (connection != NULL) {
+		if (strncasecmp(connection, "close", 5) == 0)
+			return 0;
+		if (strncasecmp(connection, "keep-alive", 10) == 0)
+			return 1;
+	}
+	return strcmp(request->version, "1.1") == 0;
+}
+
+
+// 记下 [start, end) 并在 end 处结束字符串
+static void req_str_set(const request_t *request, req_str_t *str, char *start, char *end)
 {
-	
-	//p 指向 data 首地址
-	char *p;
-	p = data;   
-	
-	// 解析状态 
-	HTTP_PARSE_STATE state = PARSE_START;  
-	
-	int write = 0;
-	char temp[512] = {'\0'};
-	int i = 0;
-	
-	//初始化 multi_part_num query param  的个数
-	request->multi_part_num = -1;		//  -1 表示没有
-	
-	hashmap_node_t * query_tmp = NULL;
-	hashmap_node_t * params_tmp = NULL;
-
-	char *cls = NULL;   //Content-Length
-	char *cts = NULL;   //Content-Type
-	
-	
-	for(int t=0; t < MULTI_PART_MAX_NUM; t++)
-		request->multi[t] = NULL;
-	
-	
-	while( *p != '\0' ) {
-				
-		switch( state ){
-			case PARSE_START:
-				if( *p == 'G' || *p=='P'){
-					write = 1;
-					state = PARSE_METHOD;
-				}else{
-					state = PARSE_INVALID;			//首字母不是 P G 不合法
-				}
-				break;
-			case PARSE_METHOD:
-				if( *p == ' ') {
-					write = 0;
-					state = PARSE_PATH_START;
-					strcpy(request->method, temp);
-					//printf("%s\n", temp);
-				}
-				break;
-			
-			//处理 path
-			case PARSE_PATH_START:
-				if( *p == '/'){
-					write = 1;
-					state = PARSE_PATH;
-				}else{
-					state = PARSE_INVALID;			//path 不以 / 开头不合法
-				}
-				break;
-			case PARSE_PATH:
-				if( *p == '?'){
-					write = 0;
-					state = PARSE_QUERY_START;
-					strcpy(request->path, temp);
-					//printf("%s\n", temp);
-				}
-				if( *p == ' '){
-					write = 0;
-					state = PARSE_PV_START;
-					strcpy(request->path, temp);
-					//printf("%s\n", temp);
-				}
-				break;
-			
-			//处理 query 
-			case PARSE_QUERY_START:    //上一个字符遇到 ？
-				write = 1;
-				int flag = 1;
-				if( *p == '=' ){
-					write = 0;
-					query_tmp = (hashmap_node_t *) malloc (sizeof(hashmap_node_t));
-					query_tmp->next = NULL;
-					query_tmp->key = (char*) malloc (sizeof(char)*strlen(temp));
-					strcpy(query_tmp->key, temp);
-					// printf("key: %s\n", temp);
-					state = PARSE_QUERY_TEMP;
-					flag = 0;
-				}
-				if(*(p+1) == ' ' && flag){
-					state = PARSE_INVALID;				// 下一个字符出现空格 但还没出现”=“  不合法
-				}
-				break;
-			case PARSE_QUERY_TEMP:
-				write = 1;
-				if( *p == '&'){
-					query_tmp->value = (char*) malloc (sizeof(char)*strlen(temp));
-					strcpy(query_tmp->value, temp);
-					// printf("value: %s\n", temp);
-					hashmap_insert(request->query, query_tmp);
-					write = 0;
-					state = PARSE_QUERY_START;
-				}
-				if (*p == ' '){
-					query_tmp->value = (char*) malloc (sizeof(char)*strlen(temp));
-					strcpy(query_tmp->value, temp);
-					// printf("value: %s\n", temp);
-					hashmap_insert(request->query, query_tmp);
-					write = 0;
-					state = PARSE_PV_START;
-				}
-				break;
-			
-
-			// 解析 协议 版本
-			case PARSE_PV_START:
-				write = 1;
-				if(*p == '/'){
-					write = 0;
-					strcpy(request->protocol, temp);
-					//printf("protocol: %s\n", temp);
-					state = PARSE_PV_TEMP;
-				}
-				break;
-			case PARSE_PV_TEMP:
-				write = 1;
-				if(*p == '\r' && *(p+1) == '\n'){
-					write = 0;
-					strcpy(request->version, temp);
-					//printf("version: %s\n", temp);
-					state = PARSE_PARAM_START;
-				}
-				break;
-			
+	str->off = (unsigned int)(start - request->data);
+	str->len = (unsigned int)(end - start);
+	*end = '\0';
+}
 
-			//  解析 参数
-			case PARSE_PARAM_START:      // 跳过 \n
-				state = PARSE_PARAM1;
-				break;
-			case PARSE_PARAM1:
-				if(*p >= 'A'&& *p<='Z'){
-					write = 1;
-				}
-				if(*p == ':'){
-					write = 0;
-					params_tmp = (hashmap_node_t *) malloc (sizeof(hashmap_node_t));
-					params_tmp->next = NULL;
-					params_tmp->key = (char*) malloc (sizeof(char)*strlen(temp));
-					strcpy(params_tmp->key, temp);
-					// printf("%s\n", temp);
-					state = PARSE_PARAM2;
-				}
-				if(*p == '\r' && *(p+1) == '\n'){		// 进入 body 
-					state = PARSE_BODY_START;
-				}
-				break;
-			case PARSE_PARAM2:    // 跳过 空格
-				state = PARSE_PARAM3;
-				break;
-			case PARSE_PARAM3:
-				write = 1;
-				if(*p == '\r' && *(p+1) == '\n'){
-					write = 0;
-					params_tmp->value = (char*) malloc (sizeof(char)*strlen(temp));
-					strcpy(params_tmp->value, temp);
-					hashmap_insert(request->params, params_tmp);
-					state = PARSE_PARAM_START;
-				}
-				break;
 
+// 从 p 开始找行尾的 \r\n, 返回 \r 的位置
+static char * req_find_crlf(char *p, char *end)
+{
+	while ((p = memchr(p, '\r', end - p)) != NULL) {
+		if (p + 1 < end && p[1] == '\n')
+			return p;
+		p++;
+	}
+	return NULL;
+}
 
-			// 解析 body 
-			case PARSE_BODY_START:      // 跳过 \n
-				if(strcmp(request->method,"POST") == 0){			
-					state = PARSE_BODY;
-				}
-				else{						// \r\n\r\n  后面没有字符
-					state = 1;
-					request->body.length = 0;
-					request->body.body = NULL;
-				}
-				break;
-			case PARSE_BODY:
-				
-				cls = (char*)hashmap_get(request->params, "Content-Length");
-				if ( cls != NULL) {
-					int len = atoi(cls);
-					if( len <= HTTP_BODY_MAX) {
-						request->body.length = len;
-						request->body.body=(char *)malloc(len + 1);
-						memset(request->body.body, 0, len + 1 );
-						memcpy(request->body.body, p, len);
-					} else {
-						printf("too big %d Bytes\n", len);
-					}
-				}
-				
-				cts = hashmap_get(request->params, "Content-Type");
-				if( cts != NULL) {
-					if(strstr(cts, "multipart/form-data") != NULL){
-						char *b;
-						char boundary[64];
-						b = strstr(cts, "boundary=");
-						memset(boundary, 0, 64);
-						memcpy(boundary, b+9, strlen(b) - 9);
-						req_parse_multi_part(request, boundary);
-					}
-				}
-					
-				state = 1;
-				break;
+
+// key1=value1&key2=value2, 没有 '=' 的参数忽略
+static void req_parse_query(request_t *request, char *p, char *end)
+{
+	char *amp, *eq;
+
+	while (p < end && request->query_num < HTTP_QUERY_NUM) {
+		eq = (char *)dm_scan(p, end, "=&", 2);
+		if (eq == end || *eq == '&') {
+			p = eq + 1;
+			continue;
 		}
-		
-		if (write) {
-			temp[i] = *p;
-			i++;
-		} else {
-			i=0;
-			memset(temp, 0, 512);
+		amp = (char *)dm_scan(eq + 1, end, "&", 1);
+
+		req_field_t *field = &request->queries[request->query_num++];
+		req_str_set(request, &field->key, p, eq);
+		req_str_set(request, &field->value, eq + 1, amp);
+		p = amp + 1;
+	}
+}
+
+
+// 请求目标的三种形式 (RFC 9112 3.2): /path 原样使用; OPTIONS * 的 path 为 "*";
+// 发给代理的 http://host/path 去掉 scheme 和 host (host 以 Host 头为准), 没有 path 时把 host 的
+// 最后一个字节改成 '/'; 返回 path 的开头, 其他形式返回 NULL
+static char * req_parse_target(const request_t *request, char *p, char *eol)
+{
+	char *host, *path;
+
+	if (*p == '/')
+		return p;
+	if (*p == '*' && (p[1] == ' ' || p + 1 == eol))
+		return strcmp(request->method, "OPTIONS") == 0 ? p : NULL;
+
+	if (eol - p > 7 && strncasecmp(p, "http://", 7) == 0)
+		host = p + 7;
+	else if (eol - p > 8 && strncasecmp(p, "https://", 8) == 0)
+		host = p + 8;
+	else
+		return NULL;
+	path = (char *)dm_scan(host, eol, "/? ", 3);
+	if (path == host || path == eol)
+		return NULL;
+	if (*path == '/')
+		return path;
+	path[-1] = '/';
+	return path - 1;
+}
+
+
+// 解析 data 开始的 len 个字节, 调用者已经用 req_parse_check 确认这是一个完整的请求
+// 请求行和头部原地解析, 只有 body 复制一份 (以 '\0' 结尾), multipart 按原来的方式解析
+// 返回 0 成功, -1 请求非法
+int req_parse_http(request_t *request, char *data, size_t len)
+{
+	char *p = data;
+	char *end = data + len;
+	char *eol, *sp, *q, *colon, *v, *vend;
+
+	request->data = data;
+	request->header_num = 0;
+	request->query_num = 0;
+	request->multi_part_num = -1;
+	request->body.body = NULL;
+	request->body.length = 0;
+	for (int t = 0; t < MULTI_PART_MAX_NUM; t++)
+		request->multi[t] = NULL;
+
+	// 请求行: METHOD SP PATH[?QUERY] SP PROTOCOL/VERSION CRLF
+	eol = req_find_crlf(p, end);
+	if (eol == NULL)
+		return -1;
+	sp = memchr(p, ' ', eol - p);
+	if (sp == NULL || sp == p)
+		return -1;
+	request->method = p;
+	*sp = '\0';
+
+	p = req_parse_target(request, sp + 1, eol);
+	if (p == NULL)
+		return -1;
+	q = (char *)dm_scan(p, eol, " ?", 2);
+	if (q == eol)
+		return -1;
+	if (*q == '?') {
+		sp = memchr(q + 1, ' ', eol - q - 1);
+		if (sp == NULL)
+			return -1;
+		req_parse_query(request, q + 1, sp);
+	} else {
+		sp = q;
+	}
+	request->path = p;
+	*q = '\0';
+
+	p = sp + 1;
+	sp = memchr(p, '/', eol - p);
+	if (sp == NULL)
+		return -1;
+	request->protocol = p;
+	request->version = sp + 1;
+	*sp = '\0';
+	*eol = '\0';
+
+	// 头部: KEY: VALUE CRLF, 值去掉两边的空白, 空行结束
+	// 每一行先一次找到 ':' 或者 '\r', 有 ':' 时再找行尾
+	for (p = eol + 2; ; p = eol + 2) {
+		colon = (char *)dm_scan(p, end, ":\r", 2);
+		if (colon == end)
+			return -1;
+		eol = *colon == ':' ? req_find_crlf(colon + 1, end) : req_find_crlf(colon, end);
+		if (eol == NULL)
+			return -1;
+		if (eol == p)
+			break;
+		// 没有 ':', 名字为空, 折行 (obs-fold, 以空白开头) 或者名字和 ':' 之间有空白的行都是非法请求 (RFC 9112 5.1, 5.2)
+		if (*colon != ':' || colon == p || *p == ' ' || *p == '\t' || 
+				colon[-1] == ' ' || colon[-1] == '\t')
+			return -1;
+		if (request->header_num >= HTTP_HEADER_NUM)
+			continue;
+
+		v = colon + 1;
+		while (v < eol && (*v == ' ' || *v == '\t'))
+			v++;
+		vend = eol;
+		while (vend > v && (vend[-1] == ' ' || vend[-1] == '\t'))
+			vend--;
+
+		req_field_t *field = &request->headers[request->header_num++];
+		req_str_set(request, &field->key, p, colon);
+		req_str_set(request, &field->value, v, vend);
+	}
+	p = eol + 2;
+
+	// body: req_parse_check 已经保证 Content-Length 声明的数据都在缓冲区中
+	char *cls = req_param(request, "Content-Length");
+	if (cls != NULL) {
+		long body_len = strtol(cls, NULL, 10);
+		if (body_len > 0 && body_len <= end - p) {
+			request->body.length = body_len;
+			request->body.body = (char *)malloc(body_len + 1);
+			if (request->body.body == NULL)
+				return -1;
+			memcpy(request->body.body, p, body_len);
+			request->body.body[body_len] = '\0';
 		}
-		p ++;
+	}
+
+	req_parse_body(request);
 
-		if(state == 1)
+#ifdef REQUEST_DEBUG 
+	printf("--------------------REQUEST-DEBUG--------------------\n");
+	printf("%s %s %s/%s headers: %d query: %d\n", request->method, request->path, 
+		request->protocol, request->version, request->header_num, request->query_num);
+	printf("length: %zu\n", request->body.length);
+	printf("--------------------REQUEST-DEBUG--------------------\n");
+#endif
+	return 0;
+}
+
+
+// body 已经整个在内存中 (Content-Length, 或者解码以后的 chunked 编码), 解析 multipart
+void req_parse_body(request_t *request)
+{
+	char boundary[MULTIPART_BOUNDARY_MAX + 1];
+
+	if (request->body.body != NULL && 
+			multipart_boundary(req_param(request, "Content-Type"), boundary, sizeof(boundary)) > 0)
+		req_parse_multi_part(request, boundary);
+}
+
+
+// 读缓冲移动或者扩大以后, 让解析结果指向新的位置
+void req_rebase(request_t *request, char *data)
+{
+	if (request->data == NULL || request->data == data)
+		return;
+	request->method = data + (request->method - request->data);
+	request->path = data + (request->path - request->data);
+	request->protocol = data + (request->protocol - request->data);
+	request->version = data + (request->version - request->data);
+	request->data = data;
+}
+
+
+// 检查缓冲区中是否已经有一个完整的请求 (头部以及 Content-Length 声明的 body)
+// 返回完整请求的长度, 0 表示还需要继续读, -1 表示请求非法或超出限制
+int req_parse_check(const char *data, size_t len)
+{
+	long body_len;
+	int head_len = req_parse_head(data, len, &body_len);
+
+	if (head_len <= 0)
+		return head_len;
+	if (body_len == HTTP_BODY_CHUNKED || body_len > HTTP_BODY_MAX)
+		return -1;				// chunked 编码只在 reactor 中流式解码
+	if (len < head_len + body_len)
+		return 0;
+	return (int)(head_len + body_len);
+}
+
+
+// Content-Length 的值只能是十进制数字, 两边可以有空白, 不接受 "+5", "5abc", "5, 7" 以及溢出的值
+// 头部已经确认以 "\r\n\r\n" 结尾, 扫描在 '\r' 处一定会停下
+static int req_content_length(const char *v, long *len)
+{
+	long n = 0;
+
+	while (*v == ' ' || *v == '\t')
+		v++;
+	if (*v < '0' || *v > '9')
+		return -1;
+	for (; *v >= '0' && *v <= '9'; v++) {
+		if (n > (LONG_MAX - (*v - '0')) / 10)
+			return -1;
+		n = n * 10 + (*v - '0');
+	}
+	while (*v == ' ' || *v == '\t')
+		v++;
+	if (*v != '\r')
+		return -1;
+	*len = n;
+	return 0;
+}
+
+
+// 检查请求行和头部是否已经完整, 返回它们的长度, 0 表示还需要继续读, -1 表示请求非法
+// body_len 返回 Content-Length 声明的长度, chunked 编码时为 HTTP_BODY_CHUNKED, 不检查 body 是否到达
+int req_parse_head(const char *data, size_t len, long *body_len)
+{
+	const char *end = data + len;
+	const char *p = data;
+	const char *v;
+	size_t head_len = 0;
+	int length = 0, chunked = 0;
+	long n;
+
+	// 只在 '\r' 处检查是否是空行, 用向量化的查找跳过其余字节
+	while (end - (p = dm_scan(p, end, "\r", 1)) > 3) {
+		if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+			head_len = p - data + 4;
 			break;
+		}
+		p++;
+	}
+	if (head_len == 0)
+		return len > HTTP_HEADER_MAX ? -1 : 0;
+	if (head_len > HTTP_HEADER_MAX)
+		return -1;
+
+	// 在头部中找 Content-Length 和 Transfer-Encoding, 每一行从 \n 之后开始
+	*body_len = 0;
+	end = data + head_len;
+	for (p = data; p < end; p = dm_scan(p, end, "\n", 1) + 1) {
+		if (end - p > 15 && strncasecmp(p, "Content-Length:", 15) == 0) {
+			// 重复的 Content-Length 值必须相同: 这里用最后一个, req_param 取的是第一个
+			if (req_content_length(p + 15, &n) < 0 || (length && n != *body_len))
+				return -1;
+			*body_len = n;
+			length = 1;
+		} else if (end - p > 18 && strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+			// 只支持 chunked 一种编码
+			for (v = p + 18; *v == ' ' || *v == '\t'; v++)
+				;
+			if (strncasecmp(v, "chunked", 7) != 0)
+				return -1;
+			for (v += 7; *v == ' ' || *v == '\t'; v++)
+				;
+			if (*v != '\r')
+				return -1;
+			chunked = 1;
+		}
+	}
+	// 两个头同时出现时前后的代理可能理解成不同的请求边界 (request smuggling), 拒绝
+	if (chunked) {
+		if (length)
+			return -1;
+		*body_len = HTTP_BODY_CHUNKED;
 	}
-	
-/*
-	switch(state){
-		case 1:
+	return (int)head_len;
+}
+
+
+void req_chunked_init(req_chunked_t *chunked, size_t max, size_t meta_max)
+{
+	chunked->state = REQ_CHUNK_SIZE;
+	chunked->digits = 0;
+	chunked->left = 0;
+	chunked->total = 0;
+	chunked->max = max;
+	chunked->meta = 0;
+	chunked->meta_max = meta_max;
+}
+
+
+static int req_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+
+// 扩展和 trailer 不使用, 只累计长度
+static int req_chunked_meta(req_chunked_t *chunked, size_t n)
+{
+	chunked->meta += n;
+	return chunked->meta_max > 0 && chunked->meta > chunked->meta_max ? -1 : 0;
+}
+
+
+// 解码 chunked 编码的 body, 数据直接交给 sink, 不复制; 输入可以在任意位置断开, 分多次调用
+// 返回消耗的输入字节数, 消费者没有全部接收时提前返回; REQ_BODY_BAD 格式错误, REQ_BODY_REJECT 超过限制或者消费者拒绝
+// 结束以后 (REQ_CHUNK_DONE) 不再消耗输入, 后面是下一个请求
+long req_chunked_feed(req_chunked_t *chunked, const char *data, size_t len, req_body_sink_t *sink)
+{
+	const char *p = data;
+	const char *end = data + len;
+	const char *q;
+	long used;
+	size_t n;
+	int x;
+
+	while (p < end && chunked->state != REQ_CHUNK_DONE) {
+		switch (chunked->state) {
+		case REQ_CHUNK_SIZE:
+			if ((x = req_hex(*p)) >= 0) {
+				if (chunked->left > (SIZE_MAX >> 4))
+					return REQ_BODY_REJECT;
+				chunked->left = (chunked->left << 4) | x;
+				chunked->digits++;
+			} else if (chunked->digits == 0) {
+				return REQ_BODY_BAD;
+			} else if (*p == ';' || *p == ' ' || *p == '\t') {
+				chunked->state = REQ_CHUNK_EXT;
+			} else if (*p == '\r') {
+				chunked->state = REQ_CHUNK_SIZE_LF;
+			} else {
+				return REQ_BODY_BAD;
+			}
+			p++;
 			break;
-		case -1:
-			printf("method invalid\n");
+		case REQ_CHUNK_EXT:
+			q = memchr(p, '\r', end - p);
+			if (req_chunked_meta(chunked, (q != NULL ? q : end) - p) < 0)
+				return REQ_BODY_REJECT;
+			if (q == NULL) {
+				p = end;
+				break;
+			}
+			p = q + 1;
+			chunked->state = REQ_CHUNK_SIZE_LF;
 			break;
-		case -2:
-			printf("path invalid\n");
+		case REQ_CHUNK_SIZE_LF:
+			if (*p++ != '\n')
+				return REQ_BODY_BAD;
+			if (chunked->left == 0) {
+				chunked->state = REQ_CHUNK_TRAILER;
+				break;
+			}
+			// 声明的长度超过上限时不等数据到达就拒绝
+			if (chunked->max > 0 && chunked->left > chunked->max - chunked->total)
+				return REQ_BODY_REJECT;
+			chunked->total += chunked->left;
+			chunked->state = REQ_CHUNK_DATA;
 			break;
-		case -3:
-			printf("query invalid\n");
+		case REQ_CHUNK_DATA:
+			n = (size_t)(end - p) < chunked->left ? (size_t)(end - p) : chunked->left;
+			used = sink->on_data(sink, p, n);
+			if (used == REQ_BODY_BAD)
+				return REQ_BODY_BAD;
+			if (used < 0 || (size_t)used > n)
+				return REQ_BODY_REJECT;
+			p += used;
+			chunked->left -= used;
+			if (chunked->left == 0)
+				chunked->state = REQ_CHUNK_DATA_CR;
+			else if ((size_t)used < n)
+				return p - data;		// 消费者暂时不再接收, 剩下的留在读缓冲中
 			break;
-		case -6:
-			printf("params invalid\n");
+		case REQ_CHUNK_DATA_CR:
+			if (*p++ != '\r')
+				return REQ_BODY_BAD;
+			chunked->state = REQ_CHUNK_DATA_LF;
 			break;
-		default:
-			printf("unknow error: %d\n", state);
+		case REQ_CHUNK_DATA_LF:
+			if (*p++ != '\n')
+				return REQ_BODY_BAD;
+			chunked->state = REQ_CHUNK_SIZE;
+			chunked->digits = 0;
+			break;
+		case REQ_CHUNK_TRAILER:
+			if (*p == '\r') {
+				p++;
+				chunked->state = REQ_CHUNK_END_LF;
+			} else {
+				chunked->state = REQ_CHUNK_TRAILER_LINE;
+			}
+			break;
+		case REQ_CHUNK_TRAILER_LINE:
+			q = memchr(p, '\n', end - p);
+			n = (q != NULL ? q + 1 : end) - p;
+			if (req_chunked_meta(chunked, n) < 0)
+				return REQ_BODY_REJECT;
+			p += n;
+			if (q != NULL)
+				chunked->state = REQ_CHUNK_TRAILER;
+			break;
+		case REQ_CHUNK_END_LF:
+			if (*p++ != '\n')
+				return REQ_BODY_BAD;
+			chunked->state = REQ_CHUNK_DONE;
 			break;
+		default:
+			return REQ_BODY_BAD;
+		}
 	}
-*/
-	if(state == 10){
-		printf("[Server: Info] connection break \n");
+	return p - data;
+}
+
+
+// 头部名不区分大小写, 头部通常只有十几个, 顺序比较就够了
+static char * req_field_find(const request_t *req, const req_field_t *fields, int num, 
+							const char *key, int nocase)
+{
+	size_t len = strlen(key);
+
+	for (int i = 0; i < num; i++) {
+		if (fields[i].key.len != len)
+			continue;
+		if (nocase ? strncasecmp(req->data + fields[i].key.off, key, len) == 0 :
+				memcmp(req->data + fields[i].key.off, key, len) == 0)
+			return req->data + fields[i].value.off;
 	}
+	return NULL;
+}
 
-	
-#ifdef REQUEST_DEBUG 
-	printf("--------------------REQUEST-DEBUG--------------------\n");
-	printf("----STATE: %d  p_int: %d  q_int: %d----\n", state, p_int, q_int);
-	printf("%s\n", request->method);
-	printf("%s\n", request->path);
-	printf("%s\n", request->protocol);
-	printf("%s\n", request->version);
-	printf("length: %d\nBody: %#x\n", request->body.length, &(request->body.body) );
-	printf("--------------------REQUEST-DEBUG--------------------\n");
-#endif
-	
+
+// 返回头部的值, 没有这个头部时返回 NULL
+char * req_param(const request_t *req, const char *key)
+{
+	return req_field_find(req, req->headers, req->header_num, key, 1);
+}
+
+
+// 返回 query 参数的值, 没有这个参数时返回 NULL
+char * req_query(const request_t *req, const char *key)
+{
+	return req_field_find(req, req->queries, req->query_num, key, 0);
 }
 
 
 void req_get_session_str(const request_t* req, char session_str[]) // OUT 
 {
     char* temp;
-	char* data = hashmap_get(req->params, "Cookie");
+	char* data = req_param(req, "Cookie");
 
 	if( data != NULL ) {
 		temp = strstr(data, "dmfsession=");
@@ -516,7 +639,7 @@ void req_get_session_str(const request_t* req, char session_str[]) // OUT
 
 void req_get_ws_key(const request_t* req, char ws_key[]) 			// OUT 
 {
-	char* data = hashmap_get(req->params, "Sec-WebSocket-Key");
+	char* data = req_param(req, "Sec-WebSocket-Key");
 	if( data != NULL ) {
 		strcpy(ws_key, data);
 	}
@@ -526,7 +649,7 @@ void req_get_ws_key(const request_t* req, char ws_key[]) 			// OUT
 
 void req_get_param(const request_t *req, char* key, char data[]) // OUT
 {
-	char* data1 = hashmap_get(req->params, key);
+	char* data1 = req_param(req, key);
 	if( data1 != NULL ) {
 		strcpy(data, data1);
 	}
@@ -536,7 +659,7 @@ void req_get_param(const request_t *req, char* key, char data[]) // OUT
 
 void req_get_query(const request_t *req, char* key, char data[]) // OUT
 {
-	char* data1 = hashmap_get(req->query, key);
+	char* data1 = req_query(req, key);
 	if( data1 != NULL ) {
 		strcpy(data, data1);
 	}
@@ -546,19 +669,10 @@ void req_get_query(const request_t *req, char* key, char data[]) // OUT
 
 void req_free(request_t *req) 
 {
-
-	hashmap_destroy(req->query);
-	hashmap_destroy(req->params);
-	
+	if (req->sink != NULL && req->sink->on_free != NULL)
+		req->sink->on_free(req->sink);
+	req->sink = NULL;
 	free(req->body.body);
-	
-	int i=0;
-	
-	for( ; i <= req->multi_part_num; i++) {
-		
-		free(req->multi[i]->data);
-		
-		free(req->multi[i]);
-		
-	}
-}
\ No newline at end of file
+	req->body.body = NULL;
+	req_multi_free(req);
+}
@@ -22,25 +22,76 @@
 #include <dmfserver/socket.h>
 
 
-// response_t 模块最后调用此函数  发送并关闭此次TCP连接
-static void res_handle( connection_tp conn, char* res_str, unsigned int size )
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
+
+
+// 发送一段数据, linux 下 epoll 管理的连接写入输出队列, 由 container 在可写时发出
+static int res_send(connection_tp conn, const char* buf, unsigned int size)
 {
-	int acceptFd = conn->per_handle_data->Socket;
-	int sendbyets = send(acceptFd, res_str, size, 0);
-	if (sendbyets == -1) {
-		connection_close(conn);
-		connection_free(conn);	
+	if (conn->sender != NULL)
+		return conn->sender(conn, buf, size);
+#ifdef __linux__
+	if (conn->per_handle_data->efd >= 0)
+		return connection_out_copy(conn, buf, size);
+	return connection_send_all(conn, buf, size);
+#else
+	return send(conn->per_handle_data->Socket, buf, size, 0);
+#endif
+}
+
+
+// 不小于 zerocopy_min 的 body 交给输出队列, 用 MSG_ZEROCOPY 发送, 内核不再复制
+// owned 为 1 时 body 是调用者 malloc 的, 直接交给输出队列; 否则 body 不属于这里, 只能先复制一份
+// 返回 1 时 body 已经交给输出队列, 0 表示这个连接不使用零拷贝, 调用者按原来的方式发送并保留 body
+static int res_send_zerocopy(connection_tp conn, const char* head, unsigned int head_len, 
+							char* body, unsigned int size, int owned)
+{
+#ifdef __linux__
+	int zerocopy_min = g_server_conf_all._conf_server.zerocopy_min;
+	char* data = body;
+
+	if (zerocopy_min <= 0 || size < (unsigned int)zerocopy_min || !conn->zerocopy || 
+			conn->sender != NULL || conn->per_handle_data->efd < 0)
+		return 0;
+	if (!owned) {
+		data = (char*)malloc(size);
+		if (data == NULL)
+			return 0;
+		memcpy(data, body, size);
 	}
 
+	if (connection_out_copy(conn, head, head_len) < 0 || connection_out_zerocopy(conn, data, size) < 0)
+		conn->keep_alive = 0;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+
+// 根据 container 的判断返回 Connection 头
+static const char* res_connection(connection_tp conn)
+{
+	return conn->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+
+// response_t 模块最后调用此函数  发送响应
+// 连接是否关闭由 container 根据 conn->keep_alive 决定, 这里发送失败时取消 keep-alive
+static void res_handle( connection_tp conn, char* res_str, unsigned int size )
+{
+	int sendbyets = res_send(conn, res_str, size);
+
 	// printf("socket %d: Send: %d byets\n", acceptFd, sendbyets);
-	connection_close(conn);
-	connection_free(conn);
-	// send_next(conn);
+	if (sendbyets < 0)
+		conn->keep_alive = 0;
 }
 
 
-// 以纯的字符串返回
-extern void res_row(connection_tp conn, char* res_str) 
+// 以纯的字符串返回, owned 为 1 时 res_str 由这里释放
+static void res_row_send(connection_tp conn, char* res_str, int owned) 
 {
 	int con_len = strlen(res_str);
 	char conlen[8] = {0}; 
@@ -48,26 +99,103 @@ extern void res_row(connection_tp conn, char* res_str)
 
 	char final_str[FINAL_STR_SIZE] = {0};
 
-	strcat( final_str, "HTTP/1.1 200 OK\r\nContent-type:text/html;utf-8;\r\nConnection: Keep-alive;\r\n" );
+	strcat( final_str, "HTTP/1.1 200 OK\r\nContent-type:text/html;utf-8;\r\n" );
+	strcat( final_str, res_connection(conn));
 	strcat( final_str, "Content-Length: ");strcat( final_str, conlen);strcat( final_str, "\r\n\r\n");
+	if (res_send_zerocopy(conn, final_str, strlen(final_str), res_str, con_len, owned))
+		return;
 	strcat( final_str, res_str);
+	if (owned)
+		free(res_str);
 	
 	res_handle(conn, final_str, strlen(final_str));
 }
 
+extern void res_row(connection_tp conn, char* res_str) 
+{
+	res_row_send(conn, res_str, 0);
+}
+
 // 返回 Not Found
 extern void res_notfound(connection_tp conn)
 {
 	// int acceptFd = conn->per_handle_data->Socket;
 
 	char final_str[FINAL_STR_SIZE] = {0};
-	strcat( final_str, "HTTP/1.1 404 \r\nContent-type:text/html;utf-8;\r\n"
-			"Connection: close;\r\nContent-Length: 18\r\n\r\n" );
+	strcat( final_str, "HTTP/1.1 404 \r\nContent-type:text/html;utf-8;\r\n" );
+	strcat( final_str, res_connection(conn));
+	strcat( final_str, "Content-Length: 18\r\n\r\n" );
 	strcat( final_str, "<h1>Not Found</h1>");
 	
 	res_handle(conn, final_str, strlen(final_str));
 }
 
+// 过载时返回, 事先拼好, 不需要格式化也不需要复制
+// 响应之后关闭连接, 让客户端过一会再重试
+static const char res_unavailable_str[] = 
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Type: text/plain\r\n"
+	"Connection: close\r\n"
+	"Content-Length: 20\r\n\r\n"
+	"Service Unavailable\n";
+
+// 上传的 body 超过限制, 或者 body 消费者拒绝时返回, 同样之后关闭连接
+static const char res_too_large_str[] = 
+	"HTTP/1.1 413 Payload Too Large\r\n"
+	"Content-Type: text/plain\r\n"
+	"Connection: close\r\n"
+	"Content-Length: 18\r\n\r\n"
+	"Payload Too Large\n";
+
+// 请求行, 头部或者 chunked 编码非法时返回, 找不到下一个请求的开头, 之后关闭连接
+static const char res_bad_request_str[] = 
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Type: text/plain\r\n"
+	"Connection: close\r\n"
+	"Content-Length: 12\r\n\r\n"
+	"Bad Request\n";
+
+// 当前的 container 不支持的功能 (例如 reactor 线程中的 websocket), 之后关闭连接
+static const char res_not_implemented_str[] = 
+	"HTTP/1.1 501 Not Implemented\r\n"
+	"Content-Type: text/plain\r\n"
+	"Connection: close\r\n"
+	"Content-Length: 16\r\n\r\n"
+	"Not Implemented\n";
+
+static void res_close_static(connection_tp conn, const char *str, size_t len)
+{
+	conn->keep_alive = 0;
+#ifdef __linux__
+	if (conn->sender == NULL && conn->per_handle_data->efd >= 0) {
+		connection_out_static(conn, str, len);
+		return;
+	}
+#endif
+	res_handle(conn, (char*)str, len);
+}
+
+extern void res_unavailable(connection_tp conn)
+{
+	res_close_static(conn, res_unavailable_str, sizeof(res_unavailable_str) - 1);
+}
+
+extern void res_too_large(connection_tp conn)
+{
+	res_close_static(conn, res_too_large_str, sizeof(res_too_large_str) - 1);
+}
+
+extern void res_bad_request(connection_tp conn)
+{
+	res_close_static(conn, res_bad_request_str, sizeof(res_bad_request_str) - 1);
+}
+
+extern void res_not_implemented(connection_tp conn)
+{
+	res_close_static(conn, res_not_implemented_str, sizeof(res_not_implemented_str) - 1);
+}
+
 // 以模板返回
 extern void res_render(connection_tp conn, char* template_name, 
 						struct Kvmap *kv, int num) 
@@ -77,9 +205,7 @@ extern void res_render(connection_tp conn, char* template_name,
 	char* context = get_template(template_name);				// 需要释放内存
 	char* res = parse_context(context, kv, num-1);		// 模板返回值  需要释放内存
 
-	res_row(conn, res);
-	memset(res, 0, TEMPLATE_RESULT_SIZE);
-	free(res);
+	res_row_send(conn, res, 1);
 }
 
 
@@ -90,7 +216,9 @@ extern void res_without_permission(connection_tp conn)
 {
 	char final_str[FINAL_STR_SIZE] = {0};
 
-	strcat( final_str, "HTTP/1.1 403 \r\n\r\nYou are without permission");
+	strcat( final_str, "HTTP/1.1 403 \r\n");
+	strcat( final_str, res_connection(conn));
+	strcat( final_str, "Content-Length: 26\r\n\r\nYou are without permission");
 	
 	res_handle(conn, final_str, strlen(final_str));
 }
@@ -119,8 +247,7 @@ extern void res_init(connection_tp conn, response_t* res)
 	strcat(res->Date, time_str);
 	strcat(res->Date, "\r\n");
 	
-	strcat(res->Connection, "Connection:keep-alive");
-	strcat(res->Connection, "\r\n");
+	strcat(res->Connection, res_connection(conn));
 	
 	res->conn = conn;
 }
@@ -165,8 +292,8 @@ extern void res_set_body(response_t* res, char* body, unsigned int size)
 	res->body_size = size;
 }
 
-// 将结构体中的变量组合成字符串 发送
-extern void res_parse_send(response_t* res) 
+// 将结构体中的变量组合成字符串 发送, owned 为 1 时 res->pbody 由这里释放
+static void res_parse_send_body(response_t* res, int owned) 
 {
 	char* final_str = malloc(sizeof(char)* FINAL_STR_SIZE);
 	memset(final_str, 0, FINAL_STR_SIZE);
@@ -177,15 +304,27 @@ extern void res_parse_send(response_t* res)
 	strcat(final_str, res->Content_type);
 	strcat(final_str, res->Set_cookie);
 	strcat(final_str, res->Connection);
+	sprintf(final_str + strlen(final_str), "Content-Length: %u\r\n", res->body_size);
 	strcat(final_str, "\r\n");
 
 	int head_len = strlen(final_str);
+	if (res_send_zerocopy(res->conn, final_str, head_len, res->pbody, res->body_size, owned)) {
+		free(final_str);
+		return;
+	}
 	memcpy(final_str + head_len, res->pbody, res->body_size);
+	if (owned)
+		free(res->pbody);
 
 	res_handle(res->conn, final_str, head_len + res->body_size);
 	free(final_str);
 }
 
+extern void res_parse_send(response_t* res) 
+{
+	res_parse_send_body(res, 0);
+}
+
 
 
 // 以下是静态文件响应函数
@@ -199,17 +338,19 @@ extern void res_static(connection_tp conn, char* path, unsigned int size, char*
 		return;
 	}
 	char* res_str = res_load_file(path);
+	if (res_str == NULL) {
+		res_notfound(conn);
+		return;
+	}
 	response_t res;
 	res_init(conn, &res);
 	res_set_head(&res, "200");
 	res_set_type(&res, content_type);
 	res_set_body(&res, res_str, size);
-	res_parse_send(&res);
-	// free(res.pbody);
-	free(res_str);
+	res_parse_send_body(&res, 1);		// res_str 交给它释放, 大文件可以不复制直接零拷贝发送
 }
 
-// 返回文件内容指针 调用者使用完文件内容要释放内存
+// 返回文件内容指针 调用者使用完文件内容要释放内存, 打开失败时返回 NULL
 // 对于小文件直接全部读取
 static char* res_load_file(char *path) 
 {
@@ -217,7 +358,7 @@ static char* res_load_file(char *path)
 	fp = fopen( path, "rb" );
 	if(fp == NULL){ 
 		printf("[response_t: ]%s open Failed\n", path);  
-		return "";
+		return NULL;
 	}
 	unsigned long int file_size;
 	fseek(fp, 0L, 2);
@@ -237,17 +378,6 @@ static char* res_load_file(char *path)
 static void res_file_handle(connection_tp conn, char* path, char* content_type, 
 							unsigned int size) 
 {
-	int acceptFd = conn->per_handle_data->Socket;
-
-	char head[512] = {0};
-	strcat(head, "HTTP/1.1 200 OK\r\n");
-	strcat(head, "Content-Type: ");
-	strcat(head, content_type);
-	strcat(head, "\r\n");
-	strcat(head, "Transfer-Encoding: chunked\r\n\r\n");
-
-	send(acceptFd, head, strlen(head), 0);
-
 	FILE* fp;
 	int read_size = 0;
 	long long int all_size = 0;
@@ -256,11 +386,43 @@ static void res_file_handle(connection_tp conn, char* path, char* content_type,
 	char chunk_header[10];
 	int chunk_header_len = 0;
 
+#ifdef __linux__
+	// 有输出队列时文件用 sendfile 发送, 不经过用户态缓冲
+	if (conn->sender == NULL && conn->per_handle_data->efd >= 0) {
+		struct stat st;
+		char file_head[512];
+		int fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			if (fd >= 0)
+				close(fd);
+			res_notfound(conn);
+			return;
+		}
+		snprintf(file_head, sizeof(file_head), 
+				"HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%sContent-Length: %lld\r\n\r\n", 
+				content_type, res_connection(conn), (long long)st.st_size);
+		if (res_send(conn, file_head, strlen(file_head)) < 0 || 
+			connection_out_file(conn, fd, 0, st.st_size, 1) < 0)
+			conn->keep_alive = 0;
+		return;
+	}
+#endif
+
 	fp = fopen(path, "rb");
 	if(fp == NULL){
-		close_socket(acceptFd);
+		res_notfound(conn);
 		return;
 	}
+
+	char head[512] = {0};
+	strcat(head, "HTTP/1.1 200 OK\r\n");
+	strcat(head, "Content-Type: ");
+	strcat(head, content_type);
+	strcat(head, "\r\n");
+	strcat(head, res_connection(conn));
+	strcat(head, "Transfer-Encoding: chunked\r\n\r\n");
+
+	res_send(conn, head, strlen(head));
 	fseek(fp, 0L, 2);
 	file_size = ftell(fp);
 	fseek(fp, 0L, 0);
@@ -268,16 +430,15 @@ static void res_file_handle(connection_tp conn, char* path, char* content_type,
 		read_size = fread(buffer, 1 , sizeof(buffer), fp);
 		sprintf(chunk_header, "%x\r\n", read_size);
 		chunk_header_len = strlen(chunk_header);
-		send(acceptFd, chunk_header, chunk_header_len, 0);
-		send(acceptFd, buffer, read_size, 0);
-		send(acceptFd, "\r\n", 2, 0);
+		res_send(conn, chunk_header, chunk_header_len);
+		res_send(conn, buffer, read_size);
+		res_send(conn, "\r\n", 2);
 		all_size = all_size + read_size;
 	}
 	fclose(fp);
 
-	send(acceptFd, "0\r\n\r\n", 5, 0);
+	if (res_send(conn, "0\r\n\r\n", 5) < 0)
+		conn->keep_alive = 0;
 	// printf("%d, %ld \n", size, file_size);
 	// printf("%d, %ld \n", size, all_size);
-
-	close_socket(acceptFd);
 }
@@ -31,6 +31,8 @@ void router_init()
 	for(int i=0; i < ContFunNUM; i++){
 		g_cmp.cf[i] = NULL;
 		g_cmp.keys[i] = NULL;
+		g_cmp.blocking[i] = 0;
+		g_cmp.bf[i] = NULL;
 	}
 	g_cmp.curr_num = 0;
 	char buffer[1024];
@@ -75,19 +77,45 @@ void router_init()
 }
 
 
+// 在control回调函数列表中寻找, 没有时返回 -1
+static int router_find(const char *path)
+{
+	for(int i=0; g_cmp.keys[i] != NULL; i++) {
+		if( strcmp(path, g_cmp.keys[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+// container 在路由之前调用, 决定请求在 reactor 中处理还是交给线程池
+int router_blocking(const request_t *req)
+{
+	int i = router_find(req->path);
+	return i >= 0 && g_cmp.blocking[i];
+}
+
+
+// container 在请求头部到达时调用, path 还没有 '\0' 结尾; 返回 NULL 表示 body 整个读入以后再执行 view
+BodyFun router_body(const char *path, size_t len)
+{
+	for(int i=0; g_cmp.keys[i] != NULL; i++) {
+		if (g_cmp.bf[i] != NULL && strlen(g_cmp.keys[i]) == len && memcmp(path, g_cmp.keys[i], len) == 0)
+			return g_cmp.bf[i];
+	}
+	return NULL;
+}
+
+
 void router_handle(connection_tp conn, request_t *req) 
 {
-	int flag = 0;
 	ContFun func_view;
+	int i = router_find(req->path);
 	
-	// 先在control回调函数列表中寻找
-	for(int i=0; g_cmp.keys[i] != NULL; i++) {
-		
-		if( strcmp(req->path, g_cmp.keys[i]) == 0) {
-			func_view = g_cmp.cf[i];
-			func_view(conn, req);
-			return;	// 回调函数找到了
-		}
+	if (i >= 0) {
+		func_view = g_cmp.cf[i];
+		func_view(conn, req);
+		return;	// 回调函数找到了
 	}
 
 	// char* local_path[ STATIC_FILES_MAX_NUM ] = {NULL};
@@ -187,7 +215,7 @@ void traverse_directory(const char *path, struct FileInfo file_list[], int *num_
 }
 
 
-void router_add_app(ContFun cf[], char* keys[], const char* name) 
+static void router_add(ContFun cf[], BodyFun bf[], char* keys[], const char* name, int blocking) 
 {
 	
 	int icf=0, ikeys=0;
@@ -209,6 +237,8 @@ void router_add_app(ContFun cf[], char* keys[], const char* name)
 
 	for(int i = 0; i < icf; i++){
 		g_cmp.cf[ curr_num + i ] = cf[i];
+		g_cmp.blocking[ curr_num + i ] = blocking;
+		g_cmp.bf[ curr_num + i ] = bf != NULL ? bf[i] : NULL;
 		strcat(appname, "/");
 		strcat(appname, name);
 		strcat(appname, keys[i]);
@@ -219,7 +249,30 @@ void router_add_app(ContFun cf[], char* keys[], const char* name)
 
 	g_cmp.curr_num = g_cmp.curr_num + icf;
 
-	printf("[Router: info] App: "YELLOW" %s"NONE" %d function loaded\n", name, icf);
+	printf("[Router: info] App: "YELLOW" %s"NONE" %d %sfunction loaded\n", name, icf, 
+			blocking ? "blocking " : "");
+}
+
+
+void router_add_app(ContFun cf[], char* keys[], const char* name) 
+{
+	router_add(cf, NULL, keys, name, 0);
+}
+
+
+// 这些 view 会阻塞 (同步数据库查询, 读写文件等), epoll reactor 把它们交给线程池执行,
+// 不影响同一个 reactor 上的其他连接; view 本身的写法不变
+void router_add_app_blocking(ContFun cf[], char* keys[], const char* name) 
+{
+	router_add(cf, NULL, keys, name, 1);
+}
+
+
+// 上传等 body 很大的 view: bf 和 cf 一一对应, 非 NULL 的项在头部到达时创建 body 消费者,
+// body 边读边交给消费者, 读缓冲只保留一个窗口, 全部收完以后再执行 view; 可以用 body_spool 作为消费者
+void router_add_app_body(ContFun cf[], BodyFun bf[], char* keys[], const char* name) 
+{
+	router_add(cf, bf, keys, name, 0);
 }
 
 
@@ -20,9 +20,18 @@
    
 #include <dmfserver/socket.h>
 
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <string.h>
+#endif // linux
+
+// simple 模式使用的阻塞监听 socket, 只监听配置中的第一个端口
 int create_socket()
 {
-    
 	int serverPort;
 	// if configure not define port, we use default SERVER_PORT
 	if(g_server_conf_all._conf_server.port == 0)
@@ -30,17 +39,20 @@ int create_socket()
 	else serverPort = g_server_conf_all._conf_server.port;
 
     int sListen;
+    int flag = 1;
     struct sockaddr_in ser;
     sListen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&ser, 0, sizeof(ser));
     ser.sin_family = AF_INET; 
-    ser.sin_port = htons(80); 
+    ser.sin_port = htons(serverPort); 
     ser.sin_addr.s_addr = htonl(INADDR_ANY); 
+    setsockopt(sListen, SOL_SOCKET, SO_REUSEADDR, (const char *)&flag, sizeof(flag));
     if( bind(sListen, (struct sockaddr*)&ser, sizeof(ser) ) < 0) 
     {
 		OutErr("bind Failed!");
 		return 1;
 	}
-    if( listen(sListen,5) != 0) 
+    if( listen(sListen, SOMAXCONN) != 0) 
     {
 		OutErr("listen Failed!");
 		return 1;
@@ -52,53 +64,145 @@ int create_socket()
 
 #ifdef __linux__
 
-int createSocket() 
+// 按 conf_listener 填写地址, 返回地址长度, 地址非法时返回 0
+static socklen_t socket_listen_addr(const conf_listener *ls, struct sockaddr_storage *ss)
 {
-    int i_listenfd;
-    struct sockaddr_in st_sersock;
-    i_listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    memset(&st_sersock, 0, sizeof(st_sersock));
-    st_sersock.sin_family = AF_INET;
-//	st_sersock.sin_addr.s_addr = htonl(INADDR_ANY);
-    st_sersock.sin_port = htons( 8080 );
-    int out = 2;
-    setsockopt(i_listenfd, SOL_SOCKET, SO_REUSEADDR, &out, sizeof(out));
-    int code = bind(i_listenfd, (struct sockaddr *)&st_sersock, sizeof(st_sersock));
-    assert(code == 0 && "bind error");
-
-    code = listen(i_listenfd, 1024);
-    assert(code == 0 && "listen error");
-    return i_listenfd;
+    memset(ss, 0, sizeof(*ss));
+
+    if (ls->family == CONF_LISTEN_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *)ss;
+        un->sun_family = AF_UNIX;
+        if (ls->address[0] == '\0' || strlen(ls->address) >= sizeof(un->sun_path))
+            return 0;
+        strcpy(un->sun_path, ls->address);
+        return sizeof(struct sockaddr_un);
+    }
+
+    if (ls->family == CONF_LISTEN_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(ls->port);
+        if (ls->address[0] == '\0')
+            in6->sin6_addr = in6addr_any;
+        else if (inet_pton(AF_INET6, ls->address, &in6->sin6_addr) != 1)
+            return 0;
+        return sizeof(struct sockaddr_in6);
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)ss;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(ls->port);
+    if (ls->address[0] == '\0')
+        in->sin_addr.s_addr = htonl(INADDR_ANY);
+    else if (inet_pton(AF_INET, ls->address, &in->sin_addr) != 1)
+        return 0;
+    return sizeof(struct sockaddr_in);
 }
 
 
-int create_socket_reuse()
+// 按配置建立一个非阻塞的监听 socket, 出错时返回 -1
+// reuseport 为 1 时每个 reactor 各建一个, 由内核通过 SO_REUSEPORT 分配连接 (只用于 TCP)
+// 不设置 FD_CLOEXEC: 平滑升级时监听 socket 要传给新的程序
+int socket_listen(const conf_listener *ls, int reuseport)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    assert(fd > 0 && "socket error");
+    struct sockaddr_storage ss;
+    socklen_t len = socket_listen_addr(ls, &ss);
+    int tcp = ls->family != CONF_LISTEN_UNIX;
+    int flag = 1;
+    int fd;
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    // addr.sin_addr.s_addr = inet_addr(LOCAL_IP);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY); 
-    addr.sin_port = htons(80);
+    if (len == 0) {
+        printf("[Socket: Error] bad listen address \"%s\"\n", ls->address);
+        return -1;
+    }
 
-    int flag = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        OutErr("socket Failed!");
+        return -1;
+    }
 
-    int code = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
-    assert(code == 0 && "bind error");
+    if (tcp) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) {
+            OutErr("SO_REUSEPORT Failed!");
+            close(fd);
+            return -1;
+        }
+        // [::] 只接收 IPv6, 同一个端口可以另外配置 IPv4 的监听地址
+        if (ls->family == CONF_LISTEN_INET6)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+    } else {
+        unlink(ls->address);        // 上次运行留下的 socket 文件
+    }
 
-    code = listen(fd, 1024);
-    assert(code == 0 && "listen error");
+    // 在 listen 之前设置, accept 得到的连接继承这些大小
+    if (ls->rcvbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ls->rcvbuf, sizeof(ls->rcvbuf));
+    if (ls->sndbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ls->sndbuf, sizeof(ls->sndbuf));
 
-    struct timeval tv = {0, 500 * 1000};
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+    if (bind(fd, (struct sockaddr *)&ss, len) < 0) {
+        OutErr("bind Failed!");
+        close(fd);
+        return -1;
+    }
+
+    if (tcp && ls->defer_accept > 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &ls->defer_accept, sizeof(ls->defer_accept));
+    if (tcp && ls->fastopen > 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &ls->fastopen, sizeof(ls->fastopen));
+
+    // accept 得到的连接继承这两个选项; 超过 net.core.busy_read 需要 CAP_NET_ADMIN
+    if (tcp && ls->busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &ls->busy_poll, sizeof(ls->busy_poll)) < 0)
+            printf("[Socket: Warn] SO_BUSY_POLL: %s\n", strerror(errno));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &flag, sizeof(flag));
+#endif
+    }
+
+    if (listen(fd, ls->backlog > 0 ? ls->backlog : SOMAXCONN) != 0) {
+        OutErr("listen Failed!");
+        close(fd);
+        return -1;
+    }
     return fd;
 }
 
 
+// fd 是否是监听在 ls 的地址和端口上的 socket, 用来核对升级时继承来的监听 socket
+// 返回 1 是, 0 不是, -1 fd 不是一个正在监听的 socket
+int socket_listen_is(int fd, const conf_listener *ls)
+{
+    struct sockaddr_storage want, got;
+    socklen_t want_len = socket_listen_addr(ls, &want);
+    socklen_t got_len = sizeof(got);
+    int listening = 0;
+    socklen_t opt_len = sizeof(listening);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &opt_len) < 0 || !listening)
+        return -1;
+    memset(&got, 0, sizeof(got));
+    if (getsockname(fd, (struct sockaddr *)&got, &got_len) < 0)
+        return -1;
+    if (want_len == 0 || got.ss_family != want.ss_family)
+        return 0;
+
+    if (want.ss_family == AF_UNIX)
+        return strcmp(((struct sockaddr_un *)&got)->sun_path, ((struct sockaddr_un *)&want)->sun_path) == 0;
+    if (want.ss_family == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6 *)&got, *b = (struct sockaddr_in6 *)&want;
+        return a->sin6_port == b->sin6_port && 
+                memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+    }
+    struct sockaddr_in *a = (struct sockaddr_in *)&got, *b = (struct sockaddr_in *)&want;
+    return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+
 #endif // linux
 
 
@@ -8,7 +8,7 @@ void mdbfind(connection_tp conn, const request_t* req)
 	
 	char data[40] = {0};
 	
-	strcpy(data, hashmap_get( req->query, "name"));
+	strcpy(data, req_query(req, "name"));
 	char* pdata = data;
 
 	str_from_mdb = mdb_find(pdata);
@@ -21,7 +21,7 @@ void mdbinsert(connection_tp conn, const request_t* req)
 	char ckey[64] = {0};
 	char cdata[512] = {0};
 	strcpy(ckey, "name");
-	strcpy(cdata, hashmap_get( req->query, "name"));
+	strcpy(cdata, req_query(req, "name"));
 	
 	char* key = ckey;
 	char* data = cdata;
@@ -36,5 +36,5 @@ RouterAdd(model)
 {
 	ContFun cf[] = {&mysqltest, &mysqltest1,NULL};
 	char* keys[] = {"/mysqltest", "/mysqltest1",NULL};
-	router_add_app(cf, keys, __func__);
+	router_add_app_blocking(cf, keys, __func__);
 }
\ No newline at end of file
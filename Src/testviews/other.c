@@ -1,5 +1,7 @@
 
 #include <dmfserver/request.h>
+#include <dmfserver/body.h>
+#include <dmfserver/multipart.h>
 
 
 #ifdef __WIN32__
@@ -27,8 +29,26 @@ void string(connection_tp conn, const request_t* req)
 }
 
 
+// multipart 由 body_multipart 边收边解析, 上传的文件在临时文件中; 其他 body 由 body_spool 保存
+void upload(connection_tp conn, const request_t* req)
+{
+	char buf[512];
+	int n = snprintf(buf, sizeof(buf), "upload ok: %zu bytes%s", (size_t)req->body.length, 
+			body_spool_fd(req) >= 0 ? " (spooled)" : "");
+	for (int i = 0; i <= req->multi_part_num && n < (int)sizeof(buf); i++)
+		n += snprintf(buf + n, sizeof(buf) - n, "\n%s: %zu bytes%s", req->multi[i]->name.data, 
+				req->multi[i]->length, req->multi[i]->fd >= 0 ? " (file)" : "");
+	res_row(conn, buf);
+}
+
+
 RouterAdd(other){
 	ContFun cf[] = { &string, NULL};
 	char* keys[] = { "/string", NULL};
 	router_add_app(cf, keys, __func__);
+
+	ContFun body_cf[] = { &upload, NULL};
+	BodyFun body_bf[] = { &body_multipart, NULL};
+	char* body_keys[] = { "/upload", NULL};
+	router_add_app_body(body_cf, body_bf, body_keys, __func__);
 }
\ No newline at end of file
@@ -4,8 +4,8 @@ void setsession(connection_tp conn, const request_t *req)
 {
 	char res_str[80] = {0};
 
-	char * key = hashmap_get( req->query, "key"); 
-	char * data = hashmap_get( req->query, "data");
+	char * key = req_query(req, "key"); 
+	char * data = req_query(req, "data");
 	if ((key == NULL) || (data == NULL)) 
 		printf("some error");
 		
@@ -29,7 +29,7 @@ void setsession(connection_tp conn, const request_t *req)
 
 void getsession(connection_tp conn, const request_t *req) 
 {
-	char* data = hashmap_get( req->query, "name");
+	char* data = req_query(req, "name");
 	
 	char* s = getSessionR(req, data);
 	if(s == NULL){
@@ -45,8 +45,8 @@ void getsession(connection_tp conn, const request_t *req)
 void sessionadd(connection_tp conn, const request_t *req) 
 {
 
-	char * key = hashmap_get( req->query, "key"); 
-	char * data = hashmap_get( req->query, "data");
+	char * key = req_query(req, "key"); 
+	char * data = req_query(req, "data");
 	if ((key == NULL) || (data == NULL)) 
 		printf("some error");
 
@@ -70,8 +70,8 @@ void sessionadd(connection_tp conn, const request_t *req)
 
 void updatesession(connection_tp conn, const request_t *req) 
 {
-	char * key = hashmap_get( req->query, "key"); 
-	char * data = hashmap_get( req->query, "data");
+	char * key = req_query(req, "key"); 
+	char * data = req_query(req, "data");
 	if ((key == NULL) || (data == NULL)) 
 		printf("some error");
 
@@ -12,5 +12,5 @@ RouterAdd(ws)
 {
 	ContFun cf[] = {&wsfunc, NULL};
 	char* keys[] = {"/ws", NULL};
-	router_add_app(cf, keys, __func__);
+	router_add_app_blocking(cf, keys, __func__);	// 阻塞读写 socket, 在线程池中执行
 }
\ No newline at end of file
@@ -0,0 +1,544 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#include <dmfserver/tls.h>
+
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+#ifdef __linux__
+
+// 会话缓存和 ticket 密钥放在 MAP_SHARED 的匿名内存里, 在 fork 之前建立,
+// 同一进程的 reactor 线程和 master.c fork 出来的 worker 看到的是同一份.
+// 缓存分成 TLS_CACHE_SHARDS 个分片, 每个分片一把进程间共享的锁.
+
+#define TLS_CACHE_SHARDS    16
+#define TLS_CACHE_WAYS      4           // 一个 session id 只会放在相邻的 4 个槽里
+#define TLS_SESSION_DER_MAX 1024        // 序列化后更大的会话不缓存
+#define TLS_TICKET_KEYS     3           // keys[0] 用来加密, 其余的只用来解密
+
+typedef struct tls_cache_entry_t {
+    time_t          expire;             // 0 表示空槽
+    unsigned int    id_len;
+    unsigned int    der_len;
+    unsigned char   id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char   der[TLS_SESSION_DER_MAX];
+} tls_cache_entry_t;
+
+typedef struct tls_cache_shard_t {
+    pthread_mutex_t lock;
+} tls_cache_shard_t;
+
+typedef struct tls_ticket_key_t {
+    time_t          created;            // 0 表示还没有生成
+    unsigned char   name[16];
+    unsigned char   aes_key[32];
+    unsigned char   hmac_key[32];
+} tls_ticket_key_t;
+
+typedef struct tls_shared_t {
+    pthread_mutex_t     key_lock;
+    tls_ticket_key_t    keys[TLS_TICKET_KEYS];
+    tls_cache_shard_t   shards[TLS_CACHE_SHARDS];
+    size_t              shard_size;     // 每个分片的槽数
+    tls_cache_entry_t   entries[];      // TLS_CACHE_SHARDS * shard_size
+} tls_shared_t;
+
+static tls_shared_t * tls_shared = NULL;
+static size_t tls_shared_len = 0;
+
+
+// 持锁的 worker 被杀掉以后, 下一个拿锁的进程接手 (槽里的数据最多是一条坏记录, 会在 d2i 时被丢弃)
+static void tls_shared_lock(pthread_mutex_t *lock)
+{
+    if (pthread_mutex_lock(lock) == EOWNERDEAD)
+        pthread_mutex_consistent(lock);
+}
+
+
+static int tls_shared_lock_init(pthread_mutex_t *lock)
+{
+    pthread_mutexattr_t attr;
+    int ret;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    ret = pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+
+static int tls_shared_init()
+{
+    size_t entries, shard_size, i;
+    int cache = g_server_conf_all._conf_server.session_cache;
+
+    if (tls_shared != NULL)
+        return 0;
+
+    shard_size = cache > 0 ? (cache + TLS_CACHE_SHARDS - 1) / TLS_CACHE_SHARDS : 0;
+    if (shard_size > 0 && shard_size < TLS_CACHE_WAYS)
+        shard_size = TLS_CACHE_WAYS;
+    entries = shard_size * TLS_CACHE_SHARDS;
+
+    // 匿名映射是按需分配物理页的, 没用到的槽不占内存
+    tls_shared_len = sizeof(tls_shared_t) + entries * sizeof(tls_cache_entry_t);
+    tls_shared = mmap(NULL, tls_shared_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (tls_shared == MAP_FAILED) {
+        perror("[TLS: Error] mmap session cache");
+        tls_shared = NULL;
+        return -1;
+    }
+
+    tls_shared->shard_size = shard_size;
+    if (tls_shared_lock_init(&tls_shared->key_lock) != 0)
+        goto fail;
+    for (i = 0; i < TLS_CACHE_SHARDS; ++i)
+        if (tls_shared_lock_init(&tls_shared->shards[i].lock) != 0)
+            goto fail;
+    return 0;
+
+fail:
+    munmap(tls_shared, tls_shared_len);
+    tls_shared = NULL;
+    return -1;
+}
+
+
+// FNV-1a
+static unsigned int tls_cache_hash(const unsigned char *id, unsigned int len)
+{
+    unsigned int h = 2166136261u;
+    while (len--) {
+        h ^= *id++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+// 返回 session id 所在分片的第一个槽, 之后的 TLS_CACHE_WAYS 个槽 (在分片内回绕) 都可以存放它
+static tls_cache_entry_t *
+tls_cache_locate(const unsigned char *id, unsigned int len, tls_cache_shard_t **shard, size_t *base)
+{
+    unsigned int h = tls_cache_hash(id, len);
+    size_t s = h % TLS_CACHE_SHARDS;
+    *shard = &tls_shared->shards[s];
+    *base = (h / TLS_CACHE_SHARDS) % tls_shared->shard_size;
+    return &tls_shared->entries[s * tls_shared->shard_size];
+}
+
+
+static int tls_sess_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    unsigned int id_len, i;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    unsigned char *p;
+    tls_cache_shard_t *shard;
+    tls_cache_entry_t *slots, *e, *victim = NULL;
+    size_t base;
+    time_t now = time(NULL);
+    int der_len = i2d_SSL_SESSION(sess, NULL);
+
+    if (id_len == 0 || der_len <= 0 || der_len > TLS_SESSION_DER_MAX)
+        return 0;
+
+    slots = tls_cache_locate(id, id_len, &shard, &base);
+    tls_shared_lock(&shard->lock);
+    for (i = 0; i < TLS_CACHE_WAYS; ++i) {
+        e = &slots[(base + i) % tls_shared->shard_size];
+        if (e->expire <= now || (e->id_len == id_len && !memcmp(e->id, id, id_len))) {
+            victim = e;
+            break;
+        }
+        if (victim == NULL || e->expire < victim->expire)
+            victim = e;                 // 都占满了就挤掉最早过期的
+    }
+    p = victim->der;
+    i2d_SSL_SESSION(sess, &p);
+    victim->der_len = der_len;
+    victim->id_len = id_len;
+    memcpy(victim->id, id, id_len);
+    victim->expire = now + SSL_SESSION_get_timeout(sess);
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;                           // 没有保留 sess 的引用
+}
+
+
+static SSL_SESSION *
+tls_sess_get_cb(SSL *ssl, const unsigned char *id, int id_len, int *copy)
+{
+    unsigned char der[TLS_SESSION_DER_MAX];
+    const unsigned char *p = der;
+    unsigned int der_len = 0, i;
+    tls_cache_shard_t *shard;
+    tls_cache_entry_t *slots, *e;
+    size_t base;
+    time_t now = time(NULL);
+
+    *copy = 0;
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    slots = tls_cache_locate(id, id_len, &shard, &base);
+    tls_shared_lock(&shard->lock);
+    for (i = 0; i < TLS_CACHE_WAYS; ++i) {
+        e = &slots[(base + i) % tls_shared->shard_size];
+        if (e->expire > now && e->id_len == (unsigned int)id_len && !memcmp(e->id, id, id_len)) {
+            der_len = e->der_len;
+            memcpy(der, e->der, der_len);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // 反序列化放在锁外面
+    return der_len > 0 ? d2i_SSL_SESSION(NULL, &p, der_len) : NULL;
+}
+
+
+static void tls_sess_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    unsigned int id_len, i;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    tls_cache_shard_t *shard;
+    tls_cache_entry_t *slots, *e;
+    size_t base;
+
+    if (id_len == 0)
+        return;
+
+    slots = tls_cache_locate(id, id_len, &shard, &base);
+    tls_shared_lock(&shard->lock);
+    for (i = 0; i < TLS_CACHE_WAYS; ++i) {
+        e = &slots[(base + i) % tls_shared->shard_size];
+        if (e->id_len == id_len && !memcmp(e->id, id, id_len)) {
+            e->expire = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+static int tls_ticket_key_gen(tls_ticket_key_t *key, time_t now)
+{
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1)
+        return -1;
+    key->created = now;
+    return 0;
+}
+
+
+// 取得加密用的当前密钥, 到期时轮换: 旧密钥后移, 还能解密 TLS_TICKET_KEYS - 1 个周期
+static int tls_ticket_key_current(tls_ticket_key_t *out)
+{
+    tls_ticket_key_t key;
+    time_t now = time(NULL);
+    int ret = 0;
+
+    tls_shared_lock(&tls_shared->key_lock);
+    if (now - tls_shared->keys[0].created >= g_server_conf_all._conf_server.ticket_key_rotate) {
+        if (tls_ticket_key_gen(&key, now) == 0) {
+            memmove(&tls_shared->keys[1], &tls_shared->keys[0], sizeof(key) * (TLS_TICKET_KEYS - 1));
+            tls_shared->keys[0] = key;
+        } else if (tls_shared->keys[0].created == 0) {
+            ret = -1;
+        }
+    }
+    *out = tls_shared->keys[0];
+    pthread_mutex_unlock(&tls_shared->key_lock);
+    return ret;
+}
+
+
+// 按名字找解密密钥: 0 当前密钥, >0 旧密钥 (需要换发新 ticket), -1 没有
+static int tls_ticket_key_find(const unsigned char *name, tls_ticket_key_t *out)
+{
+    int i, found = -1;
+    tls_shared_lock(&tls_shared->key_lock);
+    for (i = 0; i < TLS_TICKET_KEYS; ++i) {
+        if (tls_shared->keys[i].created != 0 && !memcmp(tls_shared->keys[i].name, name, 16)) {
+            *out = tls_shared->keys[i];
+            found = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tls_shared->key_lock);
+    return found;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_mac_init(EVP_MAC_CTX *hctx, tls_ticket_key_t *key)
+{
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key, sizeof(key->hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#define TLS_TICKET_MAC_CTX  EVP_MAC_CTX
+#else
+static int tls_ticket_mac_init(HMAC_CTX *hctx, tls_ticket_key_t *key)
+{
+    return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL);
+}
+#define TLS_TICKET_MAC_CTX  HMAC_CTX
+#endif
+
+
+// 返回值按 OpenSSL 的约定: 1 成功, 2 解密成功但要换发 ticket, 0 不认识的 ticket (走完整握手), -1 出错
+static int tls_ticket_key_cb(SSL *ssl, unsigned char name[16], unsigned char *iv,
+                             EVP_CIPHER_CTX *ctx, TLS_TICKET_MAC_CTX *hctx, int enc)
+{
+    tls_ticket_key_t key;
+    int idx;
+
+    if (enc) {
+        if (tls_ticket_key_current(&key) != 0 ||
+            RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+        memcpy(name, key.name, 16);
+        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1 ||
+            tls_ticket_mac_init(hctx, &key) != 1)
+            return -1;
+        return 1;
+    }
+
+    idx = tls_ticket_key_find(name, &key);
+    if (idx < 0)
+        return 0;
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1 ||
+        tls_ticket_mac_init(hctx, &key) != 1)
+        return -1;
+    return idx == 0 ? 1 : 2;
+}
+
+
+static void tls_ctx_session_setup(SSL_CTX *ctx)
+{
+    static const unsigned char sid_ctx[] = "dmfserver";
+
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_timeout(ctx, g_server_conf_all._conf_server.session_timeout);
+
+    if (tls_shared_init() != 0) {
+        printf("[TLS: Warn] shared session cache disabled\n");
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        return;
+    }
+
+    // 不用 OpenSSL 的进程内缓存, 所有 reactor 和 worker 都走共享缓存
+    if (tls_shared->shard_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, tls_sess_new_cb);
+        SSL_CTX_sess_set_get_cb(ctx, tls_sess_get_cb);
+        SSL_CTX_sess_set_remove_cb(ctx, tls_sess_remove_cb);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    // 关掉 ticket 以后, TLS 1.3 会改发有状态的 ticket, 同样存进共享缓存
+    if (g_server_conf_all._conf_server.ticket_key_rotate > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb);
+#endif
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+}
+
+#endif // __linux__
+
+
+extern SSL_CTX *
+tls_ctx_create () {
+    SSL_CTX * ctx;
+
+    SSL_library_init();
+    OpenSSL_add_all_algorithms();
+    SSL_load_error_strings();
+
+    ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ctx == NULL) {
+        ERR_print_errors_fp(stdout);
+        return NULL;
+    }
+    if (SSL_CTX_use_certificate_file(ctx, g_server_conf_all._conf_server.cert_public, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, g_server_conf_all._conf_server.cert_private, SSL_FILETYPE_PEM) <= 0 ||
+        !SSL_CTX_check_private_key(ctx)) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // 非阻塞写: 允许部分写入, 重试时缓冲区地址可以变化 (输出队列的段可能被合并)
+    // 连接空闲时释放 OpenSSL 自己的读写缓冲, 大量空闲的 TLS 连接不再各占几十 KB
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | 
+            SSL_MODE_RELEASE_BUFFERS);
+
+#ifdef __linux__
+    tls_ctx_session_setup(ctx);
+#endif
+
+    // 内核 TLS: 握手完成后记录的加解密交给内核, 文件可以直接 SSL_sendfile.
+    // 内核没有 tls 模块或协商的套件不支持时 OpenSSL 会自动退回用户态
+#ifdef TLS_HAVE_KTLS
+    if (g_server_conf_all._conf_server.ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    return ctx;
+}
+
+
+extern int
+tls_accept (connection_tp conn, SSL_CTX * ctx) {
+    SSL * ssl = SSL_new(ctx);
+    if (ssl == NULL)
+        return -1;
+    if (SSL_set_fd(ssl, conn->per_handle_data->Socket) != 1) {
+        SSL_free(ssl);
+        return -1;
+    }
+    SSL_set_accept_state(ssl);
+    conn->ssl = ssl;
+    return 0;
+}
+
+
+extern int
+tls_handshake (connection_tp conn) {
+    int ret = SSL_do_handshake(conn->ssl);
+    if (ret == 1)
+        return 1;
+
+    switch (SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 0;
+    default:
+        ERR_clear_error();
+        return -1;
+    }
+}
+
+
+extern int
+tls_recv (connection_tp conn, char * buf, size_t len) {
+    int n = SSL_read(conn->ssl, buf, (int)len);
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(conn->ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_IO_AGAIN;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error();
+        return -1;
+    }
+}
+
+
+// 返回 TLS_IO_AGAIN 时, 重试必须使用相同的数据, 长度不能变短
+extern int
+tls_send (connection_tp conn, const char * buf, size_t len) {
+    int n = SSL_write(conn->ssl, buf, (int)len);
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(conn->ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_IO_AGAIN;
+    default:
+        ERR_clear_error();
+        return -1;
+    }
+}
+
+
+extern int
+tls_ktls_send (connection_tp conn) {
+#ifdef TLS_HAVE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+
+// 只能在 tls_ktls_send 为真时调用, 返回值与 tls_send 相同
+extern int
+tls_sendfile (connection_tp conn, int fd, size_t offset, size_t len) {
+#ifdef TLS_HAVE_KTLS
+    ossl_ssize_t n = SSL_sendfile(conn->ssl, fd, (off_t)offset, len, 0);
+    if (n > 0)
+        return (int)n;
+
+    switch (SSL_get_error(conn->ssl, (int)n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_IO_AGAIN;
+    default:
+        ERR_clear_error();
+        return -1;
+    }
+#else
+    return -1;
+#endif
+}
+
+
+// 尽力发送 close_notify, 不等待对端回应
+extern void
+tls_shutdown (connection_tp conn) {
+    if (conn->ssl != NULL && SSL_is_init_finished(conn->ssl)) {
+        SSL_shutdown(conn->ssl);
+        ERR_clear_error();
+    }
+}
+
+
+extern void
+tls_free (connection_tp conn) {
+    if (conn->ssl != NULL) {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+}
@@ -0,0 +1,179 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifdef __linux__
+#define _GNU_SOURCE                 // sched_getaffinity, pthread_setaffinity_np
+#endif
+
+#include <dmfserver/utility/dm_cpu.h>
+
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+// <numaif.h> 属于 libnuma, 这里只需要 set_mempolicy 一个系统调用
+#define DM_MPOL_PREFERRED   1
+#endif
+
+
+static void dm_cpu_add(dm_cpu_set_t *set, int cpu)
+{
+    int i, j;
+    if (cpu < 0 || set->num >= DM_CPU_MAX)
+        return;
+    for (i = 0; i < set->num && set->cpus[i] < cpu; i++);
+    if (i < set->num && set->cpus[i] == cpu)
+        return;
+    for (j = set->num; j > i; j--)
+        set->cpus[j] = set->cpus[j - 1];
+    set->cpus[i] = cpu;
+    set->num++;
+}
+
+
+int dm_cpu_parse(const char *list, dm_cpu_set_t *set)
+{
+    const char *p = list;
+    char *end;
+
+    set->num = 0;
+
+    if (list == NULL || *list == '\0') {
+#ifdef __linux__
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &mask))
+                    dm_cpu_add(set, cpu);
+        }
+#endif
+        return set->num;
+    }
+
+    while (*p != '\0') {
+        long first, last;
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+        first = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            dm_cpu_add(set, (int)cpu);
+    }
+    return set->num;
+}
+
+
+void dm_cpu_exclude(dm_cpu_set_t *set, const dm_cpu_set_t *other)
+{
+    int i, j, k = 0;
+    for (i = 0; i < set->num; i++) {
+        for (j = 0; j < other->num && other->cpus[j] != set->cpus[i]; j++);
+        if (j == other->num)
+            set->cpus[k++] = set->cpus[i];
+    }
+    set->num = k;
+}
+
+
+int dm_cpu_node(int cpu)
+{
+#ifdef __linux__
+    char path[64];
+    struct dirent *ent;
+    DIR *dir;
+    int node = 0;
+
+    // /sys/devices/system/cpu/cpuN/ 下有一个 nodeX 的链接
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+#else
+    return 0;
+#endif
+}
+
+
+int dm_cpu_bind_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    unsigned long nodemask[16];
+    int node;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return -1;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+        return -1;
+
+    // 没有 NUMA 的内核上失败也没有关系, 默认策略本来就是本地分配
+    node = dm_cpu_node(cpu);
+    if (node < (int)(sizeof(nodemask) * 8)) {
+        memset(nodemask, 0, sizeof(nodemask));
+        nodemask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+        syscall(SYS_set_mempolicy, DM_MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8);
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+int dm_cpu_bind_thread_set(const dm_cpu_set_t *set)
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int i = 0; i < set->num; i++)
+        if (set->cpus[i] < CPU_SETSIZE)
+            CPU_SET(set->cpus[i], &mask);
+    if (CPU_COUNT(&mask) == 0)
+        return -1;
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
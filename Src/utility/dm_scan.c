@@ -0,0 +1,135 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#include <dmfserver/utility/dm_scan.h>
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DM_SCAN_X86
+#include <immintrin.h>
+#endif
+
+
+static const char * dm_scan_scalar(const char *p, const char *end, const char *set, int set_len)
+{
+    for (; p < end; p++)
+        for (int i = 0; i < set_len; i++)
+            if (*p == set[i])
+                return p;
+    return end;
+}
+
+
+#ifdef DM_SCAN_X86
+// 一次比较 16 字节和整个集合, 返回第一个匹配的位置; 不足 16 字节的尾部逐字节比较, 不越过 end 读取
+__attribute__((target("sse4.2")))
+static const char * dm_scan_sse42(const char *p, const char *end, const char *set, int set_len)
+{
+    char buf[16] = {0};
+    __m128i needle;
+    int idx;
+
+    memcpy(buf, set, set_len);
+    needle = _mm_loadu_si128((const __m128i *)buf);
+    for (; end - p >= 16; p += 16) {
+        idx = _mm_cmpestri(needle, set_len, _mm_loadu_si128((const __m128i *)p), 16,
+                _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (idx < 16)
+            return p + idx;
+    }
+    return dm_scan_scalar(p, end, set, set_len);
+}
+
+
+// 每个字符比较一次 32 字节, 结果合并以后用 movemask 取出第一个匹配的位置
+__attribute__((target("avx2")))
+static const char * dm_scan_avx2(const char *p, const char *end, const char *set, int set_len)
+{
+    __m256i needle[DM_SCAN_SET_MAX];
+    __m256i block, hit;
+    unsigned int mask;
+
+    for (int i = 0; i < set_len; i++)
+        needle[i] = _mm256_set1_epi8(set[i]);
+    for (; end - p >= 32; p += 32) {
+        block = _mm256_loadu_si256((const __m256i *)p);
+        hit = _mm256_cmpeq_epi8(block, needle[0]);
+        for (int i = 1; i < set_len; i++)
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(block, needle[i]));
+        mask = (unsigned int)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return dm_scan_scalar(p, end, set, set_len);
+}
+#endif
+
+
+typedef const char * (*dm_scan_fn)(const char *, const char *, const char *, int);
+
+static dm_scan_fn dm_scan_kernel = NULL;
+static const char * dm_scan_name = "scalar";
+
+// 第一次调用时选择实现, 多个线程同时选择时结果相同
+static dm_scan_fn dm_scan_select()
+{
+    dm_scan_fn fn = dm_scan_scalar;
+    const char * name = "scalar";
+
+#ifdef DM_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fn = dm_scan_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        fn = dm_scan_sse42;
+        name = "sse4.2";
+    }
+#endif
+    dm_scan_name = name;
+    dm_scan_kernel = fn;
+    return fn;
+}
+
+
+const char * dm_scan(const char *p, const char *end, const char *set, int set_len)
+{
+    dm_scan_fn fn = dm_scan_kernel;
+
+    if (p >= end)
+        return end;
+    // 单个字符时 libc 的 memchr 已经向量化
+    if (set_len == 1) {
+        const char * r = (const char *)memchr(p, set[0], end - p);
+        return r != NULL ? r : end;
+    }
+    if (set_len > DM_SCAN_SET_MAX)
+        return dm_scan_scalar(p, end, set, set_len);
+    if (fn == NULL)
+        fn = dm_scan_select();
+    return fn(p, end, set, set_len);
+}
+
+
+const char * dm_scan_impl()
+{
+    if (dm_scan_kernel == NULL)
+        dm_scan_select();
+    return dm_scan_name;
+}
@@ -18,8 +18,16 @@
 
 #include <dmfserver/utility/dm_thread_pool.h>
 
+#include <string.h>
+
 // start some thread 
 thread_pool_t *thread_pool_create(int thread_count) {
+    return thread_pool_create_bind(thread_count, NULL);
+}
+
+
+// 工作线程只在 cpus 里运行, 和 reactor 占用的核分开
+thread_pool_t *thread_pool_create_bind(int thread_count, const dm_cpu_set_t *cpus) {
     thread_pool_t *pool;
     int i;
 
@@ -41,6 +49,14 @@ thread_pool_t *thread_pool_create(int thread_count) {
 	
     pool->thread_count = 0;
     pool->shutdown = false;
+    pool->cpus = NULL;
+
+    if (cpus != NULL && cpus->num > 0) {
+        pool->cpus = (dm_cpu_set_t*) malloc(sizeof(dm_cpu_set_t));
+        if (pool->cpus != NULL) {
+            memcpy(pool->cpus, cpus, sizeof(dm_cpu_set_t));
+        }
+    }
 
     for (i = 0; i < thread_count; i++) {
         thread_t *thread;
@@ -81,6 +97,10 @@ void *thread_func(void *arg) {
 	
 	thread_t* thread = (thread_t*) arg;
 	thread_pool_t *pool = thread->pool;
+
+	if (pool->cpus != NULL) {
+		dm_cpu_bind_thread_set(pool->cpus);
+	}
 	
 	while (true) {
 		pthread_mutex_lock(&(pool->lock));
@@ -238,6 +258,7 @@ void thread_pool_destroy(thread_pool_t *pool) {
 
 	pthread_mutex_destroy(&(pool->lock));
 	pthread_cond_destroy(&(pool->notify));
+	free(pool->cpus);
 	free(pool);
 }
 
@@ -0,0 +1,212 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#include <dmfserver/utility/dm_timer_wheel.h>
+
+#ifdef __WIN32__
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+// 单调时钟的毫秒数, 不受系统时间修改影响
+unsigned long long dm_timer_now_ms()
+{
+#ifdef __WIN32__
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+// 单调时钟的微秒数, reactor 自旋计时用
+unsigned long long dm_timer_now_us()
+{
+#ifdef __WIN32__
+    return GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+static void dm_timer_list_init(dm_timer_node_t *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+
+static void dm_timer_list_add(dm_timer_node_t *head, dm_timer_node_t *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+
+static void dm_timer_list_del(dm_timer_node_t *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+
+// slot_num 会向上取到 2 的幂
+int dm_timer_wheel_init(dm_timer_wheel_t *wheel, size_t slot_num, unsigned int tick_ms)
+{
+    size_t n = 1;
+    while (n < slot_num)
+        n <<= 1;
+
+    wheel->slots = (dm_timer_node_t *)malloc(n * sizeof(dm_timer_node_t));
+    if (wheel->slots == NULL)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        dm_timer_list_init(&wheel->slots[i]);
+
+    wheel->slot_mask = n - 1;
+    wheel->tick_ms = tick_ms ? tick_ms : 1;
+    wheel->current = dm_timer_now_ms() / wheel->tick_ms;
+    wheel->count = 0;
+    return 0;
+}
+
+
+// 不会调用剩下定时器的回调
+void dm_timer_wheel_destroy(dm_timer_wheel_t *wheel)
+{
+    for (size_t i = 0; i <= wheel->slot_mask; i++) {
+        dm_timer_node_t *head = &wheel->slots[i];
+        while (head->next != head)
+            dm_timer_list_del(head->next);
+    }
+    free(wheel->slots);
+    wheel->slots = NULL;
+    wheel->count = 0;
+}
+
+
+void dm_timer_node_init(dm_timer_node_t *node, void (*callback)(dm_timer_node_t *), void *data)
+{
+    node->prev = NULL;
+    node->next = NULL;
+    node->expire = 0;
+    node->callback = callback;
+    node->data = data;
+}
+
+
+int dm_timer_pending(const dm_timer_node_t *node)
+{
+    return node->next != NULL;
+}
+
+
+// 已经在时间轮中的定时器会先被移除, 即重新设置超时
+void dm_timer_add(dm_timer_wheel_t *wheel, dm_timer_node_t *node, unsigned int timeout_ms)
+{
+    unsigned long long expire;
+
+    if (dm_timer_pending(node))
+        dm_timer_del(wheel, node);
+
+    expire = (dm_timer_now_ms() + timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (expire <= wheel->current)
+        expire = wheel->current + 1;
+
+    node->expire = expire;
+    dm_timer_list_add(&wheel->slots[expire & wheel->slot_mask], node);
+    wheel->count++;
+}
+
+
+void dm_timer_del(dm_timer_wheel_t *wheel, dm_timer_node_t *node)
+{
+    if (!dm_timer_pending(node))
+        return;
+    dm_timer_list_del(node);
+    wheel->count--;
+}
+
+
+// 处理到当前时间为止到期的定时器, 返回调用的回调个数
+// 到期的节点先移到临时链表再调用回调, 回调中可以释放节点或者操作其他定时器
+int dm_timer_wheel_expire(dm_timer_wheel_t *wheel)
+{
+    dm_timer_node_t expired;
+    unsigned long long now = dm_timer_now_ms() / wheel->tick_ms;
+    unsigned long long steps;
+    int fired = 0;
+
+    if (now <= wheel->current)
+        return 0;
+
+    // 落后超过一圈时每个槽只需要扫描一次
+    steps = now - wheel->current;
+    if (steps > wheel->slot_mask + 1)
+        steps = wheel->slot_mask + 1;
+
+    dm_timer_list_init(&expired);
+    for (unsigned long long i = 1; i <= steps; i++) {
+        dm_timer_node_t *head = &wheel->slots[(wheel->current + i) & wheel->slot_mask];
+        dm_timer_node_t *node = head->next;
+        while (node != head) {
+            dm_timer_node_t *next = node->next;
+            if (node->expire <= now) {
+                dm_timer_list_del(node);
+                dm_timer_list_add(&expired, node);
+            }
+            node = next;
+        }
+    }
+    wheel->current = now;
+
+    while (expired.next != &expired) {
+        dm_timer_node_t *node = expired.next;
+        dm_timer_list_del(node);
+        wheel->count--;
+        fired++;
+        if (node->callback)
+            node->callback(node);
+    }
+    return fired;
+}
+
+
+// 距离下一个 tick 的毫秒数, 可以直接作为 epoll_wait 的超时; 没有定时器时返回 -1
+int dm_timer_wheel_timeout(const dm_timer_wheel_t *wheel)
+{
+    unsigned long long now, next;
+
+    if (wheel->count == 0)
+        return -1;
+
+    now = dm_timer_now_ms();
+    next = (wheel->current + 1) * wheel->tick_ms;
+    return next > now ? (int)(next - now) : 0;
+}
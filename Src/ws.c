@@ -22,6 +22,7 @@
 #include <dmfserver/utility/base64.h>  
 #include <dmfserver/connection.h>
 #include <dmfserver/socket.h>
+#include <dmfserver/response.h>
 
 static void sha1(char sText[], char* shaed) {
 	SHA_CTX ctx;
@@ -151,10 +152,39 @@ int parseWebSocketFrame(const unsigned char *data, size_t data_length,
 }
 
 //  将协议转换到websocket
+//  下面的循环阻塞读写 socket, reactor 的连接只能在线程池中执行 (路由用 router_add_app_blocking 注册),
+//  每个打开的 websocket 占用一个线程池线程; 在 reactor 线程中, 或者是 TLS 连接时返回 501
 extern void upto_ws_prot(connection_tp conn, char key[]) 
 {
     int a = conn->per_handle_data->Socket;
 	char sha[128] = {0};
+	unsigned char data[1024];
+	int data_length = 0;
+
+	// websocket 连接由这里接管, 结束后由 container 关闭
+	conn->keep_alive = 0;
+#ifdef __linux__
+	int fl = fcntl(a, F_GETFL, 0);
+
+	if (conn->per_handle_data->reactor != NULL && (!conn->offloaded || conn->ssl != NULL)) {
+		res_not_implemented(conn);
+		return;
+	}
+	fcntl(a, F_SETFL, fl & ~O_NONBLOCK);
+	// 前面 pipeline 请求还没有发完的响应先发出去, socket 已经是阻塞的
+	if (connection_flush(conn) < 0) {
+		fcntl(a, F_SETFL, fl);
+		return;
+	}
+	// 升级请求后面已经读进读缓冲的帧先处理
+	if (conn->offloaded && conn->rlen > conn->rpos) {
+		data_length = conn->rlen - conn->rpos;
+		if (data_length > (int)sizeof(data))
+			data_length = sizeof(data);
+		memcpy(data, conn->rbuf + conn->rpos, data_length);
+		conn->rlen = conn->rpos;
+	}
+#endif
 	strcat(key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
 	sha1(key, sha);
 
@@ -183,12 +213,10 @@ extern void upto_ws_prot(connection_tp conn, char key[])
 
 	while(!shouldClose) {
 		// 解析数据帧
-		unsigned char data[1024];  // 假设接收到的数据
-
-    	size_t data_length = recv( a, data, sizeof(data), 0 );
-		if(data_length == 0) {
-            close_socket(a);
-			return;
+		if (data_length == 0)
+			data_length = recv( a, data, sizeof(data), 0 );
+		if(data_length <= 0) {
+			break;
 		}
 
 		unsigned char *payload;
@@ -209,10 +237,13 @@ extern void upto_ws_prot(connection_tp conn, char key[])
 		}else{
 			printf("Can't parse data frame\n");
 		}
+		data_length = 0;
 
 
 		const char *message = "Hello, WebSocket!";
 		sendWebSocketFrame(a, message, strlen(message));
 	}
-    close_socket(a);
+#ifdef __linux__
+	fcntl(a, F_SETFL, fl);			// 回到 reactor 以后由它关闭
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# 打开大量空闲的 keep-alive 连接, 报告 server 进程每个连接占用的内存 (RSS)
+# 用法: python3 idle_bench.py <server pid> [连接数] [端口] [路径]
+# 每个连接先完成一次请求, 然后保持空闲; 超过 6 万个连接时轮流使用 127.0.0.x 作为源地址
+# server 的 keepalive_timeout 应设为 0 或足够大, ulimit -n 和 max_conns 要大于连接数
+
+import resource
+import select
+import socket
+import sys
+import time
+
+
+def rss_kb(pid):
+	with open('/proc/%d/status' % pid) as f:
+		for line in f:
+			if line.startswith('VmRSS:'):
+				return int(line.split()[1])
+	return 0
+
+
+def main():
+	pid = int(sys.argv[1])
+	total = int(sys.argv[2]) if len(sys.argv) > 2 else 100000
+	port = int(sys.argv[3]) if len(sys.argv) > 3 else 80
+	path = sys.argv[4] if len(sys.argv) > 4 else '/'
+
+	soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+	resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+	if hard < total + 16:
+		print('RLIMIT_NOFILE %d is too small for %d connections' % (hard, total))
+		return
+
+	request = ('GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n' % path).encode()
+	before = rss_kb(pid)
+	conns = []
+	batch = 0
+	start = time.time()
+
+	for i in range(total):
+		s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		s.bind(('127.0.0.%d' % (1 + i // 60000), 0))
+		s.connect(('127.0.0.1', port))
+		s.sendall(request)
+		conns.append(s)
+		# 分批读完响应, 保证服务器已经处理过请求, 连接进入空闲状态; 只读这一批新建的连接
+		if len(conns) - batch == 1000 or i == total - 1:
+			for c in conns[batch:]:
+				if select.select([c], [], [], 5)[0]:
+					c.recv(65536)
+			batch = len(conns)
+
+	time.sleep(2)
+	after = rss_kb(pid)
+	print('connections: %d in %.1fs' % (total, time.time() - start))
+	print('rss before: %d KB, after: %d KB' % (before, after))
+	print('rss per idle connection: %.0f bytes' % ((after - before) * 1024.0 / total))
+
+	for c in conns:
+		c.close()
+
+
+if __name__ == '__main__':
+	main()
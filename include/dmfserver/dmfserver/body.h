@@ -0,0 +1,53 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __BODY_INCLUDE__
+#define __BODY_INCLUDE__
+
+#include <dmfserver/conf/conf.h>
+#include <dmfserver/connection.h>
+#include <dmfserver/request.h>
+
+#define BODY_SPOOL_MEM      HTTP_BODY_MAX       // 不超过这个大小的 body 留在内存中, 更大的写入临时文件
+#define BODY_SPOOL_DIR      "/tmp"              // 临时文件所在的目录, 文件没有名字, 关闭以后自动删除
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 默认的 body 消费者 (BodyFun), 在 router_add_app_body 中使用:
+// body 收完以后, 留在内存中的通过 req->body 读取, 写入临时文件的通过 body_spool_fd 读取,
+// 两种情况下 req->body.length 都是 body 的长度
+extern req_body_sink_t * body_spool(connection_tp conn, const request_t * req);
+
+extern req_body_sink_t * body_spool_new(size_t expect, size_t mem_max, size_t limit);
+
+// 在 BODY_SPOOL_DIR 中创建没有名字的临时文件, 失败时返回 -1
+extern int body_tmpfile();
+
+// 写完 len 个字节, 失败时返回 -1
+extern int body_write(int fd, const char * data, size_t len);
+
+// body 写入了临时文件时返回文件描述符, 读写位置在文件开头, 请求结束时关闭; 否则返回 -1
+extern int body_spool_fd(const request_t * req);
+
+#ifdef __cplusplus
+}		/* end of the 'extern "C"' block */
+#endif
+
+#endif // __BODY_INCLUDE__
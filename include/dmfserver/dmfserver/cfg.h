@@ -20,11 +20,7 @@
 #define __CFG_INCLUDE__
 
 
-// #define __SERVER_MPOOL__		// 启用server内存池
-
-#ifdef __SERVER_MPOOL__
-#define SERVER_MPOOL_NUM 8192
-#endif // __SERVER_MPOOL__
+// #define __SERVER_IO_URING__	// 启用 io_uring container, cmake 找到 liburing 时自动定义
 
 // #define __SERVER_IOCP_DEBUG__  // 不会启用request router 等模块，接到请求直接返回 hello woorld 字符串
 
@@ -34,15 +34,68 @@ typedef enum _ServerMode {
     SSLServer,
 #ifdef __linux__
     EpollServer,
+    IoUringServer,
 #endif
 } ServerMode;
 
+#define CONF_LISTEN_MAX 16
+
+typedef enum _conf_listen_family {
+    CONF_LISTEN_INET,
+    CONF_LISTEN_INET6,
+    CONF_LISTEN_UNIX,
+} conf_listen_family;
+
+// 一个监听地址, 在 <listeners> 中配置; 没有配置时由 <listen> 端口生成一个
+typedef struct conf_listener {
+    conf_listen_family family;
+    char address[108];          // IP 地址 (空表示所有地址) 或者 unix socket 路径
+    int port;
+    int backlog;
+    int tls;                    // 1 这个监听地址上的连接使用 TLS
+    int defer_accept;           // TCP_DEFER_ACCEPT 秒数, 收到数据以后才完成 accept, 0 关闭
+    int fastopen;               // TCP_FASTOPEN 队列长度, 0 关闭
+    int rcvbuf;                 // SO_RCVBUF / SO_SNDBUF, accept 的连接继承, 0 使用系统默认值
+    int sndbuf;
+    int busy_poll;              // SO_BUSY_POLL 的微秒数, 同时设置 SO_PREFER_BUSY_POLL, 0 关闭
+} conf_listener;
+
 typedef struct conf_server {
     int port;
     char host[64];
     ServerMode mode;
     char cert_private[128];
     char cert_public[128];
+    int reactor_num;            // epoll reactor 线程数, 0 表示与 cpu 核数相同 (多进程模式下为每个 worker 1 个)
+    int multi_process;          // 1 使用 master/worker 多进程模式 (linux)
+    int workers;                // worker 进程数, 0 表示与 cpu 核数相同
+    int daemon;                 // 多进程模式下 master 转为守护进程
+    int keepalive_requests;     // 一个 keep-alive 连接上最多处理的请求数
+    int keepalive_timeout;      // 超时秒数, 0 表示不限制; 空闲的 keep-alive 连接
+    int header_timeout;         // 读完请求头部
+    int body_timeout;           // 读 body 时两次收到数据的间隔
+    int send_timeout;           // 响应没有发完时两次发出数据的间隔
+    int drain_timeout;          // 平滑退出 (SIGQUIT) 时等待已有连接处理完的秒数
+    int ktls;                   // 1 开启内核 TLS, https 的静态文件用 sendfile 发送
+    int session_cache;          // TLS 会话缓存条目数 (所有 reactor 和 worker 共享), 0 关闭
+    int session_timeout;        // TLS 会话 (缓存和 ticket) 的有效秒数
+    int ticket_key_rotate;      // ticket 密钥轮换的秒数, 0 关闭 session ticket
+    int max_conns;              // 每个 reactor 的连接数上限, 达到时暂停 accept, 0 表示不限制
+    int max_inflight;           // 每个 reactor 同时处理的请求数上限, 超过时返回 503, 0 表示不限制
+    int max_inflight_total;     // 所有 reactor 和 worker 合计的上限
+    int pool_queue;             // 每个进程等待和正在执行的阻塞 view 上限, 超过时返回 503, 0 表示不限制
+    char status_path[64];       // 返回负载和上限的路径, 例如 /server-status, 空表示关闭
+    int pool_threads;           // 每个进程执行阻塞 view 的线程数, 0 表示阻塞 view 也在 reactor 中执行
+    int cpu_affinity;           // 1 把 reactor 绑定到 io_cpus 的核上, 线程池绑定到 pool_cpus (linux)
+    char io_cpus[256];          // 例如 "0-7", 空表示进程可以使用的所有核
+    char pool_cpus[256];        // 空表示 io_cpus 以外的核, 没有剩余的核时和 reactor 共用
+    int busy_spin;              // epoll reactor 阻塞前用 epoll_wait(..., 0) 自旋的最长微秒数, 按负载自适应, 0 关闭
+    int conn_batch;             // reactor 每轮最多处理一个连接的请求数, 剩下的轮到其它连接之后再处理, 0 表示不限制
+    int zerocopy_min;           // 不小于这个字节数的动态响应 body 用 MSG_ZEROCOPY 发送, 0 关闭
+    int upload_max;             // 流式接收的 body 上限 (MB), 超过时返回 413, 0 表示不限制
+    int chunked_meta_max;       // chunked 编码的 body 中 chunk 扩展和 trailer 的总字节数上限, 0 表示不限制
+    conf_listener listeners[CONF_LISTEN_MAX];
+    int listener_num;
     
 } conf_server;
 
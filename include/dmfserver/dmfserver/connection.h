@@ -23,9 +23,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dmfserver/request.h>
+#include <dmfserver/utility/dm_timer_wheel.h>
+#include <openssl/ssl.h>
 
 #define DATA_BUFSIZE 2048
 
+#define CONN_RBUF_INIT  4096                                // 读缓冲初始大小
+#define CONN_RBUF_MAX   (HTTP_HEADER_MAX + HTTP_BODY_MAX)   // 读缓冲上限, 一个完整请求
+#define CONN_BODY_WINDOW (1024*64)                          // 流式 body 在读缓冲中最多积压的字节数
+#define CONN_ALIGN      64                                  // 连接对象按 cache line 对齐
+
+#define CONN_SEG_MIN    4096                                // 复制数据时输出段的最小容量, 小段会合并
+#define CONN_OUT_HIGH   (1024*256)                          // 输出队列超过这个值时暂停读取这个连接
+#define CONN_OUT_LOW    (1024*64)                           // 降到这个值以下时恢复读取
+#define CONN_IOV_MAX    16                                  // 一次 sendmsg 最多合并的段数
+#define CONN_TLS_CHUNK  16384                               // TLS 发送文件时每次读取的大小, 一个 record
+
+// 连接当前等待的超时类型
+typedef enum _conn_timeout_t {
+    CONN_TIMEOUT_NONE,
+    CONN_TIMEOUT_IDLE,          // keep-alive 连接等待下一个请求
+    CONN_TIMEOUT_HEADER,        // 从请求的第一个字节到头部结束
+    CONN_TIMEOUT_BODY,          // 读 body 时两次收到数据之间
+    CONN_TIMEOUT_SEND,          // 输出队列没有发完时两次发出数据之间
+} conn_timeout_t;
+
+// 输出队列中的一段数据
+typedef enum _conn_seg_type_t {
+    CONN_SEG_HEAP,              // 队列拥有的堆内存, 发送完释放
+    CONN_SEG_STATIC,            // 调用者保证在发送完之前一直有效, 不复制也不释放
+    CONN_SEG_FILE,              // 文件的一段, 用 sendfile 发送
+    CONN_SEG_ZEROCOPY,          // 队列拥有的堆内存, 用 MSG_ZEROCOPY 单独发送, 内核通知用完以后才释放
+} conn_seg_type_t;
+
+typedef struct _conn_seg_t {
+    struct _conn_seg_t * next;
+    conn_seg_type_t      type;
+    const char         * data;
+    size_t               cap;           // HEAP 段的容量
+    int                  fd;            // FILE 段的文件
+    int                  close_fd;      // 发送完以后关闭 fd
+    long long            offset;        // 下一个要发送的位置, 内存段为 data 中的偏移
+    size_t               len;           // 还没有发送的字节数
+    unsigned int         zc_id;         // ZEROCOPY 段最后一次 MSG_ZEROCOPY 发送的通知序号
+    int                  zc_sent;       // 至少有一次是零拷贝发出的, 发送完以后要等内核的通知
+} conn_seg_t;
+
 #ifdef __WIN32__ // Windows
 #include <WinSock2.h>
 #include <WS2tcpip.h>
@@ -51,6 +94,7 @@ typedef struct {
     int efd;
 	int Socket;
     struct _connection_t * conn;
+    struct _reactor_t * reactor;       // 连接所属的 reactor
 } per_handle_data_t, * per_handle_data_tp;
 
 #endif // linux
@@ -59,9 +103,73 @@ typedef struct _connection_t {
     per_io_data_tp      per_io_data;
     per_handle_data_tp  per_handle_data;
     request_t             *req;
+
+    char                *rbuf;          // 连接自己的读缓冲, 请求可以分多次到达
+    size_t               rlen;          // 已读入的字节数
+    size_t               rcap;          // 缓冲容量 (不含结尾的 '\0')
+
+    int                  keep_alive;    // 响应之后是否保持连接, 由 container 在路由前设置
+    unsigned int         req_count;     // 这个连接上已经处理的请求数
+
+    // container 可以接管响应的发送 (例如 io_uring 提交 send), 为 NULL 时直接写 socket
+    int                (*sender)(struct _connection_t * conn, const char * buf, size_t len);
+    void                *io_ctx;        // container 私有的连接数据
+
+    dm_timer_node_t      timer;         // 挂在所属 reactor 的时间轮上
+    conn_timeout_t       timeout;
+
+    conn_seg_t          *out_head;      // 还没有发出的响应, 由 container 在可写时继续发送
+    conn_seg_t          *out_tail;
+    size_t               out_bytes;
+    int                  read_paused;   // 输出积压超过 CONN_OUT_HIGH, 暂停读取和处理请求
+    int                  read_eof;      // 对端已经关闭写
+    int                  closing;       // 输出队列发送完以后关闭
+
+    int                  zerocopy;      // socket 打开了 SO_ZEROCOPY
+    int                  zc_copied;     // 内核通知数据被复制了 (例如回环), 之后不再使用 MSG_ZEROCOPY
+    unsigned int         zc_next;       // 内核给下一次 MSG_ZEROCOPY 发送的通知序号
+    conn_seg_t          *zc_head;       // 已经发出但内核还在引用的 ZEROCOPY 段, 按序号排列
+    conn_seg_t          *zc_tail;
+
+    int                  offloaded;     // 阻塞 view 正在线程池中执行, 这期间 reactor 不读写这个连接
+    size_t               rpos;          // 读缓冲中已经处理完的请求, 交给线程池时记下, 回来以后接着处理
+    struct _connection_t *done_next;    // 执行完以后挂在 reactor 的完成队列上
+    int                  inflight;      // 正在处理的请求计入了 reactor 和全局的 in-flight 数
+
+    unsigned int         work;          // 连续积压期间处理的请求数, 读缓冲中的请求处理完时清零
+    int                  ready;         // 在 reactor 的就绪队列上, 读缓冲中还有请求等下一轮处理
+    struct _connection_t *ready_prev;
+    struct _connection_t *ready_next;
+
+    SSL                 *ssl;           // TLS 连接, 读写都经过它, 明文连接为 NULL
+
+    struct _conn_slab_t *slab;          // 所属的 slab, NULL 表示直接分配
+    struct _connection_t *slab_prev;    // 使用中时在 slab 的 used_list 上 (双向),
+    struct _connection_t *slab_next;    // 空闲时在 free_list 上 (只用 slab_next)
+
+    // 上面的 per_handle_data, per_io_data 指向这里, 一次分配得到整个连接
+    // req 和 rbuf 只在有数据要处理时挂上, 空闲的连接只占这个对象本身
+    per_handle_data_t    handle_data;
+    per_io_data_t        io_data;
 } connection_t, * connection_tp;
 
 
+// 连接对象的空闲链表, 每个 reactor 一个, 只在 reactor 线程中使用, 不需要加锁
+typedef struct _conn_slab_t {
+    connection_tp        free_list;
+    size_t               free_num;
+    size_t               free_max;      // 空闲对象超过这个数时直接还给系统
+    size_t               used;          // 正在使用的连接数
+    connection_tp        used_list;     // 正在使用的连接, 排空时用来找到所有连接
+
+    // 空闲连接交还的 request 和初始大小的读缓冲, 开头存放下一个的指针, 最多各缓存 free_max 个
+    request_t           *req_free;
+    size_t               req_num;
+    char                *rbuf_free;
+    size_t               rbuf_num;
+} conn_slab_t;
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -72,16 +180,60 @@ extern "C" {
 extern connection_tp 
 new_connection ();
 
+extern void
+conn_slab_init (conn_slab_t * slab, size_t free_max);
+
+extern void
+conn_slab_destroy (conn_slab_t * slab);
+
+extern connection_tp
+conn_slab_acquire (conn_slab_t * slab);
+
+extern request_t *
+connection_req_attach (connection_tp conn);
+
+extern void
+connection_idle (connection_tp conn);
+
 #ifdef __WIN32__
 extern void
 send_next (connection_tp conn) ;
 #endif
 
-extern void 
-connection_close (connection_tp conn);
+#ifdef __linux__
+extern int
+connection_read (connection_tp conn);
+
+extern int
+connection_append (connection_tp conn, const char * data, size_t len);
+
+extern int
+connection_send_all (connection_tp conn, const char * buf, size_t len);
+
+extern int
+connection_out_copy (connection_tp conn, const char * buf, size_t len);
+
+extern int
+connection_out_static (connection_tp conn, const char * buf, size_t len);
+
+extern int
+connection_out_file (connection_tp conn, int fd, long long offset, size_t len, int close_fd);
+
+extern int
+connection_out_zerocopy (connection_tp conn, char * buf, size_t len);
+
+extern int
+connection_flush (connection_tp conn);
+
+extern int
+connection_zerocopy_reap (connection_tp conn);
 
 extern void
-connection_free_base (connection_tp conn);
+connection_out_clear (connection_tp conn);
+#endif
+
+extern void 
+connection_close (connection_tp conn);
 
 extern void
 connection_free (connection_tp conn);
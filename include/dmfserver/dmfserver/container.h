@@ -31,6 +31,7 @@
 #include <dmfserver/mpool.h>
 #include <dmfserver/middleware/middleware.h>
 #include <dmfserver/socket.h>
+#include <dmfserver/utility/dm_timer_wheel.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -63,26 +64,53 @@
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
 
-typedef struct fd_ssl_map {
-	int fd;
-	SSL* ssl;
-	struct fd_ssl_map* next;
-} fd_ssl_map ;
+// 所有 worker 共享的负载计数, 在 fork 之前建立在共享内存中
+typedef struct _container_load_t {
+	_Atomic long inflight;		// 所有 worker 正在处理的请求数
+	_Atomic long shed;			// 因为过载返回 503 的请求数
+} container_load_t;
+
+// reactor 上的一个监听 socket, epoll 的 data.ptr 指向它
+typedef struct _listener_t {
+	int			fd;
+	int			tls;			// 这个 socket 上 accept 的连接先进行 TLS 握手
+	int			shared;			// 所有 reactor 共用 (unix socket), 使用 EPOLLEXCLUSIVE 避免同时唤醒
+} listener_t;
+
+// 每个 reactor 独占一个线程、一个 epoll 和一个 SO_REUSEPORT 监听 socket
+typedef struct _reactor_t {
+	int 		id;
+	pthread_t 	tid;
+	int 		epfd;
+	listener_t *	listeners;	// 这个 reactor 服务的所有监听 socket, TCP 的每个 reactor 一个, unix socket 共用
+	int			listen_num;
+	int			cpu;			// 绑定的 cpu, -1 表示不绑定
+	long 		conn_num;		// 当前 reactor 上的连接数
+	dm_timer_wheel_t wheel;		// 连接的空闲, 头部, body 超时
+	conn_slab_t	slab;			// 连接对象的空闲链表
+	SSL_CTX *	ssl_ctx;		// 不为 NULL 时新连接先进行 TLS 握手
+	int			draining;		// 收到 SIGQUIT, 不再 accept, 连接处理完当前请求后关闭
+	unsigned long long drain_deadline;	// 到这个时间 (ms) 还没有关闭的连接直接关闭
+	int			done_fd;		// 线程池执行完阻塞 view 以后通过这个 eventfd 唤醒 reactor
+	pthread_mutex_t done_lock;	// 保护 done_list, 线程池线程和 reactor 都会访问
+	connection_tp done_list;	// 执行完的连接, 回到 reactor 线程中继续处理
+	long		offloaded;		// 正在线程池中的连接数
+	long		inflight;		// 正在处理的请求数, 从开始处理到响应全部交给内核
+	long		shed;			// 因为过载返回 503 的请求数
+	int			accept_paused;	// 连接数达到 max_conns, 新连接留在内核的 backlog 中
+	int			spin_us;		// 当前的自旋预算 (微秒), 0 表示直接阻塞
+	connection_tp ready_head;	// 用完 conn_batch 还有请求的连接, 每轮 epoll_wait 之后依次再处理一批
+	connection_tp ready_tail;
+	long		throttled;		// 积压的连接被降为每轮一个请求的次数
+	container_load_t * load;	// 所有 worker 共享的计数
+} reactor_t, * reactor_tp;
 
 #endif  		// Linux
 
-
-typedef struct thread_arg {
-	ctl_fun_map_t cmp;
-	long fd;
-} thread_arg;
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-static SSL_CTX* get_ssl_ctx();
-
 static void simple_container_handler(connection_tp conn_ptr );
 
 extern void simple_container_make();
@@ -98,8 +126,17 @@ extern int iocp_container_make();
 #endif  		   // Windows
 
 #ifdef __linux__   // linux epool Model
-extern void epoll_container_make();
-extern int epoll_ssl_container();
+// worker 是 worker 进程的 id, 单进程模式下为 0
+extern void epoll_container_make(int worker);
+
+// 连接关闭时结束它正在处理的请求
+extern void container_inflight_end(connection_tp conn);
+
+// 连接关闭时从 reactor 的就绪队列上去掉
+extern void container_ready_del(connection_tp conn);
+#ifdef __SERVER_IO_URING__
+extern void io_uring_container_make(int worker);
+#endif 			   // __SERVER_IO_URING__
 #endif  		   // linux
 
 #ifdef __cplusplus
@@ -55,6 +55,7 @@ typedef struct mysql_pool
 	pthread_cond_t idle_signal;	//等待可用连接的条件变量
 
 	mysql_conn * mysql_list; 	//mysql连接池链表
+	int need_fill;				//fork 之后还没有建立本进程的连接
 
 } mysql_pool;
 
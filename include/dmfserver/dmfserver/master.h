@@ -0,0 +1,50 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __MASTER_INCLUDE__
+#define __MASTER_INCLUDE__
+
+#ifdef __linux__
+
+#include <sys/types.h>
+
+// 平滑升级时旧 master 传给新程序的环境变量: 监听 socket 的 fd 列表 (逗号分隔) 和旧 master 的 pid
+#define MASTER_LISTEN_FDS   "DMF_LISTEN_FDS"
+#define MASTER_UPGRADE_PID  "DMF_UPGRADE_PID"
+
+// worker 进程的入口, id 从 0 开始, 同一个 id 的 worker 崩溃后以相同的 id 重启
+typedef void (*worker_function)(int id);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 在 master 进程中调用: 所有共享的初始化 (配置, 模板, 路由, 监听 socket) 要在这之前完成,
+// fork 出 worker_num 个 worker 以后一直监督它们.
+//   SIGTERM/SIGINT/SIGUSR1  立即停止所有 worker 再返回
+//   SIGQUIT                 worker 停止 accept, 处理完已有的连接后退出, 然后返回
+//   SIGUSR2                 exec 新的程序并把 listen_fds 交给它, 新 master 就绪后向这里发送 SIGQUIT
+extern void multi_process_init(int worker_num, worker_function wf, const int *listen_fds, int listen_num);
+
+#ifdef __cplusplus
+}		/* end of the 'extern "C"' block */
+#endif
+
+#endif // __linux__
+
+#endif // __MASTER_INCLUDE__
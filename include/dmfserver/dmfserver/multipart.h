@@ -0,0 +1,100 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __MULTIPART_INCLUDE__
+#define __MULTIPART_INCLUDE__
+
+#include <dmfserver/request.h>
+#include <dmfserver/connection.h>
+
+#define MULTIPART_BOUNDARY_MAX  70                          // RFC 2046 规定的 boundary 最大长度
+#define MULTIPART_DELIM_MAX     (MULTIPART_BOUNDARY_MAX + 4) // 分隔符 "\r\n--" + boundary
+#define MULTIPART_HEAD_MAX      1024                        // 每个 part 的头部最大长度
+
+typedef enum _multipart_state_t {
+    MULTIPART_BODY,             // 第一个分隔符之前的 preamble, 或者一个 part 的数据
+    MULTIPART_DELIM,            // 分隔符之后, 可能有空白
+    MULTIPART_LF,               // 分隔符之后的 \r, 等 \n
+    MULTIPART_CLOSE,            // 分隔符之后的第一个 '-', 等第二个
+    MULTIPART_HEAD,             // part 的头部
+    MULTIPART_END               // 结束分隔符之后的 epilogue, 忽略
+} multipart_state_t;
+
+typedef struct _multipart_t multipart_t;
+
+// 增量解析 multipart/form-data, 数据可以在任意位置断开, 分多次交给 multipart_feed
+// 用 Boyer-Moore-Horspool 查找分隔符, part 的数据不经过中间缓冲, 直接交给 on_data
+// on_part 在 part 的头部解析完时调用, 返回保存这个 part 的位置, NULL 拒绝请求;
+// on_data 可能对一个 part 调用多次, on_end 在 part 结束时调用, 返回 -1 拒绝请求
+struct _multipart_t {
+    multipart_state_t   state;
+    request_t *         req;
+    struct Multipart *  part;                               // 当前的 part, preamble 中为 NULL
+    struct Multipart *  (*on_part)(multipart_t * mp, const struct Multipart * head);
+    int                 (*on_data)(multipart_t * mp, struct Multipart * part, const char * data, size_t len);
+    int                 (*on_end)(multipart_t * mp, struct Multipart * part);
+
+    char                delim[MULTIPART_DELIM_MAX];
+    size_t              dlen;
+    unsigned char       skip[256];                          // BMH 跳转表, 按窗口最后一个字节跳过
+    char                hold[MULTIPART_DELIM_MAX];          // 上一段末尾可能是分隔符开头的字节
+    size_t              hold_len;
+    char                head[MULTIPART_HEAD_MAX];
+    size_t              head_len;
+    int                 bad;                                // 格式错误, 不是被 on_part / on_data / on_end 拒绝
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 从 Content-Type 中取出 boundary (可以带引号), 不是 multipart/form-data 或者 boundary 非法时返回 -1
+extern int multipart_boundary(const char * content_type, char * boundary, size_t size);
+
+// 默认 on_part / on_data / on_end 为 multipart_part_spool / multipart_data_store / multipart_part_end
+extern int multipart_init(multipart_t * mp, request_t * req, const char * boundary, size_t len);
+
+// 返回 len, 格式错误时返回 REQ_BODY_BAD, 被 on_part / on_data / on_end 拒绝时返回 REQ_BODY_REJECT
+extern long multipart_feed(multipart_t * mp, const char * data, size_t len);
+
+// body 结束时调用, 没有看到结束分隔符时返回 REQ_BODY_BAD
+extern int multipart_finish(multipart_t * mp);
+
+// part 的描述从 request 的内存块中分配, 记录到 req->multi 中
+extern struct Multipart * multipart_part_new(multipart_t * mp, const struct Multipart * head);
+
+// 和 multipart_part_new 一样, 但上传的文件 (带 filename) 写入临时文件
+extern struct Multipart * multipart_part_spool(multipart_t * mp, const struct Multipart * head);
+
+// 字段数据复制到 request 的内存块中, 最多 MULTI_PART_MAX; 有 fd 的 part 写入临时文件
+extern int multipart_data_store(multipart_t * mp, struct Multipart * part, const char * data, size_t len);
+
+// 整个 body 一次交给 multipart_feed 时使用, data 直接指向 body, 不复制
+extern int multipart_data_inplace(multipart_t * mp, struct Multipart * part, const char * data, size_t len);
+
+extern int multipart_part_end(multipart_t * mp, struct Multipart * part);
+
+// 流式 body 的消费者 (BodyFun): multipart 边收边解析, 字段放在内存中, 上传的文件写入临时文件,
+// 收完以后和一次读入的 body 一样通过 req->multi 访问; 不是 multipart 的 body 交给 body_spool
+extern req_body_sink_t * body_multipart(connection_tp conn, const request_t * req);
+
+#ifdef __cplusplus
+}		/* end of the 'extern "C"' block */
+#endif
+
+#endif // __MULTIPART_INCLUDE__
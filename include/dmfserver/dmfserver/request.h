@@ -25,89 +25,131 @@
 // #define REQUEST_DEBUG
 
 
-#define MULTI_PART_MAX 		1024*1024	// multipart 数据大小
+#define MULTI_PART_MAX 		(1024*1024)	// 留在内存中的 multipart 字段的最大长度, 写入临时文件的上传文件不受限制
 #define MULTI_PART_MAX_NUM 	20			// 最大multipart 数量
+#define REQ_ARENA_CHUNK		4096		// request 内存块的最小大小
 
 
 //******************  HTTP协议相关 *****************
-// 第一行
-#define HTTP_METHOD_MAX    5
-#define HTTP_URI_MAX       512
-#define HTTP_PROTOCOL_MAX  5
-#define HTTP_VERSION_MAX   4
-
+#define HTTP_HEADER_MAX			(1024*64)	// 请求行加头部的最大长度
 #define HTTP_BODY_MAX		 	1024*1024	// body 数据大小
+#define HTTP_HEADER_NUM			64			// 最多记录的头部数, 多出的忽略
+#define HTTP_QUERY_NUM			32			// 最多记录的 query 参数数
+#define HTTP_BODY_CHUNKED		(-1L)		// req_parse_head 的 body_len: Transfer-Encoding: chunked, 长度未知
 //******************  HTTP协议相关 *****************
 
-//******************  HTTP解析状态机 *****************
-
-typedef  enum _HTTP_PARSE_STATE {
-	PARSE_INVALID	,
-	PARSE_START  	,
-	PARSE_METHOD 	,
-
-	PARSE_PATH_START      ,
-	PARSE_PATH         ,
-
-	PARSE_QUERY_START  ,
-	PARSE_QUERY        ,
-	PARSE_QUERY_TEMP   ,
-
-	PARSE_PV_START     ,
-	PARSE_PV_TEMP      ,
-	PARSE_PV           ,
-
-	PARSE_PARAM_START  ,
-	PARSE_PARAM1		   ,
-	PARSE_PARAM2		   ,
-	PARSE_PARAM3		   ,
-	
-	PARSE_BODY_START  ,
-	PARSE_BODY
-
-} HTTP_PARSE_STATE ;
-
-//******************  HTTP解析状态机 *****************
-
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <openssl/ssl.h>
 
-#include <dmfserver/utility/dm_map.h>
-
 
 struct Multi_kv {
 	char 				key[32];
 	char 				data[64];
 };
 
+// data 在内存中时以 '\0' 结尾; 上传的文件写入临时文件时 data 为 NULL, 通过 fd 读取, 读写位置在文件开头
+// 这些都在请求结束时释放和关闭
 struct Multipart {
 	struct Multi_kv 	name;
 	struct Multi_kv 	dis;
 	struct Multi_kv 	filename;
+	struct Multi_kv 	type;		// Content-Type
 	char 		*		data;
-	int 				length;
+	size_t 				length;
+	int 				fd;
 };
 
+// request 自己的内存块链表, multipart 的描述和字段数据从这里分配, 请求结束时一起释放
+typedef struct _req_arena_t {
+	struct _req_arena_t *	next;
+	size_t 				used;
+	size_t 				cap;
+	char 				data[];
+} req_arena_t;
+
 struct http_body_t {
 	char 	*	body;
 	size_t 		length;
 };
 
-
+struct req;
+
+// 流式 body 的消费者, 由路由注册的工厂函数在头部到达时创建, 挂在 request 上, 具体的消费者把它作为第一个成员
+// on_data 返回接收的字节数, 可以少于 len, 剩下的留在读缓冲中以后再交给它, 这期间连接暂停读取;
+// 返回 REQ_BODY_REJECT (超过限制或者保存失败, 413) 或 REQ_BODY_BAD (body 格式错误, 400) 拒绝请求
+// on_end 在 body 全部交给 on_data 以后调用, 然后执行 view, 出错时返回值同上; on_free 在请求结束或连接关闭时调用
+#define REQ_BODY_REJECT		(-1)
+#define REQ_BODY_BAD		(-2)
+
+typedef struct _req_body_sink_t {
+	long		(*on_data)(struct _req_body_sink_t * sink, const char * data, size_t len);
+	int			(*on_end)(struct _req_body_sink_t * sink, struct req * req);
+	void		(*on_free)(struct _req_body_sink_t * sink);
+} req_body_sink_t;
+
+typedef enum _req_chunk_state_t {
+	REQ_CHUNK_NONE,				// 不是 chunked 编码
+	REQ_CHUNK_SIZE,				// chunk 长度 (十六进制)
+	REQ_CHUNK_EXT,				// 长度后面的 ;name=value 扩展, 不使用
+	REQ_CHUNK_SIZE_LF,
+	REQ_CHUNK_DATA,
+	REQ_CHUNK_DATA_CR,
+	REQ_CHUNK_DATA_LF,
+	REQ_CHUNK_TRAILER,			// 最后一个 chunk 之后的 trailer 行首, 或者结束的空行
+	REQ_CHUNK_TRAILER_LINE,		// trailer 丢弃, 只限制长度
+	REQ_CHUNK_END_LF,
+	REQ_CHUNK_DONE
+} req_chunk_state_t;
+
+// chunked 编码的 body 的解码状态, 数据可以在任意位置断开
+typedef struct _req_chunked_t {
+	req_chunk_state_t	state;
+	int				digits;
+	size_t			left;			// 当前 chunk 还没有交给消费者的字节数
+	size_t			total;			// 已经声明的 body 总长度
+	size_t			max;			// body 总长度上限, 0 表示不限制
+	size_t			meta;			// 扩展和 trailer 的字节数
+	size_t			meta_max;		// 0 表示不限制
+} req_chunked_t;
+
+// 请求中的一段, 相对于 req->data 的偏移和长度
+typedef struct _req_str_t {
+	unsigned int	off;
+	unsigned int	len;
+} req_str_t;
+
+// 一个头部或者 query 参数
+typedef struct _req_field_t {
+	req_str_t		key;
+	req_str_t		value;
+} req_field_t;
+
+
+// 解析结果都指向连接的读缓冲, 不复制也不分配内存, 只在处理这个请求期间有效
+// 解析时把每一段后面的分隔符 (空格, '?', '=', '&', ':', '\r') 改成 '\0', 这些段也可以直接当作字符串使用
 struct req {
-	char 			method		[ HTTP_METHOD_MAX  ];
-	char 			path		[ HTTP_URI_MAX     ];
-	char 			protocol	[ HTTP_PROTOCOL_MAX];
-	char 			version		[ HTTP_VERSION_MAX ];
-	hashmap_tp     query;
-	hashmap_tp     params;
+	char *			data;			// 请求的第一个字节
+	char *			method;
+	char *			path;
+	char *			protocol;
+	char *			version;
 	struct http_body_t 		body;
 
+	int				header_num;
+	int				query_num;
+	req_field_t		headers		[ HTTP_HEADER_NUM ];
+	req_field_t		queries		[ HTTP_QUERY_NUM ];
+
 	int 			multi_part_num;
 	struct Multipart * multi    [ MULTI_PART_MAX_NUM];
+	req_arena_t *	arena;
+
+	req_body_sink_t *	sink;		// 流式 body 的消费者, NULL 表示 body 整个到达以后复制到 body 中
+	size_t			head_len;		// 流式 body 时请求行加头部的长度, 头部一直留在读缓冲的开头
+	size_t			body_left;		// 还没有交给消费者的 body 字节数
+	req_chunked_t	chunked;		// chunked 编码的 body 不用 body_left, 由它解码以后交给消费者
 };
 
 typedef struct req request_t;
@@ -120,7 +162,27 @@ void req_parse_multi_part (request_t * request, char * boundary );
 
 void req_parse_init(request_t * request);
 
-void req_parse_http(request_t * request, char * data);
+void req_reset(request_t * request);
+
+int  req_keep_alive(const request_t * request);
+
+int  req_parse_http(request_t * request, char * data, size_t len);
+
+int  req_parse_check(const char * data, size_t len);
+
+int  req_parse_head(const char * data, size_t len, long * body_len);
+
+void req_rebase(request_t * request, char * data);
+
+void req_parse_body(request_t * request);
+
+void req_chunked_init(req_chunked_t * chunked, size_t max, size_t meta_max);
+
+long req_chunked_feed(req_chunked_t * chunked, const char * data, size_t len, req_body_sink_t * sink);
+
+void * req_arena_alloc(request_t * request, size_t size);
+
+char * req_arena_grow(request_t * request, char * p, size_t len, size_t add);
 
 void req_get_session_str(const request_t * req,  char session_str[]);
 
@@ -128,6 +190,10 @@ void req_get_param(const request_t * req, char * key, 	char data[]);
 
 void req_get_query(const request_t * req, char * key, 	char data[]);
 
+char * req_param(const request_t * req, const char * key);
+
+char * req_query(const request_t * req, const char * key);
+
 void req_get_ws_key(const request_t * req,  char ws_key[]);
 
 void req_free(request_t * req);
@@ -82,6 +82,14 @@ extern void res_parse_send( response_t* res);
 
 extern void res_notfound( connection_tp conn);
 
+extern void res_unavailable( connection_tp conn);
+
+extern void res_too_large( connection_tp conn);
+
+extern void res_bad_request( connection_tp conn);
+
+extern void res_not_implemented( connection_tp conn);
+
 extern void res_row(  connection_tp conn, char* res_str);
 
 extern void res_render( connection_tp conn, char* template_name, struct Kvmap *kv, int num);
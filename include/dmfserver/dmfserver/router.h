@@ -58,12 +58,17 @@ struct FileInfo {
 
 typedef void (*ContFun) (connection_tp conn, const request_t *req );
 
+// 头部到达时创建这个请求的 body 消费者, 返回 NULL 拒绝请求 (413)
+typedef req_body_sink_t * (*BodyFun) (connection_tp conn, const request_t *req );
+
 #define RouterAdd(name) void name()
 
 typedef struct _ContFunMap {
 	
 	ContFun cf[ ContFunNUM ];
 	char* keys[ ContFunNUM ];
+	char blocking[ ContFunNUM ];	// 1 表示 view 会阻塞 (数据库查询等), 交给线程池执行
+	BodyFun bf[ ContFunNUM ];		// 非 NULL 时 body 边到达边交给它创建的消费者, 不在内存中攒成一整块
 	int curr_num;
 	
 } ctl_fun_map_t;
@@ -82,6 +87,10 @@ extern void router_init();
 
 extern void router_handle(connection_tp conn, request_t *req);
 
+extern int router_blocking(const request_t *req);
+
+extern BodyFun router_body(const char *path, size_t len);
+
 static int search_local_file(char* local_paths[]);
 
 static void traverse_directory(const char *path, struct FileInfo file_list[], int *num_files);
@@ -90,6 +99,10 @@ static char* get_content_type(char *file_ext);
 
 extern void router_add_app(ContFun cf[], char* keys[], const char* name);
 
+extern void router_add_app_blocking(ContFun cf[], char* keys[], const char* name);
+
+extern void router_add_app_body(ContFun cf[], BodyFun bf[], char* keys[], const char* name);
+
 #ifdef __cplusplus
 }		/* end of the 'extern "C"' block */
 #endif
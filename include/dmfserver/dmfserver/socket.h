@@ -53,8 +53,10 @@ extern "C" {
 #endif
 
 	extern int create_socket();
-    extern int createSocket();
-    extern int create_socket_reuse();
+#ifdef __linux__
+    extern int socket_listen(const conf_listener *ls, int reuseport);
+    extern int socket_listen_is(int fd, const conf_listener *ls);
+#endif
 
 #ifdef __WIN32__
 
@@ -0,0 +1,77 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __TLS_INCLUDE__
+#define __TLS_INCLUDE__
+
+#include <dmfserver/conf/conf.h>
+#include <dmfserver/connection.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_IO_AGAIN    -2          // 需要等待 socket 可读或可写以后重试
+
+// OpenSSL 3.0 以后才有 SSL_sendfile, 并且编译时没有关掉 ktls
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define TLS_HAVE_KTLS
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 按配置中的证书建立服务端 SSL_CTX, 失败时返回 NULL
+// linux 下会话缓存和 ticket 密钥在第一次调用时放进共享内存, 要在 fork worker 之前调用
+extern SSL_CTX *
+tls_ctx_create ();
+
+// 为新连接建立 SSL 对象, 握手在之后的可读可写事件中完成
+extern int
+tls_accept (connection_tp conn, SSL_CTX * ctx);
+
+// 推进非阻塞握手: 1 完成, 0 等待 socket, -1 失败
+extern int
+tls_handshake (connection_tp conn);
+
+// 读写解密后的数据: >0 字节数, 0 对端关闭 (只有读), TLS_IO_AGAIN 等待 socket, -1 出错
+extern int
+tls_recv (connection_tp conn, char * buf, size_t len);
+
+extern int
+tls_send (connection_tp conn, const char * buf, size_t len);
+
+// 发送方向是否已经交给内核 TLS (需要配置 ktls)
+extern int
+tls_ktls_send (connection_tp conn);
+
+// 内核 TLS 下直接从文件发送, 不经过用户态
+extern int
+tls_sendfile (connection_tp conn, int fd, size_t offset, size_t len);
+
+extern void
+tls_shutdown (connection_tp conn);
+
+extern void
+tls_free (connection_tp conn);
+
+#ifdef __cplusplus
+}		/* end of the 'extern "C"' block */
+#endif
+
+#endif // __TLS_INCLUDE__
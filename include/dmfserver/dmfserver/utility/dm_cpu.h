@@ -0,0 +1,61 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __DM_CPU_INCLUDE__
+#define __DM_CPU_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// cpu 列表和线程绑定, 只在 linux 下生效, 其他平台上绑定函数返回 -1
+// 线程先绑定到 cpu 再分配内存: 页面在第一次写入时按线程所在的 NUMA 节点分配,
+// 绑定时同时把线程的内存策略设为优先本地节点, 不受 numactl --interleave 之类的继承策略影响
+
+#define DM_CPU_MAX  1024
+
+typedef struct dm_cpu_set_t {
+    int     num;
+    int     cpus[DM_CPU_MAX];       // 升序, 不重复
+} dm_cpu_set_t;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // 解析 "0-7,16,18-19" 这样的列表; 空串或 NULL 表示进程当前可以使用的所有 cpu
+    int     dm_cpu_parse(const char *list, dm_cpu_set_t *set);
+
+    // 从 set 中去掉 other 里的 cpu
+    void    dm_cpu_exclude(dm_cpu_set_t *set, const dm_cpu_set_t *other);
+
+    // cpu 所在的 NUMA 节点, 不知道时返回 0
+    int     dm_cpu_node(int cpu);
+
+    // 把当前线程绑定到一个 cpu, 内存优先从这个 cpu 的节点分配
+    int     dm_cpu_bind_thread(int cpu);
+
+    // 把当前线程绑定到一组 cpu, 在组内可以迁移
+    int     dm_cpu_bind_thread_set(const dm_cpu_set_t *set);
+
+#ifdef __cplusplus
+}           /* end of the 'extern "C"' block */
+#endif
+
+
+#endif // __DM_CPU_INCLUDE__
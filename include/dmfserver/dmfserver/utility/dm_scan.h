@@ -0,0 +1,44 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __DM_SCAN_INCLUDE__
+#define __DM_SCAN_INCLUDE__
+
+#include <stddef.h>
+
+// 在一段内存中找第一个属于给定字符集合的字节, 请求解析用它查找分隔符
+// x86 上运行时按 cpu 支持选择 AVX2 (每次 32 字节) 或 SSE4.2 pcmpestri (每次 16 字节), 否则逐字节比较
+
+#define DM_SCAN_SET_MAX     8       // 集合中最多的字符数
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // 返回 [p, end) 中第一个属于 set (set_len 个字符) 的字节, 没有时返回 end
+    const char *    dm_scan(const char *p, const char *end, const char *set, int set_len);
+
+    // 当前使用的实现: "avx2", "sse4.2" 或 "scalar"
+    const char *    dm_scan_impl();
+
+#ifdef __cplusplus
+}           /* end of the 'extern "C"' block */
+#endif
+
+
+#endif // __DM_SCAN_INCLUDE__
@@ -27,6 +27,8 @@
 #include <sys/time.h>
 #include <stdbool.h>
 
+#include <dmfserver/utility/dm_cpu.h>
+
 #ifdef _WIN32
 	#include <windows.h>
 #else
@@ -69,6 +71,7 @@ typedef struct thread_pool_t {
 	
     int 				thread_count;
     bool 				shutdown;
+    dm_cpu_set_t*		cpus;				// 工作线程绑定的 cpu, NULL 表示不绑定
 	
 } thread_pool_t;
 
@@ -80,6 +83,7 @@ static void			sleep_microseconds(int microseconds);
 void* 				thread_func(void *arg);
 void 				thread_pool_destroy(thread_pool_t *pool);
 thread_pool_t*		thread_pool_create(int thread_count);
+thread_pool_t*		thread_pool_create_bind(int thread_count, const dm_cpu_set_t *cpus);
 int 				thread_pool_add_task(thread_pool_t *pool, void (*func)(void*), void *arg);
 //int 				add_timer(thread_pool_t *pool, int seconds, void (func)(void), void *arg);
 int 				is_thread_pool_empty(thread_pool_t *pool);
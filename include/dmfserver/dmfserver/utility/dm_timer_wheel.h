@@ -0,0 +1,69 @@
+/* 
+    *  Copyright 2023 Ajax
+    *
+    *  Licensed under the Apache License, Version 2.0 (the "License");
+    *  you may not use this file except in compliance with the License.
+    *
+    *  You may obtain a copy of the License at
+    *
+    *    http://www.apache.org/licenses/LICENSE-2.0
+    *    
+    *  Unless required by applicable law or agreed to in writing, software
+    *  distributed under the License is distributed on an "AS IS" BASIS,
+    *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    *  See the License for the specific language governing permissions and
+    *  limitations under the License. 
+    *
+    */
+
+#ifndef __DM_TIMER_WHEEL_INCLUDE__
+#define __DM_TIMER_WHEEL_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// 哈希时间轮, 单线程使用 (每个 reactor 一个)
+// 定时器节点嵌入在使用者的结构体中, 添加, 重新设置, 删除都是 O(1)
+// 超过一圈的定时器留在槽中, 轮到时比较到期 tick, 没有到期就跳过
+
+typedef struct dm_timer_node_t {
+    struct dm_timer_node_t *prev;
+    struct dm_timer_node_t *next;
+    unsigned long long      expire;     // 到期的 tick
+    void                  (*callback)(struct dm_timer_node_t *node);
+    void                   *data;
+} dm_timer_node_t;
+
+typedef struct dm_timer_wheel_t {
+    dm_timer_node_t        *slots;      // 每个槽是带头结点的双向循环链表
+    size_t                  slot_mask;  // 槽数 - 1, 槽数是 2 的幂
+    unsigned int            tick_ms;    // 一个 tick 的毫秒数
+    unsigned long long      current;    // 已经处理到的 tick
+    size_t                  count;      // 时间轮中的定时器个数
+} dm_timer_wheel_t;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    unsigned long long  dm_timer_now_ms();
+    unsigned long long  dm_timer_now_us();
+
+    int     dm_timer_wheel_init(dm_timer_wheel_t *wheel, size_t slot_num, unsigned int tick_ms);
+    void    dm_timer_wheel_destroy(dm_timer_wheel_t *wheel);
+
+    void    dm_timer_node_init(dm_timer_node_t *node, void (*callback)(dm_timer_node_t *), void *data);
+    void    dm_timer_add(dm_timer_wheel_t *wheel, dm_timer_node_t *node, unsigned int timeout_ms);
+    void    dm_timer_del(dm_timer_wheel_t *wheel, dm_timer_node_t *node);
+    int     dm_timer_pending(const dm_timer_node_t *node);
+
+    int     dm_timer_wheel_expire(dm_timer_wheel_t *wheel);
+    int     dm_timer_wheel_timeout(const dm_timer_wheel_t *wheel);
+
+#ifdef __cplusplus
+}           /* end of the 'extern "C"' block */
+#endif
+
+
+#endif // __DM_TIMER_WHEEL_INCLUDE__
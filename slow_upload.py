@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# 慢速的 chunked 上传: 每秒发送一个 chunk, 总时间超过 header_timeout 和 body_timeout 的单次间隔,
+# 检查流式 body 的请求在数据不断到达时不会被超时关闭
+# 用法: python3 slow_upload.py [秒数] [端口] [路径]
+# 路径要用 router_add_app_body 注册, 例如 testviews 中的 /other/upload
+
+import socket
+import sys
+import time
+
+
+def main():
+	seconds = int(sys.argv[1]) if len(sys.argv) > 1 else 15
+	port = int(sys.argv[2]) if len(sys.argv) > 2 else 80
+	path = sys.argv[3] if len(sys.argv) > 3 else '/other/upload'
+
+	s = socket.create_connection(('127.0.0.1', port))
+	s.sendall(('POST %s HTTP/1.1\r\nHost: localhost\r\n'
+			'Transfer-Encoding: chunked\r\n\r\n' % path).encode())
+
+	chunk = b'x' * 1000
+	sent = 0
+	start = time.time()
+	while time.time() - start < seconds:
+		try:
+			s.sendall(b'%x\r\n' % len(chunk) + chunk + b'\r\n')
+		except OSError as e:
+			print('FAIL: connection closed after %.1fs: %s' % (time.time() - start, e))
+			return 1
+		sent += len(chunk)
+		time.sleep(1)
+	s.sendall(b'0\r\n\r\n')
+
+	s.settimeout(10)
+	res = b''
+	while True:
+		head, sep, body = res.partition(b'\r\n\r\n')
+		if sep and b'Content-Length: ' in head:
+			length = int(head.split(b'Content-Length: ')[1].split(b'\r\n')[0])
+			if len(body) >= length:
+				break
+		data = s.recv(65536)
+		if not data:
+			break
+		res += data
+	s.close()
+
+	expect = ('upload ok: %d bytes' % sent).encode()
+	if res.startswith(b'HTTP/1.1 200') and expect in res:
+		print('OK: %d bytes in %.1fs' % (sent, time.time() - start))
+		return 0
+	print('FAIL: %r' % res[:200])
+	return 1
+
+
+if __name__ == '__main__':
+	sys.exit(main())